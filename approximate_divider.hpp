@@ -2,5 +2,6 @@
 
 #include <stdint.h>
 
-void setup_fixed_divider();
+// Prints the table as GLSL by default, for use in shaders.
+void setup_fixed_divider(bool print_glsl_table = true);
 int32_t fixed_divider(int32_t x, uint32_t y, unsigned add_bits);
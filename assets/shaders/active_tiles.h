@@ -0,0 +1,44 @@
+#ifndef ACTIVE_TILES_H_
+#define ACTIVE_TILES_H_
+
+// List of tiles which had any primitive binned in the current flush.
+// Starts with the indirect dispatch arguments for ROP, one workgroup per tile.
+// Tile coordinates are packed as 16:16.
+
+#ifndef ACTIVE_TILE_LIST
+#define ACTIVE_TILE_LIST 0
+#endif
+
+#if ACTIVE_TILE_LIST
+layout(std430, set = 0, binding = ACTIVE_TILES_BUFFER) ACTIVE_TILES_QUALIFIER buffer ActiveTiles
+{
+    uvec4 rop_dispatch;
+    uint active_tiles[];
+};
+
+ivec2 get_active_tile(uint index)
+{
+    uint packed_tile = active_tiles[index];
+    return ivec2(packed_tile & 0xffffu, packed_tile >> 16u);
+}
+
+#ifdef ACTIVE_TILE_GENERATION_BUFFER
+// Last flush generation a tile was appended in, so every tile is only appended once.
+layout(std430, set = 0, binding = ACTIVE_TILE_GENERATION_BUFFER) buffer ActiveTileGeneration
+{
+    uint active_tile_generation[];
+};
+
+void mark_tile_active(ivec2 tile, int linear_tile)
+{
+    uint generation = fb_info.active_tile_generation;
+    if (atomicExchange(active_tile_generation[linear_tile], generation) != generation)
+    {
+        uint index = atomicAdd(rop_dispatch.x, 1u);
+        active_tiles[index] = uint(tile.x) | (uint(tile.y) << 16u);
+    }
+}
+#endif
+#endif
+
+#endif
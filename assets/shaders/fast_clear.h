@@ -0,0 +1,33 @@
+#ifndef FAST_CLEAR_H_
+#define FAST_CLEAR_H_
+
+// Clears only tag tiles with the current clear generation.
+// Whoever visits the tile first is responsible for writing out the clear value and resetting the tag.
+
+#include "constants.h"
+#include "fb_info.h"
+
+layout(std430, set = 0, binding = FAST_CLEAR_BUFFER) buffer FastClear
+{
+    uint fast_clear_flags[];
+};
+
+bool tile_has_fast_clear_color(int linear_tile)
+{
+    return fast_clear_flags[linear_tile] == fb_info.color_clear_generation;
+}
+
+bool tile_has_fast_clear_depth(int linear_tile)
+{
+    return fast_clear_flags[MAX_TILES_X * MAX_TILES_Y + linear_tile] == fb_info.depth_clear_generation;
+}
+
+void reset_fast_clear(int linear_tile, bool color, bool depth)
+{
+    if (color)
+        fast_clear_flags[linear_tile] = 0u;
+    if (depth)
+        fast_clear_flags[MAX_TILES_X * MAX_TILES_Y + linear_tile] = 0u;
+}
+
+#endif
\ No newline at end of file
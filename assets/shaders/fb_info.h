@@ -5,9 +5,6 @@ layout(set = 2, binding = 0, std140) uniform FBInfo
 {
 	uvec2 resolution;
 	uvec2 resolution_tiles;
-	int primitive_count;
-	int primitive_count_32;
-	int primitive_count_1024;
 
 	int color_offset;
 	int color_width;
@@ -17,6 +14,37 @@ layout(set = 2, binding = 0, std140) uniform FBInfo
 	int depth_width;
 	int depth_height;
 	int depth_stride;
+
+	int hiz_cull;
+
+	uint color_clear_value;
+	uint depth_clear_value;
+	uint color_clear_generation;
+	uint depth_clear_generation;
+
+	uint active_tile_generation;
+
+	// A batch can render to several targets, ROP runs once per target over its range of primitives.
+	int primitive_begin;
+	int primitive_end;
 } fb_info;
 
+// Bits of the binning mask word mask_index which belong to the current target.
+uint get_framebuffer_primitive_mask(int mask_index)
+{
+	int lo = clamp(fb_info.primitive_begin - 32 * mask_index, 0, 32);
+	int hi = clamp(fb_info.primitive_end - 32 * mask_index, 0, 32);
+	uint below_lo = lo == 32 ? ~0u : ((1u << uint(lo)) - 1u);
+	uint below_hi = hi == 32 ? ~0u : ((1u << uint(hi)) - 1u);
+	return below_hi & ~below_lo;
+}
+
+// Separate from FBInfo, since GPU triangle setup only knows the primitive count on the GPU, see primitive_offsets.comp.
+layout(set = 2, binding = 1, std140) uniform PrimitiveCounts
+{
+	int primitive_count;
+	int primitive_count_32;
+	int primitive_count_1024;
+} primitive_counts;
+
 #endif
\ No newline at end of file
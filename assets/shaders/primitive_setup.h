@@ -24,4 +24,27 @@ struct PrimitiveSetupAttr
 	i16vec2 uv_offset;
 };
 
+// Compact encoding of PrimitiveSetupAttr, see primitive_packing.cpp.
+// UV and W are snorm16 with a separate scale each, only the ratio of the scales is stored.
+// Barycentric gradients are snorm16 relative to exp2(gradient_exponent).
+#ifndef PACKED_ATTRIBUTES
+#define PACKED_ATTRIBUTES 0
+#endif
+
+struct PrimitiveSetupAttrPacked
+{
+	float z, dzdx, dzdy;
+	float uv_scale;
+	i16vec2 bary_dx;
+	i16vec2 bary_dy;
+	i16vec2 uv_offset;
+	int16_t u[3];
+	int16_t v[3];
+	int16_t w[3];
+	int16_t gradient_exponent;
+	u8vec4 color_a;
+	u8vec4 color_b;
+	u8vec4 color_c;
+};
+
 #endif
\ No newline at end of file
@@ -25,7 +25,11 @@ layout(std430, set = 0, binding = PRIMITIVE_SETUP_POS_BUFFER) readonly buffer Tr
 #ifdef PRIMITIVE_SETUP_ATTR_BUFFER
 layout(std430, set = 0, binding = PRIMITIVE_SETUP_ATTR_BUFFER) readonly buffer TriangleSetupAttr
 {
+#if PACKED_ATTRIBUTES
+    PrimitiveSetupAttrPacked primitives_attr[];
+#else
     PrimitiveSetupAttr primitives_attr[];
+#endif
 };
 #endif
 
@@ -42,8 +46,16 @@ vec3 interpolate_barycentrics(uint primitive_index, int x, int y, ivec2 interpol
 {
     float dx = float((x << SUBPIXELS_LOG2) - interpolation_base.x);
     float dy = float((y << SUBPIXELS_LOG2) - interpolation_base.y);
+#if PACKED_ATTRIBUTES
+    float gradient_scale = ldexp(1.0, int(primitives_attr[primitive_index].gradient_exponent)) * (1.0 / float(0x7fff));
+    vec2 bary_dx = vec2(ivec2(primitives_attr[primitive_index].bary_dx)) * gradient_scale;
+    vec2 bary_dy = vec2(ivec2(primitives_attr[primitive_index].bary_dy)) * gradient_scale;
+    float j = bary_dx.x * dx + bary_dy.x * dy;
+    float k = bary_dx.y * dx + bary_dy.y * dy;
+#else
     float j = primitives_attr[primitive_index].djdx * dx + primitives_attr[primitive_index].djdy * dy;
     float k = primitives_attr[primitive_index].dkdx * dx + primitives_attr[primitive_index].dkdy * dy;
+#endif
     float i = 1.0 - j - k;
     return vec3(i, j, k);
 }
@@ -52,10 +64,26 @@ vec3 interpolate_barycentrics(uint primitive_index, int x, int y, ivec2 interpol
 #ifdef PRIMITIVE_SETUP_ATTR_BUFFER
 vec2 interpolate_uv(uint primitive_index, vec3 bary)
 {
+#if PACKED_ATTRIBUTES
+    vec3 attr_u = vec3(int(primitives_attr[primitive_index].u[0]),
+                       int(primitives_attr[primitive_index].u[1]),
+                       int(primitives_attr[primitive_index].u[2]));
+    vec3 attr_v = vec3(int(primitives_attr[primitive_index].v[0]),
+                       int(primitives_attr[primitive_index].v[1]),
+                       int(primitives_attr[primitive_index].v[2]));
+    vec3 attr_w = vec3(int(primitives_attr[primitive_index].w[0]),
+                       int(primitives_attr[primitive_index].w[1]),
+                       int(primitives_attr[primitive_index].w[2]));
+    float u = dot(attr_u, bary) * primitives_attr[primitive_index].uv_scale;
+    float v = dot(attr_v, bary) * primitives_attr[primitive_index].uv_scale;
+    float w = dot(attr_w, bary);
+    w = max(w, 0.00001);
+#else
     float u = dot(primitives_attr[primitive_index].u, bary);
     float v = dot(primitives_attr[primitive_index].v, bary);
     float w = dot(primitives_attr[primitive_index].w, bary);
     w = max(w, 0.00001);
+#endif
     return (vec2(u, v) / w) + vec2(ivec2(primitives_attr[primitive_index].uv_offset));
 }
 #endif
@@ -207,4 +235,30 @@ uint interpolate_z(uint primitive_index, int x, int y, ivec2 interpolation_base)
 }
 #endif
 
+#if defined(PRIMITIVE_SETUP_POS_BUFFER) && defined(PRIMITIVE_SETUP_ATTR_BUFFER)
+// Conservative lower bound for interpolate_z() over pixels in [start, end) covered by the primitive.
+// Depth is planar, so the minimum over a rectangle is found in one of its corners.
+uint compute_min_z(uint primitive_index, ivec2 start, ivec2 end)
+{
+    start.y = max(start.y, (int(primitives_pos[primitive_index].y_lo) + ((1 << SUBPIXELS_LOG2) - 1)) >> SUBPIXELS_LOG2);
+    end.y = min(end.y, ((int(primitives_pos[primitive_index].y_hi) - 1) >> SUBPIXELS_LOG2) + 1);
+    end.y = max(end.y, start.y + 1);
+
+    ivec2 interpolation_base = get_interpolation_base(primitive_index);
+    vec2 d_lo = vec2((start << SUBPIXELS_LOG2) - interpolation_base);
+    vec2 d_hi = vec2(((end - 1) << SUBPIXELS_LOG2) - interpolation_base);
+
+    float z = primitives_attr[primitive_index].z;
+    float dzdx = primitives_attr[primitive_index].dzdx;
+    float dzdy = primitives_attr[primitive_index].dzdy;
+    float dx = min(dzdx * d_lo.x, dzdx * d_hi.x);
+    float dy = min(dzdy * d_lo.y, dzdy * d_hi.y);
+
+    // Account for rounding differences against evaluating the plane per pixel.
+    float error = (abs(z) + abs(dx) + abs(dy)) * (1.0 / 1048576.0);
+    float fz = z + dx + dy - error;
+    return uint(clamp(floor(float(0xffff) * fz), 0.0, float(0xffff)));
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -3,6 +3,20 @@
 
 #include "constants.h"
 
+#define ROP_Z_ALWAYS 0u
+#define ROP_Z_LE 1u
+#define ROP_Z_LEQ 2u
+#define ROP_Z_GE 3u
+#define ROP_Z_GEQ 4u
+#define ROP_Z_EQ 5u
+#define ROP_Z_NEQ 6u
+#define ROP_Z_NEVER 7u
+
+#define ROP_BLEND_REPLACE 0u
+#define ROP_BLEND_ADDITIVE 1u
+#define ROP_BLEND_ALPHA 2u
+#define ROP_BLEND_SUBTRACT 3u
+
 layout(std430, set = 0, binding = RENDER_STATE_INDEX_BUFFER) uniform ROPStateIndex
 {
 	uint16_t render_state_indices[MAX_PRIMITIVES];
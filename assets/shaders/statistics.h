@@ -0,0 +1,39 @@
+#ifndef STATISTICS_H_
+#define STATISTICS_H_
+
+// Optional pipeline statistics. Counters are accumulated with atomics and read back by the host.
+// Everything compiles away unless STATISTICS is defined to non-zero.
+
+#ifndef STATISTICS
+#define STATISTICS 0
+#endif
+
+#if STATISTICS
+layout(std430, set = 0, binding = STATISTICS_BUFFER) buffer PipelineStatistics
+{
+    uint primitives_binned;
+    uint tile_instances;
+    uint tiles_with_primitives;
+    uint max_primitives_per_tile;
+    uint fragments_shaded;
+    uint fragments_depth_passed;
+    uint fragments_blended;
+    uint statistics_padding;
+} statistics;
+
+#define STATISTICS_ADD(counter, value) atomicAdd(statistics.counter, value)
+
+// Called from divergent control flow for every invocation which produces a fragment.
+void statistics_count_fragment_shaded()
+{
+#if SUBGROUP
+    uvec4 ballot = subgroupBallot(true);
+    if (subgroupElect())
+        STATISTICS_ADD(fragments_shaded, subgroupBallotBitCount(ballot));
+#else
+    STATISTICS_ADD(fragments_shaded, 1u);
+#endif
+}
+#endif
+
+#endif
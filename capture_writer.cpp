@@ -0,0 +1,245 @@
+#include "capture_writer.hpp"
+#include <string.h>
+#include <algorithm>
+
+namespace RetroWarp
+{
+CaptureWriter::CaptureWriter(size_t chunk_size_, unsigned max_chunks_)
+	: chunk_size(chunk_size_), max_chunks(max_chunks_)
+{
+	worker = std::thread(&CaptureWriter::thread_main, this);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	if (file_open)
+		end_file();
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		shutdown = true;
+	}
+	cond.notify_all();
+	worker.join();
+}
+
+void CaptureWriter::queue_job(Job job)
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		jobs_in_flight++;
+		jobs.push_back(std::move(job));
+	}
+	cond.notify_all();
+}
+
+void CaptureWriter::queue_current_chunk()
+{
+	if (current.empty())
+		return;
+
+	Job job;
+	job.type = JobType::Write;
+	job.chunk.swap(current);
+	queue_job(std::move(job));
+}
+
+bool CaptureWriter::acquire_chunk()
+{
+	std::lock_guard<std::mutex> holder{lock};
+	if (!chunk_pool.empty())
+	{
+		current = std::move(chunk_pool.back());
+		chunk_pool.pop_back();
+		return true;
+	}
+
+	if (allocated_chunks < max_chunks)
+	{
+		allocated_chunks++;
+		current.reserve(chunk_size);
+		return true;
+	}
+
+	overflow = true;
+	return false;
+}
+
+bool CaptureWriter::begin_file(const std::string &path)
+{
+	if (file_open)
+		end_file();
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		overflow = false;
+	}
+
+	Job job;
+	job.type = JobType::Open;
+	job.path = path;
+	queue_job(std::move(job));
+	file_open = true;
+	return true;
+}
+
+bool CaptureWriter::append(const void *data, size_t size)
+{
+	if (!file_open || overflowed())
+		return false;
+
+	auto *bytes = static_cast<const uint8_t *>(data);
+	while (size)
+	{
+		if (current.size() == current.capacity())
+		{
+			queue_current_chunk();
+			if (!acquire_chunk())
+			{
+				// Give up on the file, the I/O thread deletes what was written of it.
+				Job job;
+				job.type = JobType::Close;
+				job.truncated = true;
+				queue_job(std::move(job));
+				file_open = false;
+				return false;
+			}
+		}
+
+		size_t to_copy = std::min(size, current.capacity() - current.size());
+		current.insert(current.end(), bytes, bytes + to_copy);
+		bytes += to_copy;
+		size -= to_copy;
+	}
+
+	return true;
+}
+
+bool CaptureWriter::end_file(std::function<bool (FILE *)> finalize)
+{
+	if (!file_open)
+		return false;
+
+	queue_current_chunk();
+
+	Job job;
+	job.type = JobType::Close;
+	job.finalize = std::move(finalize);
+	queue_job(std::move(job));
+	file_open = false;
+	return !overflowed();
+}
+
+void CaptureWriter::submit(std::function<bool ()> func)
+{
+	Job job;
+	job.type = JobType::Func;
+	job.func = std::move(func);
+	queue_job(std::move(job));
+}
+
+void CaptureWriter::wait_idle()
+{
+	std::unique_lock<std::mutex> holder{lock};
+	cond.wait(holder, [this]() { return jobs_in_flight == 0; });
+}
+
+bool CaptureWriter::overflowed() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return overflow;
+}
+
+unsigned CaptureWriter::get_written_files() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return written_files;
+}
+
+unsigned CaptureWriter::get_failed_jobs() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return failed_jobs;
+}
+
+uint64_t CaptureWriter::get_written_bytes() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return written_bytes;
+}
+
+bool CaptureWriter::run_job(Job &job)
+{
+	switch (job.type)
+	{
+	case JobType::Open:
+		file = fopen(job.path.c_str(), "wb");
+		file_path = job.path;
+		file_failed = file == nullptr;
+		return true;
+
+	case JobType::Write:
+		if (!file_failed && fwrite(job.chunk.data(), job.chunk.size(), 1, file) != 1)
+			file_failed = true;
+		// Failures are reported once the file is closed.
+		return true;
+
+	case JobType::Close:
+	{
+		bool ok = !file_failed && !job.truncated;
+		if (ok && job.finalize)
+			ok = job.finalize(file);
+		if (file && fclose(file) != 0)
+			ok = false;
+		// Don't leave incomplete files behind which look like valid captures.
+		if (file && !ok)
+			remove(file_path.c_str());
+		file = nullptr;
+		file_path.clear();
+		file_failed = false;
+		return ok;
+	}
+
+	case JobType::Func:
+		return job.func();
+	}
+
+	return false;
+}
+
+void CaptureWriter::thread_main()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			cond.wait(holder, [this]() { return shutdown || !jobs.empty(); });
+			// Drain everything before shutting down.
+			if (jobs.empty())
+				break;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		bool ok = run_job(job);
+
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			if (job.type == JobType::Write)
+			{
+				written_bytes += job.chunk.size();
+				job.chunk.clear();
+				chunk_pool.push_back(std::move(job.chunk));
+			}
+			else if (job.type == JobType::Close && ok)
+				written_files++;
+
+			if (!ok)
+				failed_jobs++;
+			jobs_in_flight--;
+		}
+		cond.notify_all();
+	}
+}
+}
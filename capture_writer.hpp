@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace RetroWarp
+{
+// Moves file I/O for captures off the render thread.
+// The render thread appends file data to an arena of fixed-size chunks. Every full chunk is handed to an I/O thread,
+// which writes chunks to their file in order. Written chunks are recycled, so in steady state, capturing does not allocate.
+// The render thread never waits for I/O. Memory is bounded by max_chunks: if the disk cannot keep up and every chunk
+// is in flight, the writer overflows. The file being written is then abandoned, and the I/O thread deletes it rather
+// than leaving an incomplete file behind, see overflowed(). The next begin_file() starts over.
+class CaptureWriter
+{
+public:
+	explicit CaptureWriter(size_t chunk_size = 4 * 1024 * 1024, unsigned max_chunks = 64);
+	~CaptureWriter();
+
+	CaptureWriter(const CaptureWriter &) = delete;
+	void operator=(const CaptureWriter &) = delete;
+
+	// Data appended until end_file() goes to path. append() and end_file() return false once the file has overflowed.
+	bool begin_file(const std::string &path);
+	bool append(const void *data, size_t size);
+	// finalize runs on the I/O thread once all data is written, before the file is closed, e.g. to patch a header.
+	bool end_file(std::function<bool (FILE *)> finalize = {});
+
+	// Runs arbitrary I/O on the writer thread, in submission order with file data. Returns false on failure.
+	void submit(std::function<bool ()> job);
+
+	// Blocks until all submitted work has completed. Only a partially filled chunk of an unfinished file is kept back.
+	void wait_idle();
+
+	// True if the last file begun ran out of chunks. Cleared by begin_file().
+	bool overflowed() const;
+	unsigned get_written_files() const;
+	unsigned get_failed_jobs() const;
+	uint64_t get_written_bytes() const;
+
+private:
+	enum class JobType
+	{
+		Open,
+		Write,
+		Close,
+		Func
+	};
+
+	struct Job
+	{
+		JobType type;
+		std::string path;
+		std::vector<uint8_t> chunk;
+		std::function<bool (FILE *)> finalize;
+		std::function<bool ()> func;
+		// Set when closing a file because of an overflow.
+		bool truncated = false;
+	};
+
+	std::thread worker;
+	mutable std::mutex lock;
+	std::condition_variable cond;
+	std::deque<Job> jobs;
+	std::vector<std::vector<uint8_t>> chunk_pool;
+	size_t chunk_size;
+	unsigned max_chunks;
+	unsigned allocated_chunks = 0;
+	unsigned jobs_in_flight = 0;
+	unsigned written_files = 0;
+	unsigned failed_jobs = 0;
+	uint64_t written_bytes = 0;
+	bool overflow = false;
+	bool shutdown = false;
+
+	// Render thread only, the chunk being filled. Zero capacity if no chunk is held.
+	std::vector<uint8_t> current;
+	bool file_open = false;
+
+	// Only used from the I/O thread.
+	FILE *file = nullptr;
+	std::string file_path;
+	bool file_failed = false;
+
+	void queue_job(Job job);
+	void queue_current_chunk();
+	bool acquire_chunk();
+	bool run_job(Job &job);
+	void thread_main();
+};
+}
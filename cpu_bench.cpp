@@ -0,0 +1,369 @@
+#include "triangle_converter.hpp"
+#include "rasterizer_cpu.hpp"
+#include "approximate_divider.hpp"
+#include "canvas.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+// Benchmarks the CPU front end on synthetic meshes, without any dependency on Vulkan or Granite.
+
+using namespace RetroWarp;
+
+struct Mesh
+{
+	const char *name;
+	const char *description;
+	CullMode cull_mode;
+	std::vector<Vertex> vertices;
+};
+
+static Vertex make_vertex(float x, float y, float z, float w, float u, float v)
+{
+	Vertex vert = {};
+	vert.x = x;
+	vert.y = y;
+	vert.z = z;
+	vert.w = w;
+	vert.u = u;
+	vert.v = v;
+	for (auto &c : vert.color)
+		c = 1.0f;
+	return vert;
+}
+
+static void add_triangle(Mesh &mesh, const Vertex &a, const Vertex &b, const Vertex &c)
+{
+	mesh.vertices.push_back(a);
+	mesh.vertices.push_back(b);
+	mesh.vertices.push_back(c);
+}
+
+// Quads in NDC, wound so their signed area is positive after the viewport transform.
+static void add_grid(Mesh &mesh, unsigned cells_x, unsigned cells_y)
+{
+	for (unsigned y = 0; y < cells_y; y++)
+	{
+		for (unsigned x = 0; x < cells_x; x++)
+		{
+			float x0 = -1.0f + 2.0f * float(x) / float(cells_x);
+			float x1 = -1.0f + 2.0f * float(x + 1) / float(cells_x);
+			float y0 = -1.0f + 2.0f * float(y) / float(cells_y);
+			float y1 = -1.0f + 2.0f * float(y + 1) / float(cells_y);
+			auto v00 = make_vertex(x0, y0, 0.5f, 1.0f, 0.0f, 0.0f);
+			auto v10 = make_vertex(x1, y0, 0.5f, 1.0f, 16.0f, 0.0f);
+			auto v01 = make_vertex(x0, y1, 0.5f, 1.0f, 0.0f, 16.0f);
+			auto v11 = make_vertex(x1, y1, 0.5f, 1.0f, 16.0f, 16.0f);
+			add_triangle(mesh, v00, v10, v01);
+			add_triangle(mesh, v10, v11, v01);
+		}
+	}
+}
+
+static std::vector<Mesh> create_meshes(unsigned width, unsigned height)
+{
+	std::vector<Mesh> meshes;
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	float pixel_x = 2.0f / float(width);
+	float pixel_y = 2.0f / float(height);
+
+	{
+		Mesh mesh = { "grid", "dense grid of 4x4 pixel quads", CullMode::CWOnly, {} };
+		add_grid(mesh, width / 4, height / 4);
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		Mesh mesh = { "culled", "same grid, every triangle back facing", CullMode::CCWOnly, {} };
+		add_grid(mesh, width / 4, height / 4);
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		// One or two vertices behind the eye, so triangles have to be clipped against W first.
+		Mesh mesh = { "near-plane", "triangles crossing the near plane", CullMode::None, {} };
+		for (unsigned i = 0; i < 1024; i++)
+		{
+			Vertex verts[3];
+			for (unsigned j = 0; j < 3; j++)
+			{
+				float w = j == 0 ? -0.5f - 0.5f * unit(rnd) * unit(rnd) : 0.75f + 0.5f * unit(rnd);
+				if (j == 2 && (i & 1))
+					w = -w;
+				verts[j] = make_vertex(unit(rnd) * w, unit(rnd) * w, 0.5f * w, w, 8.0f * unit(rnd), 8.0f * unit(rnd));
+			}
+			add_triangle(mesh, verts[0], verts[1], verts[2]);
+		}
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		// Vertices far outside the viewport, beyond the guard band, which forces X/Y clipping.
+		Mesh mesh = { "guard-band", "triangles extending past the guard band", CullMode::None, {} };
+		float extent = 8192.0f / float(std::min(width, height));
+		for (unsigned i = 0; i < 1024; i++)
+		{
+			Vertex verts[3];
+			for (unsigned j = 0; j < 3; j++)
+				verts[j] = make_vertex(unit(rnd) * extent, unit(rnd) * extent, 0.5f, 1.0f, 8.0f * unit(rnd), 8.0f * unit(rnd));
+			add_triangle(mesh, verts[0], verts[1], verts[2]);
+		}
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		Mesh mesh = { "slivers", "long triangles, less than a pixel wide", CullMode::None, {} };
+		for (unsigned i = 0; i < 16 * 1024; i++)
+		{
+			float x0 = unit(rnd), y0 = unit(rnd);
+			float x1 = unit(rnd), y1 = unit(rnd);
+			float offset = 0.5f * (unit(rnd) + 1.0f);
+			add_triangle(mesh,
+			             make_vertex(x0, y0, 0.5f, 1.0f, 0.0f, 0.0f),
+			             make_vertex(x1, y1, 0.5f, 1.0f, 16.0f, 0.0f),
+			             make_vertex(x1 + offset * pixel_x, y1 + offset * pixel_y, 0.5f, 1.0f, 16.0f, 1.0f));
+		}
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		Mesh mesh = { "tiny", "sub-pixel triangles", CullMode::None, {} };
+		for (unsigned i = 0; i < 64 * 1024; i++)
+		{
+			float x = unit(rnd), y = unit(rnd);
+			add_triangle(mesh,
+			             make_vertex(x, y, 0.5f, 1.0f, 0.0f, 0.0f),
+			             make_vertex(x + 0.75f * pixel_x, y, 0.5f, 1.0f, 1.0f, 0.0f),
+			             make_vertex(x, y + 0.75f * pixel_y, 0.5f, 1.0f, 0.0f, 1.0f));
+		}
+		meshes.push_back(std::move(mesh));
+	}
+
+	{
+		Mesh mesh = { "huge", "full screen quads, front to back", CullMode::None, {} };
+		for (unsigned i = 0; i < 8; i++)
+		{
+			float z = 0.1f + 0.1f * float(i);
+			auto v00 = make_vertex(-1.0f, -1.0f, z, 1.0f, 0.0f, 0.0f);
+			auto v10 = make_vertex(+1.0f, -1.0f, z, 1.0f, 256.0f, 0.0f);
+			auto v01 = make_vertex(-1.0f, +1.0f, z, 1.0f, 0.0f, 256.0f);
+			auto v11 = make_vertex(+1.0f, +1.0f, z, 1.0f, 256.0f, 256.0f);
+			add_triangle(mesh, v00, v10, v01);
+			add_triangle(mesh, v10, v11, v01);
+		}
+		meshes.push_back(std::move(mesh));
+	}
+
+	return meshes;
+}
+
+struct CheckerboardSampler : Sampler
+{
+	Texel sample(int u, int v) override
+	{
+		uint8_t c = ((u ^ v) & 8) ? 0xff : 0x40;
+		return { c, c, c, 0xff };
+	}
+};
+
+struct DepthTestROP : ROP
+{
+	Canvas<uint32_t> color;
+	Canvas<uint16_t> depth;
+	uint64_t pixels = 0;
+
+	void emit_pixel(int x, int y, uint16_t z, const Texel &texel) override
+	{
+		pixels++;
+		auto &d = depth.get(x, y);
+		if (z <= d)
+		{
+			d = z;
+			color.get(x, y) = uint32_t(texel.r) | (uint32_t(texel.g) << 8) | (uint32_t(texel.b) << 16) | (uint32_t(texel.a) << 24);
+		}
+	}
+
+	void clear()
+	{
+		for (unsigned y = 0; y < depth.get_height(); y++)
+			for (unsigned x = 0; x < depth.get_width(); x++)
+				depth.get(x, y) = 0xffff;
+	}
+};
+
+static double get_time()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs func until min_time has passed, returns seconds per run.
+template <typename Func>
+static double measure(double min_time, Func &&func)
+{
+	func();
+	unsigned runs = 0;
+	double start = get_time();
+	double elapsed;
+	do
+	{
+		func();
+		runs++;
+		elapsed = get_time() - start;
+	} while (elapsed < min_time);
+	return elapsed / double(runs);
+}
+
+static void run_mesh_benchmark(const Mesh &mesh, unsigned width, unsigned height, double min_time)
+{
+	ViewportTransform vp = { -0.5f, -0.5f, float(width), float(height), 0.0f, 1.0f };
+	size_t num_triangles = mesh.vertices.size() / 3;
+	std::vector<PrimitiveSetup> setups(num_triangles + MAX_SETUPS_PER_TRIANGLE);
+	size_t num_setups = 0;
+
+	double setup_time = measure(min_time, [&]() {
+		InputPrimitive input = {};
+		num_setups = 0;
+		for (size_t i = 0; i < num_triangles; i++)
+		{
+			// Only heavily clipped meshes grow this after the first run.
+			if (setups.size() < num_setups + MAX_SETUPS_PER_TRIANGLE)
+				setups.resize(2 * setups.size());
+			memcpy(input.vertices, &mesh.vertices[3 * i], sizeof(input.vertices));
+			num_setups += setup_clipped_triangles(setups.data() + num_setups, input, mesh.cull_mode, vp);
+		}
+	});
+
+	RasterizerCPU rasterizer;
+	CheckerboardSampler sampler;
+	DepthTestROP rop;
+	rop.color.resize(width, height);
+	rop.depth.resize(width, height);
+	rasterizer.set_scissor(0, 0, width, height);
+	rasterizer.set_sampler(&sampler);
+	rasterizer.set_rop(&rop);
+
+	uint64_t pixels = 0;
+	double raster_time = measure(min_time, [&]() {
+		rop.clear();
+		rop.pixels = 0;
+		for (size_t i = 0; i < num_setups; i++)
+			rasterizer.render_primitive(setups[i]);
+		pixels = rop.pixels;
+	});
+
+	printf("%-12s %9u %9u %14.3f %14.3f %12.3f   %s\n", mesh.name, unsigned(num_triangles), unsigned(num_setups),
+	       1e-6 * double(num_triangles) / setup_time, 1e-6 * double(pixels) / raster_time,
+	       double(pixels) / double(std::max<size_t>(num_setups, 1)), mesh.description);
+}
+
+static void run_divider_benchmark(double min_time)
+{
+	// Slopes as computed by triangle setup, dx << 16 / dy in subpixels.
+	std::mt19937 rnd(1337);
+	std::uniform_int_distribution<int32_t> dx_dist(-(2048 << SUBPIXELS_LOG2), 2048 << SUBPIXELS_LOG2);
+	std::uniform_int_distribution<uint32_t> dy_dist(1, 2048 << SUBPIXELS_LOG2);
+	std::vector<int32_t> dx(64 * 1024);
+	std::vector<uint32_t> dy(dx.size());
+	for (size_t i = 0; i < dx.size(); i++)
+	{
+		dx[i] = dx_dist(rnd);
+		dy[i] = dy_dist(rnd);
+	}
+
+	setup_fixed_divider(false);
+	double max_error = 0.0;
+	for (size_t i = 0; i < dx.size(); i++)
+	{
+		double exact = double(dx[i]) * 65536.0 / double(dy[i]);
+		double error = fabs(double(fixed_divider(dx[i], dy[i], 16)) - exact) / std::max(fabs(exact), 1.0);
+		max_error = std::max(max_error, error);
+	}
+
+	volatile int32_t sink = 0;
+	double fixed_time = measure(min_time, [&]() {
+		int32_t acc = 0;
+		for (size_t i = 0; i < dx.size(); i++)
+			acc += fixed_divider(dx[i], dy[i], 16);
+		sink = acc;
+	});
+
+	double exact_time = measure(min_time, [&]() {
+		int32_t acc = 0;
+		for (size_t i = 0; i < dx.size(); i++)
+			acc += int32_t((int64_t(dx[i]) << 16) / int64_t(dy[i]));
+		sink = acc;
+	});
+	(void)sink;
+
+	printf("fixed_divider: %.3f M/s, integer divide: %.3f M/s, max relative error %.6f %%\n",
+	       1e-6 * double(dx.size()) / fixed_time, 1e-6 * double(dx.size()) / exact_time, 100.0 * max_error);
+}
+
+static void print_help()
+{
+	fprintf(stderr, "Usage: cpu-bench [--width <pixels>] [--height <pixels>] [--time <seconds>] [--mesh <name>]\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned width = 640;
+	unsigned height = 360;
+	double min_time = 0.5;
+	std::string only_mesh;
+
+	for (int i = 1; i < argc; i++)
+	{
+		bool has_value = i + 1 < argc;
+		if (!strcmp(argv[i], "--width") && has_value)
+			width = unsigned(strtoul(argv[++i], nullptr, 0));
+		else if (!strcmp(argv[i], "--height") && has_value)
+			height = unsigned(strtoul(argv[++i], nullptr, 0));
+		else if (!strcmp(argv[i], "--time") && has_value)
+			min_time = strtod(argv[++i], nullptr);
+		else if (!strcmp(argv[i], "--mesh") && has_value)
+			only_mesh = argv[++i];
+		else
+		{
+			print_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (width < 4 || height < 4 || width > 2048 || height > 2048)
+	{
+		fprintf(stderr, "Resolution must be between 4 and 2048.\n");
+		return EXIT_FAILURE;
+	}
+
+	auto meshes = create_meshes(width, height);
+	if (!only_mesh.empty())
+	{
+		meshes.erase(std::remove_if(meshes.begin(), meshes.end(), [&](const Mesh &mesh) {
+			return only_mesh != mesh.name;
+		}), meshes.end());
+
+		if (meshes.empty())
+		{
+			fprintf(stderr, "Unknown mesh %s.\n", only_mesh.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Cull, clip and setup are all part of setup_clipped_triangles(), the meshes isolate each of them.
+	printf("Resolution: %u x %u\n", width, height);
+	printf("%-12s %9s %9s %14s %14s %12s\n", "mesh", "triangles", "setups", "setup Mtri/s", "raster Mpix/s", "pixels/prim");
+	for (auto &mesh : meshes)
+		run_mesh_benchmark(mesh, width, height, min_time);
+
+	if (only_mesh.empty())
+		run_divider_benchmark(min_time);
+
+	return EXIT_SUCCESS;
+}
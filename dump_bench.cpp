@@ -1,11 +1,19 @@
 #include "primitive_setup.hpp"
+#include "primitive_packing.hpp"
+#include "dump_format.hpp"
+#include "sequence_format.hpp"
 #include "rasterizer_cpu.hpp"
 #include "triangle_converter.hpp"
+#include "trace_recorder.hpp"
+#include "json_util.hpp"
 #include "canvas.hpp"
 #include "stb_image_write.h"
 #include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <math.h>
 #include <assert.h>
 
 #include "global_managers_init.hpp"
@@ -15,6 +23,7 @@
 #include "camera.hpp"
 #include "approximate_divider.hpp"
 #include "rasterizer_gpu.hpp"
+#include "vram_image.hpp"
 #include "os_filesystem.hpp"
 #include "scene_loader.hpp"
 #include "mesh_util.hpp"
@@ -28,154 +37,204 @@ constexpr int TEXTURE_BASE_LEVEL = 1;
 using namespace RetroWarp;
 using namespace Granite;
 
-class StreamReader
+enum class ReplayMode
 {
-public:
-	StreamReader(const uint8_t *blob, size_t size);
-	bool eof() const;
-	bool parse_header();
-	bool parse_resolution(uint32_t &width, uint32_t &height);
-	bool parse_num_textures(uint32_t &count);
-
-	enum Op { TEX, PRIM, AlphaThreshold, BlendState, CombinerMode, ConstantColor, DepthTest, DepthWrite };
-	bool parse_op(Op &op);
-	bool parse_uint(uint32_t &value);
-	bool parse_primitive(PrimitiveSetup &setup);
-
-private:
-	const uint8_t *blob;
-	size_t offset = 0;
-	size_t size;
+	// Runs of primitives sharing render state are submitted in one call.
+	Batched,
+	// Render state is set and primitives are submitted one at a time, like the viewer does.
+	PerPrimitive,
+	// Benchmark both and compare.
+	Compare
 };
 
-StreamReader::StreamReader(const uint8_t *blob_, size_t size_)
-	: blob(blob_), size(size_)
+struct StageSamples
 {
-}
-
-bool StreamReader::eof() const
-{
-	return offset == size;
-}
+	std::string name;
+	std::vector<double> samples;
+};
 
-bool StreamReader::parse_header()
+static void add_stage_sample(std::vector<StageSamples> &stages, const std::string &name, double ms)
 {
-	if (offset + 16 > size)
-		return false;
-	if (memcmp(blob + offset, "RETROWARP DUMP01", 16))
-		return false;
+	auto itr = std::find_if(stages.begin(), stages.end(), [&](const StageSamples &stage) {
+		return stage.name == name;
+	});
 
-	offset += 16;
-	return true;
-}
+	if (itr == stages.end())
+	{
+		stages.push_back({ name, {} });
+		itr = stages.end() - 1;
+	}
 
-bool StreamReader::parse_resolution(uint32_t &width, uint32_t &height)
-{
-	if (offset + 2 * sizeof(uint32_t) > size)
-		return false;
-
-	memcpy(&width, blob + offset, sizeof(uint32_t));
-	offset += sizeof(uint32_t);
-	memcpy(&height, blob + offset, sizeof(uint32_t));
-	offset += sizeof(uint32_t);
-	return true;
+	itr->samples.push_back(ms);
 }
 
-bool StreamReader::parse_num_textures(uint32_t &count)
+// Nearest-rank percentile of sorted samples.
+static double get_percentile(const std::vector<double> &sorted, double p)
 {
-	return parse_uint(count);
+	size_t rank = size_t(ceil(p * double(sorted.size())));
+	rank = std::max<size_t>(rank, 1);
+	return sorted[std::min(rank, sorted.size()) - 1];
 }
 
-bool StreamReader::parse_op(Op &op)
+static void report_stage_timings(std::vector<StageSamples> &stages, const std::string &json_path)
 {
-	if (offset + 4 > size)
-		return false;
-
-	if (memcmp(blob + offset, "TEX ", 4) == 0)
+	FILE *json = nullptr;
+	if (!json_path.empty())
 	{
-		op = Op::TEX;
-		offset += 4;
-		return true;
+		json = fopen(json_path.c_str(), "w");
+		if (!json)
+			LOGE("Failed to open %s for writing.\n", json_path.c_str());
 	}
-	else if (memcmp(blob + offset, "PRIM", 4) == 0)
-	{
-		op = Op::PRIM;
-		offset += 4;
-		return true;
-	}
-	else if (memcmp(blob + offset, "ATRS", 4) == 0)
-	{
-		op = Op::AlphaThreshold;
-		offset += 4;
-		return true;
-	}
-	else if (memcmp(blob + offset, "BSTA", 4) == 0)
+
+	if (json)
+		fprintf(json, "{\n\t\"stages\": [\n");
+
+	LOGI("%-26s %8s %10s %10s %10s %10s %10s\n", "stage (ms)", "samples", "min", "median", "p95", "p99", "max");
+	for (auto &stage : stages)
 	{
-		op = Op::BlendState;
-		offset += 4;
-		return true;
+		auto &samples = stage.samples;
+		std::sort(samples.begin(), samples.end());
+
+		double min_ms = samples.front();
+		double median_ms = get_percentile(samples, 0.50);
+		double p95_ms = get_percentile(samples, 0.95);
+		double p99_ms = get_percentile(samples, 0.99);
+		double max_ms = samples.back();
+
+		LOGI("%-26s %8u %10.4f %10.4f %10.4f %10.4f %10.4f\n", stage.name.c_str(), unsigned(samples.size()),
+		     min_ms, median_ms, p95_ms, p99_ms, max_ms);
+
+		if (json)
+		{
+			fprintf(json, "\t\t{ \"name\": ");
+			write_json_string(json, stage.name.c_str());
+			fprintf(json, ", \"samples\": %u, \"min\": %.6f, \"median\": %.6f, "
+			              "\"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f }%s\n",
+			        unsigned(samples.size()), min_ms, median_ms, p95_ms, p99_ms, max_ms,
+			        &stage != &stages.back() ? "," : "");
+		}
 	}
-	else if (memcmp(blob + offset, "CMOD", 4) == 0)
+
+	if (json)
 	{
-		op = Op::CombinerMode;
-		offset += 4;
-		return true;
+		fprintf(json, "\t]\n}\n");
+		fclose(json);
 	}
-	else if (memcmp(blob + offset, "CCOL", 4) == 0)
+}
+
+// Compares median times of stages which were benchmarked in both replay modes.
+static void report_replay_mode_comparison(const std::vector<StageSamples> &stages)
+{
+	static const char batched_prefix[] = "batched/";
+	static const char per_primitive_prefix[] = "per-primitive/";
+
+	LOGI("%-26s %14s %14s %10s\n", "median (ms)", "per-primitive", "batched", "speedup");
+	for (auto &stage : stages)
 	{
-		op = Op::ConstantColor;
-		offset += 4;
-		return true;
+		if (stage.name.compare(0, strlen(batched_prefix), batched_prefix) != 0)
+			continue;
+
+		auto name = stage.name.substr(strlen(batched_prefix));
+		auto itr = std::find_if(stages.begin(), stages.end(), [&](const StageSamples &other) {
+			return other.name == per_primitive_prefix + name;
+		});
+		if (itr == stages.end())
+			continue;
+
+		// report_stage_timings() sorted the samples already.
+		double batched_ms = get_percentile(stage.samples, 0.50);
+		double per_primitive_ms = get_percentile(itr->samples, 0.50);
+		LOGI("%-26s %14.4f %14.4f %9.2fx\n", name.c_str(), per_primitive_ms, batched_ms,
+		     per_primitive_ms / std::max(batched_ms, 1e-9));
 	}
-	else if (memcmp(blob + offset, "DTST", 4) == 0)
+}
+
+static void report_statistics(const PipelineStatistics &stats)
+{
+	LOGI("Primitives binned: %llu\n", static_cast<unsigned long long>(stats.primitives_binned));
+	LOGI("Tile instances: %llu\n", static_cast<unsigned long long>(stats.tile_instances));
+	LOGI("Tiles with primitives: %llu\n", static_cast<unsigned long long>(stats.tiles_with_primitives));
+	if (stats.tiles_with_primitives)
 	{
-		op = Op::DepthTest;
-		offset += 4;
-		return true;
+		LOGI("Primitives per tile: %.2f average, %u max\n",
+		     double(stats.primitives_binned) / double(stats.tiles_with_primitives), stats.max_primitives_per_tile);
 	}
-	else if (memcmp(blob + offset, "DWRT", 4) == 0)
+	LOGI("Fragments shaded: %llu\n", static_cast<unsigned long long>(stats.fragments_shaded));
+	LOGI("Fragments passing depth: %llu\n", static_cast<unsigned long long>(stats.fragments_depth_passed));
+	LOGI("Fragments blended: %llu\n", static_cast<unsigned long long>(stats.fragments_blended));
+	LOGI("Flushes: %llu split, %llu ubershader\n", static_cast<unsigned long long>(stats.split_flushes),
+	     static_cast<unsigned long long>(stats.ubershader_flushes));
+	for (auto &variant : stats.combiner_variants)
 	{
-		op = Op::DepthWrite;
-		offset += 4;
-		return true;
+		LOGI("Combiner variant 0x%06x: %llu work items\n", variant.shader_state,
+		     static_cast<unsigned long long>(variant.work_items));
 	}
-	else
-		return false;
 }
 
-bool StreamReader::parse_uint(uint32_t &value)
+static void report_packed_attribute_accuracy(const PackedAttributeError &error)
 {
-	if (offset + sizeof(uint32_t) > size)
-		return false;
-	memcpy(&value, blob + offset, sizeof(uint32_t));
-	offset += sizeof(uint32_t);
-	return true;
-}
-
-bool StreamReader::parse_primitive(PrimitiveSetup &setup)
-{
-	if (offset + sizeof(setup) > size)
-		return false;
-	memcpy(&setup, blob + offset, sizeof(setup));
-	offset += sizeof(setup);
-	return true;
+	LOGI("Packed attributes: %llu primitives, %u bytes per primitive rather than %u.\n",
+	     static_cast<unsigned long long>(error.primitives),
+	     unsigned(sizeof(PrimitiveSetupAttrPacked)), unsigned(sizeof(PrimitiveSetupAttr)));
+	if (error.uv_samples)
+	{
+		LOGI("UV error: %.6f texels average, %.6f texels max\n",
+		     error.total_uv_error / double(error.uv_samples), error.max_uv_error);
+	}
+	LOGI("Barycentric error: %.8f max\n", error.max_barycentric_error);
 }
 
 int main(int argc, char **argv)
 {
-	bool ubershader = false;
+	PipelineMode pipeline_mode = PipelineMode::Split;
 	bool subgroup = true;
 	bool async_compute = false;
 	std::string path;
 	unsigned tile_size = 16;
 	unsigned num_iterations = 1000;
+	unsigned num_warmup_iterations = 10;
+	std::string json_path;
+	bool use_display_list = false;
+	bool statistics = false;
+	bool compact_work_list = false;
+	bool indirect_rop = true;
+	bool depth_prepass = false;
+	bool packed_attributes = false;
+	std::string convert_path;
+	std::string texture_base;
+	bool use_vram_image = true;
+	bool clip_space = false;
+	bool validate_gpu_setup = false;
+	unsigned override_width = 0;
+	unsigned override_height = 0;
+	ReplayMode replay_mode = ReplayMode::Batched;
+	std::string replay_mode_name;
+	std::string trace_path;
 
 	Util::CLICallbacks cbs;
-	cbs.add("--ubershader", [&](Util::CLIParser &) { ubershader = true; });
+	cbs.add("--ubershader", [&](Util::CLIParser &) { pipeline_mode = PipelineMode::Ubershader; });
+	cbs.add("--auto-pipeline", [&](Util::CLIParser &) { pipeline_mode = PipelineMode::Auto; });
 	cbs.add("--nosubgroup", [&](Util::CLIParser &) { subgroup = false; });
 	cbs.add("--async-compute", [&](Util::CLIParser &) { async_compute = true; });
 	cbs.add("--tile-size", [&](Util::CLIParser &parser) { tile_size = parser.next_uint(); });
 	cbs.add("--iterations", [&](Util::CLIParser &parser) { num_iterations = parser.next_uint(); });
+	cbs.add("--display-list", [&](Util::CLIParser &) { use_display_list = true; });
+	cbs.add("--warmup", [&](Util::CLIParser &parser) { num_warmup_iterations = parser.next_uint(); });
+	cbs.add("--json", [&](Util::CLIParser &parser) { json_path = parser.next_string(); });
+	cbs.add("--statistics", [&](Util::CLIParser &) { statistics = true; });
+	cbs.add("--compact-work-list", [&](Util::CLIParser &) { compact_work_list = true; });
+	cbs.add("--full-rop", [&](Util::CLIParser &) { indirect_rop = false; });
+	cbs.add("--depth-prepass", [&](Util::CLIParser &) { depth_prepass = true; });
+	cbs.add("--packed-attributes", [&](Util::CLIParser &) { packed_attributes = true; });
+	cbs.add("--convert", [&](Util::CLIParser &parser) { convert_path = parser.next_string(); });
+	cbs.add("--textures", [&](Util::CLIParser &parser) { texture_base = parser.next_string(); });
+	cbs.add("--no-vram-image", [&](Util::CLIParser &) { use_vram_image = false; });
+	cbs.add("--clip-space", [&](Util::CLIParser &) { clip_space = true; });
+	cbs.add("--validate-gpu-setup", [&](Util::CLIParser &) { validate_gpu_setup = true; });
+	cbs.add("--width", [&](Util::CLIParser &parser) { override_width = parser.next_uint(); });
+	cbs.add("--height", [&](Util::CLIParser &parser) { override_height = parser.next_uint(); });
+	cbs.add("--replay-mode", [&](Util::CLIParser &parser) { replay_mode_name = parser.next_string(); });
+	cbs.add("--trace", [&](Util::CLIParser &parser) { trace_path = parser.next_string(); });
 	cbs.default_handler = [&](const char *arg) { path = arg; };
 	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
@@ -191,6 +250,30 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (replay_mode_name == "per-primitive")
+		replay_mode = ReplayMode::PerPrimitive;
+	else if (replay_mode_name == "compare")
+		replay_mode = ReplayMode::Compare;
+	else if (!replay_mode_name.empty() && replay_mode_name != "batched")
+	{
+		LOGE("Unknown replay mode %s.\n", replay_mode_name.c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (replay_mode == ReplayMode::Compare && use_display_list)
+	{
+		LOGE("The display list is recorded once, replay modes cannot be compared.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (texture_base.empty())
+		texture_base = path;
+
+	std::unique_ptr<TraceRecorder> trace_recorder;
+	if (!trace_path.empty())
+		trace_recorder.reset(new TraceRecorder);
+	TraceRecorder *trace = trace_recorder.get();
+
 	Global::init();
 	GRANITE_FILESYSTEM()->register_protocol("assets", std::make_unique<OSFilesystem>(ASSET_DIRECTORY));
 
@@ -208,27 +291,156 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	StreamReader reader(mapped, dump_file->get_size());
-	if (!reader.parse_header())
+	// DUMP02 is used in-place, legacy dumps are decoded into a copy.
+	// Sequences are decoded one frame at a time as iterations progress.
+	DumpData legacy_dump;
+	SequenceReader sequence;
+	DumpView dump;
+	size_t dump_size = dump_file->get_size();
+	auto version = get_dump_version(mapped, dump_size);
+	if (version == DumpVersion::V2)
+	{
+		if (!parse_dump(dump, mapped, dump_size))
+		{
+			LOGE("Failed to parse dump.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	else if (version == DumpVersion::Legacy)
+	{
+		if (!parse_dump_legacy(legacy_dump, mapped, dump_size))
+		{
+			LOGE("Failed to parse legacy dump.\n");
+			return EXIT_FAILURE;
+		}
+		dump = legacy_dump.get_view();
+	}
+	else if (version == DumpVersion::Sequence)
+	{
+		if (!sequence.init(mapped, dump_size) || !sequence.next_frame(dump))
+		{
+			LOGE("Failed to parse sequence.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (use_display_list || !convert_path.empty())
+		{
+			LOGE("Sequences cannot be recorded into a display list or converted.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	else
 	{
 		LOGE("Failed to parse header.\n");
 		return EXIT_FAILURE;
 	}
 
-	uint32_t width, height;
-	if (!reader.parse_resolution(width, height))
+	for (size_t i = 0; i < dump.num_render_states; i++)
 	{
-		LOGE("Failed to parse resolution.\n");
+		if (dump.render_states[i].texture_index >= dump.num_textures)
+		{
+			LOGE("Render state %u references texture %u, but dump only has %u textures.\n",
+			     unsigned(i), dump.render_states[i].texture_index, dump.num_textures);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((clip_space || validate_gpu_setup) && !dump.viewport)
+	{
+		LOGE("Dump was not captured with --dump-clip-space, cannot replay triangle setup.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (clip_space && use_display_list)
+	{
+		LOGE("Triangle setup is replayed every iteration, which cannot be recorded into a display list.\n");
 		return EXIT_FAILURE;
 	}
 
-	uint32_t num_textures;
-	if (!reader.parse_num_textures(num_textures))
+	if ((override_width || override_height) && !clip_space && !validate_gpu_setup)
 	{
-		LOGE("Failed to parse num textures.\n");
+		LOGE("Primitives are stored after triangle setup, use --clip-space to replay at a different resolution.\n");
 		return EXIT_FAILURE;
 	}
 
+	if (!convert_path.empty())
+	{
+		if (!write_dump(convert_path.c_str(), dump))
+		{
+			LOGE("Failed to write %s.\n", convert_path.c_str());
+			return EXIT_FAILURE;
+		}
+		LOGI("Wrote %u primitives, %u render states to %s.\n", unsigned(dump.num_primitives),
+		     unsigned(dump.num_render_states), convert_path.c_str());
+		return EXIT_SUCCESS;
+	}
+
+	uint32_t width = override_width ? override_width : dump.width;
+	uint32_t height = override_height ? override_height : dump.height;
+	uint32_t num_textures = dump.num_textures;
+
+	// Clip-space replays run clipping and triangle setup on the CPU every iteration, into these arrays.
+	DumpView clip_dump = dump;
+	ViewportTransform clip_viewport = {};
+	std::vector<uint32_t> setup_state_indices;
+	std::vector<PrimitiveSetupPos> setup_positions;
+	std::vector<PrimitiveSetupAttr> setup_attributes;
+	double setup_ms = 0.0;
+
+	auto run_triangle_setup = [&]() {
+		TraceScope scope(trace, "triangle-setup");
+		auto start_setup = Util::get_current_time_nsecs();
+		setup_state_indices.clear();
+		setup_positions.clear();
+		setup_attributes.clear();
+
+		InputPrimitive input = {};
+		PrimitiveSetup setups[MAX_SETUPS_PER_TRIANGLE];
+		for (size_t i = 0; i < clip_dump.num_meshes; i++)
+		{
+			auto &mesh = clip_dump.meshes[i];
+			const uint32_t *indices = clip_dump.indices + mesh.first_index;
+			for (uint32_t j = 0; j < mesh.num_indices; j += 3)
+			{
+				input.vertices[0] = clip_dump.vertices[indices[j + 0]];
+				input.vertices[1] = clip_dump.vertices[indices[j + 1]];
+				input.vertices[2] = clip_dump.vertices[indices[j + 2]];
+				unsigned count = setup_clipped_triangles(setups, input, CullMode(mesh.cull_mode), clip_viewport);
+				for (unsigned k = 0; k < count; k++)
+				{
+					setup_state_indices.push_back(mesh.render_state);
+					setup_positions.push_back(setups[k].pos);
+					setup_attributes.push_back(setups[k].attr);
+				}
+			}
+		}
+
+		dump.state_indices = setup_state_indices.data();
+		dump.positions = setup_positions.data();
+		dump.attributes = setup_attributes.data();
+		dump.num_primitives = setup_positions.size();
+		auto end_setup = Util::get_current_time_nsecs();
+		setup_ms = double(end_setup - start_setup) * 1e-6;
+	};
+
+	if (clip_space || validate_gpu_setup)
+	{
+		// Scale the viewport, keeping the sub-pixel offset.
+		clip_viewport = *clip_dump.viewport;
+		float scale_x = float(width) / float(dump.width);
+		float scale_y = float(height) / float(dump.height);
+		clip_viewport.x = (clip_viewport.x + 0.5f) * scale_x - 0.5f;
+		clip_viewport.y = (clip_viewport.y + 0.5f) * scale_y - 0.5f;
+		clip_viewport.width *= scale_x;
+		clip_viewport.height *= scale_y;
+	}
+
+	if (clip_space)
+	{
+		run_triangle_setup();
+		LOGI("Replaying triangle setup of %u meshes at %u x %u.\n", unsigned(clip_dump.num_meshes), width, height);
+	}
+
 	if (!Vulkan::Context::init_loader(nullptr))
 	{
 		LOGE("Failed to init loader.\n");
@@ -246,7 +458,36 @@ int main(int argc, char **argv)
 	device.set_context(ctx);
 
 	RasterizerGPU rasterizer;
-	rasterizer.init(device, subgroup, ubershader, async_compute, tile_size);
+	rasterizer.init(device, subgroup, pipeline_mode == PipelineMode::Ubershader, async_compute, tile_size);
+	rasterizer.set_pipeline_mode(pipeline_mode);
+	rasterizer.set_compact_work_list(compact_work_list);
+	rasterizer.set_indirect_rop(indirect_rop);
+	rasterizer.set_depth_prepass(depth_prepass);
+	rasterizer.set_packed_attributes(packed_attributes);
+	rasterizer.set_trace_recorder(trace);
+
+	if (validate_gpu_setup)
+	{
+		size_t num_triangles = 0;
+		size_t mismatches = 0;
+		for (size_t i = 0; i < clip_dump.num_meshes; i++)
+		{
+			auto &mesh = clip_dump.meshes[i];
+			mismatches += rasterizer.validate_triangle_setup(clip_dump.vertices, clip_dump.num_vertices,
+			                                                 clip_dump.indices + mesh.first_index, mesh.num_indices / 3,
+			                                                 CullMode(mesh.cull_mode), clip_viewport);
+			num_triangles += mesh.num_indices / 3;
+		}
+
+		if (mismatches)
+		{
+			LOGE("GPU triangle setup mismatches for %u of %u triangles.\n", unsigned(mismatches), unsigned(num_triangles));
+			return EXIT_FAILURE;
+		}
+
+		LOGI("GPU triangle setup matches for all %u triangles at %u x %u.\n", unsigned(num_triangles), width, height);
+		return EXIT_SUCCESS;
+	}
 
 	uint32_t addr = 0;
 	rasterizer.set_color_framebuffer(addr, width, height, width * 2);
@@ -255,183 +496,289 @@ int main(int argc, char **argv)
 	addr += width * height * 2;
 
 	std::vector<TextureDescriptor> texture_descriptors;
-	for (unsigned i = 0; i < num_textures; i++)
+
+	// A VRAM image restores every texture with one upload,
+	// otherwise textures are mipmapped and converted one level at a time.
+	bool restored_vram_image = false;
+	auto vram_image_path = texture_base + ".vram";
+	FileStat vram_image_stat;
+	if (use_vram_image && GRANITE_FILESYSTEM()->stat(vram_image_path, vram_image_stat))
 	{
-		auto tex_path = std::string(argv[1]) + ".tex." + std::to_string(i);
-		auto tex_file = load_texture_from_file(*GRANITE_FILESYSTEM(), tex_path, Vulkan::ColorSpace::Linear);
-		if (tex_file.empty())
+		auto vram_image_file = GRANITE_FILESYSTEM()->open(vram_image_path, FileMode::ReadOnly);
+		void *vram_image_mapped = vram_image_file ? vram_image_file->map() : nullptr;
+		VRAMImageView vram_image;
+		if (!vram_image_mapped || !parse_vram_image(vram_image, vram_image_mapped, vram_image_file->get_size()))
 		{
-			LOGE("Failed to load texture.\n");
+			LOGE("Failed to parse %s.\n", vram_image_path.c_str());
 			return EXIT_FAILURE;
 		}
-		tex_file = SceneFormats::generate_mipmaps(tex_file.get_layout(), 0);
-		auto &layout = tex_file.get_layout();
-		unsigned levels = std::min(layout.get_levels() - TEXTURE_BASE_LEVEL, 8u);
 
-		TextureDescriptor descriptor;
-
-		descriptor.texture_clamp = i16vec4(-0x8000, -0x8000, 0x7fff, 0x7fff);
-		descriptor.texture_mask = u16vec2(layout.get_width(TEXTURE_BASE_LEVEL) - 1,
-		                                  layout.get_height(TEXTURE_BASE_LEVEL) - 1);
-		descriptor.texture_max_lod = levels - 1;
-		descriptor.texture_width = layout.get_width(TEXTURE_BASE_LEVEL);
-		descriptor.texture_fmt = TEXTURE_FMT_ARGB1555 | TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT;
-
-		addr = (addr + 63) & ~63;
-
-		for (unsigned level = 0; level < levels; level++)
+		if (vram_image.num_descriptors < num_textures)
 		{
-			unsigned mip_width = layout.get_width(level + TEXTURE_BASE_LEVEL);
-			unsigned mip_height = layout.get_height(level + TEXTURE_BASE_LEVEL);
-			descriptor.texture_offset[level] = addr;
-			uint32_t blocks_width = (mip_width + 7) / 8;
-			uint32_t blocks_height = (mip_height + 7) / 8;
-			rasterizer.copy_texture_rgba8888_to_vram(addr,
-			                                         static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL)),
-			                                         mip_width, mip_height, TEXTURE_FMT_ARGB1555);
-			addr += blocks_width * blocks_height * 64 * sizeof(uint16_t);
+			LOGE("%s has %u textures, but dump uses %u.\n", vram_image_path.c_str(),
+			     unsigned(vram_image.num_descriptors), num_textures);
+			return EXIT_FAILURE;
 		}
 
-		texture_descriptors.push_back(descriptor);
-	}
-
-	struct Cache
-	{
-		unsigned state_index;
-		uint8_t alpha_threshold;
-		BlendState blend_state;
-		PrimitiveSetup setup;
-		CombinerFlags combiner_state;
-		DepthTest depth_test;
-		DepthWrite depth_write;
-		uint8_t constant_color[4];
-	};
-
-	std::vector<Cache> commands;
-
-	Cache current = {};
-	current.blend_state = BlendState::Replace;
-	current.combiner_state = COMBINER_MODE_TEX_MOD_COLOR | COMBINER_SAMPLE_BIT;
-	current.depth_test = DepthTest::LE;
-	current.depth_write = DepthWrite::On;
-
-	while (!reader.eof())
-	{
-		StreamReader::Op op;
-		if (!reader.parse_op(op))
+		// Texture offsets are baked into the descriptors, so a larger framebuffer has to fall back to loading textures.
+		if (vram_image.vram_offset < addr)
+			LOGI("VRAM image in %s overlaps the framebuffer, loading textures instead.\n", vram_image_path.c_str());
+		else if (!rasterizer.write_vram(vram_image.vram_offset, vram_image.vram, vram_image.vram_size))
 		{
-			LOGE("Failed to parse op.\n");
+			LOGE("VRAM image in %s does not fit in VRAM.\n", vram_image_path.c_str());
 			return EXIT_FAILURE;
 		}
-
-		if (op == StreamReader::Op::TEX)
+		else
 		{
-			if (!reader.parse_uint(current.state_index))
-			{
-				LOGE("Failed to parse uint.\n");
-				return EXIT_FAILURE;
-			}
+			texture_descriptors.assign(vram_image.descriptors, vram_image.descriptors + num_textures);
+			restored_vram_image = true;
+			LOGI("Restored %u textures, %u bytes of VRAM from %s.\n", num_textures,
+			     unsigned(vram_image.vram_size), vram_image_path.c_str());
 		}
-		else if (op == StreamReader::Op::PRIM)
+	}
+
+	if (!restored_vram_image)
+	{
+		for (unsigned i = 0; i < num_textures; i++)
 		{
-			if (!reader.parse_primitive(current.setup))
+			auto tex_path = texture_base + ".tex." + std::to_string(i);
+			auto tex_file = load_texture_from_file(*GRANITE_FILESYSTEM(), tex_path, Vulkan::ColorSpace::Linear);
+			if (tex_file.empty())
 			{
-				LOGE("Failed to parse primitive.\n");
+				LOGE("Failed to load texture.\n");
 				return EXIT_FAILURE;
 			}
-			commands.push_back(current);
-		}
-		else if (op == StreamReader::Op::AlphaThreshold)
-		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
+			tex_file = SceneFormats::generate_mipmaps(tex_file.get_layout(), 0);
+			auto &layout = tex_file.get_layout();
+			unsigned levels = std::min(layout.get_levels() - TEXTURE_BASE_LEVEL, 8u);
+
+			TextureDescriptor descriptor;
+
+			descriptor.texture_clamp = i16vec4(-0x8000, -0x8000, 0x7fff, 0x7fff);
+			descriptor.texture_mask = u16vec2(layout.get_width(TEXTURE_BASE_LEVEL) - 1,
+			                                  layout.get_height(TEXTURE_BASE_LEVEL) - 1);
+			descriptor.texture_max_lod = levels - 1;
+			descriptor.texture_width = layout.get_width(TEXTURE_BASE_LEVEL);
+			descriptor.texture_fmt = TEXTURE_FMT_ARGB1555 | TEXTURE_FMT_FILTER_MIP_LINEAR_BIT | TEXTURE_FMT_FILTER_LINEAR_BIT;
+
+			addr = (addr + 63) & ~63;
+
+			for (unsigned level = 0; level < levels; level++)
 			{
-				LOGE("Failed to parse alpha threshold.\n");
-				return EXIT_FAILURE;
+				unsigned mip_width = layout.get_width(level + TEXTURE_BASE_LEVEL);
+				unsigned mip_height = layout.get_height(level + TEXTURE_BASE_LEVEL);
+				descriptor.texture_offset[level] = addr;
+				uint32_t blocks_width = (mip_width + 7) / 8;
+				uint32_t blocks_height = (mip_height + 7) / 8;
+				rasterizer.copy_texture_rgba8888_to_vram(addr,
+				                                         static_cast<const uint32_t *>(layout.data(0, level + TEXTURE_BASE_LEVEL)),
+				                                         mip_width, mip_height, TEXTURE_FMT_ARGB1555);
+				addr += blocks_width * blocks_height * 64 * sizeof(uint16_t);
 			}
-			current.alpha_threshold = word;
+
+			texture_descriptors.push_back(descriptor);
 		}
-		else if (op == StreamReader::Op::BlendState)
+	}
+
+	LOGI("Primitive count: %u\n", unsigned(dump.num_primitives));
+	LOGI("Render states: %u\n", unsigned(dump.num_render_states));
+
+	if (packed_attributes)
+	{
+		PackedAttributeError error;
+		for (size_t i = 0; i < dump.num_primitives; i++)
 		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
-			{
-				LOGE("Failed to parse blend state.\n");
-				return EXIT_FAILURE;
-			}
-			current.blend_state = BlendState(word);
+			PrimitiveSetup setup;
+			setup.pos = dump.positions[i];
+			setup.attr = dump.attributes[i];
+			accumulate_packed_attribute_error(error, setup);
 		}
-		else if (op == StreamReader::Op::CombinerMode)
+		report_packed_attribute_accuracy(error);
+	}
+
+	auto set_render_state = [&](const DumpRenderState &state) {
+		rasterizer.set_texture_descriptor(texture_descriptors[state.texture_index]);
+		rasterizer.set_combiner_mode(state.combiner_state);
+		rasterizer.set_constant_color(state.constant_color[0], state.constant_color[1], state.constant_color[2], state.constant_color[3]);
+		rasterizer.set_alpha_threshold(state.alpha_threshold);
+		rasterizer.set_rop_state(BlendState(state.blend_state));
+		rasterizer.set_depth_state(DepthTest(state.depth_test), DepthWrite(state.depth_write));
+	};
+
+	size_t submit_calls = 0;
+	auto submit_commands = [&](bool per_primitive) {
+		if (per_primitive)
 		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
+			for (size_t i = 0; i < dump.num_primitives; i++)
 			{
-				LOGE("Failed to parse blend state.\n");
-				return EXIT_FAILURE;
+				set_render_state(dump.render_states[dump.state_indices[i]]);
+				rasterizer.rasterize_primitives(dump.positions + i, dump.attributes + i, 1);
 			}
-			current.combiner_state = word;
+			submit_calls = dump.num_primitives;
+			return;
 		}
-		else if (op == StreamReader::Op::ConstantColor)
+
+		submit_calls = 0;
+		size_t i = 0;
+		while (i < dump.num_primitives)
 		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
-			{
-				LOGE("Failed to parse constant color.\n");
-				return EXIT_FAILURE;
-			}
-			current.constant_color[0] = (word >> 0) & 0xff;
-			current.constant_color[1] = (word >> 8) & 0xff;
-			current.constant_color[2] = (word >> 16) & 0xff;
-			current.constant_color[3] = (word >> 24) & 0xff;
+			// Submit runs of primitives sharing render state in one go.
+			uint32_t state_index = dump.state_indices[i];
+			size_t count = 1;
+			while (i + count < dump.num_primitives && dump.state_indices[i + count] == state_index)
+				count++;
+
+			set_render_state(dump.render_states[state_index]);
+			rasterizer.rasterize_primitives(dump.positions + i, dump.attributes + i, count);
+			submit_calls++;
+			i += count;
 		}
-		else if (op == StreamReader::Op::DepthTest)
+	};
+
+	std::shared_ptr<DisplayList> display_list;
+	if (use_display_list)
+	{
+		rasterizer.begin_display_list();
+		submit_commands(replay_mode == ReplayMode::PerPrimitive);
+		display_list = rasterizer.end_display_list();
+		LOGI("Recorded %u primitives in display list.\n", unsigned(get_display_list_primitive_count(*display_list)));
+	}
+
+	std::vector<StageSamples> stages;
+
+	// Walks the sequence, starting over at the end.
+	double sequence_decode_ms = 0.0;
+	uint64_t sequence_frames = 0;
+	uint64_t sequence_changed_primitives = 0;
+	uint64_t sequence_primitives = 0;
+	auto advance_sequence = [&]() -> bool {
+		TraceScope scope(trace, "sequence-decode");
+		auto start_decode = Util::get_current_time_nsecs();
+		if (!sequence.next_frame(dump))
 		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
-			{
-				LOGE("Failed to parse depth test.\n");
-				return EXIT_FAILURE;
-			}
-			current.depth_test = DepthTest(word);
+			if (sequence.failed())
+				return false;
+			sequence.rewind();
+			if (!sequence.next_frame(dump))
+				return false;
 		}
-		else if (op == StreamReader::Op::DepthWrite)
+		auto end_decode = Util::get_current_time_nsecs();
+		sequence_decode_ms = double(end_decode - start_decode) * 1e-6;
+		sequence_frames++;
+		sequence_changed_primitives += sequence.get_last_changed_primitives();
+		sequence_primitives += dump.num_primitives;
+		return true;
+	};
+
+	auto run_iteration = [&](bool per_primitive) {
+		TraceScope scope(trace, "iteration");
+		if (version == DumpVersion::Sequence && !advance_sequence())
 		{
-			uint32_t word;
-			if (!reader.parse_uint(word))
-			{
-				LOGE("Failed to parse depth write.\n");
-				return EXIT_FAILURE;
-			}
-			current.depth_write = DepthWrite(word);
+			LOGE("Sequence is corrupt at frame %u.\n", sequence.get_frame_index());
+			exit(EXIT_FAILURE);
 		}
-	}
 
-	LOGI("Primitive count: %u\n", unsigned(commands.size()));
+		if (clip_space)
+			run_triangle_setup();
 
-	rasterizer.flush();
-	device.wait_idle();
-	auto start_run = Util::get_current_time_nsecs();
-	for (unsigned i = 0; i < num_iterations; i++)
-	{
 		device.next_frame_context();
 		rasterizer.clear_depth();
 		rasterizer.clear_color();
-		for (auto &command : commands)
+		auto start_staging = Util::get_current_time_nsecs();
 		{
-			rasterizer.set_texture_descriptor(texture_descriptors[command.state_index]);
-			rasterizer.set_combiner_mode(command.combiner_state);
-			rasterizer.set_constant_color(command.constant_color[0], command.constant_color[1], command.constant_color[2], command.constant_color[3]);
-			rasterizer.set_depth_state(command.depth_test, command.depth_write);
-			rasterizer.set_alpha_threshold(command.alpha_threshold);
-			rasterizer.set_rop_state(command.blend_state);
-			rasterizer.set_depth_state(command.depth_test, command.depth_write);
-			rasterizer.rasterize_primitives(&command.setup, 1);
+			TraceScope staging_scope(trace, "staging");
+			if (display_list)
+				rasterizer.replay(*display_list);
+			else
+				submit_commands(per_primitive);
+			rasterizer.flush();
 		}
+		auto end_staging = Util::get_current_time_nsecs();
+		return double(end_staging - start_staging) * 1e-6;
+	};
+
+	// When comparing replay modes, stages are prefixed with the mode.
+	auto run_benchmark = [&](bool per_primitive, const std::string &prefix) {
+		for (unsigned i = 0; i < num_warmup_iterations; i++)
+			run_iteration(per_primitive);
+		sequence_frames = 0;
+		sequence_changed_primitives = 0;
+		sequence_primitives = 0;
+
 		rasterizer.flush();
+		device.wait_idle();
+		rasterizer.set_stage_timing(true);
+		auto start_run = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < num_iterations; i++)
+		{
+			add_stage_sample(stages, prefix + "cpu-staging", run_iteration(per_primitive));
+			if (version == DumpVersion::Sequence)
+				add_stage_sample(stages, prefix + "sequence-decode", sequence_decode_ms);
+			if (clip_space)
+				add_stage_sample(stages, prefix + "cpu-triangle-setup", setup_ms);
+			rasterizer.end_timing_frame();
+		}
+		device.wait_idle();
+		auto end_run = Util::get_current_time_nsecs();
+		LOGI("%sCPU time: %.3f ms / frame\n", prefix.c_str(), (double(end_run - start_run) / double(num_iterations)) * 1e-6);
+		if (!display_list)
+		{
+			LOGI("%sSubmitted %u primitives in %u calls / frame.\n", prefix.c_str(),
+			     unsigned(dump.num_primitives), unsigned(submit_calls));
+		}
+		if (sequence_frames)
+		{
+			LOGI("%sSequence: walked %llu frames, %.2f %% of primitives changed per frame.\n", prefix.c_str(),
+			     static_cast<unsigned long long>(sequence_frames),
+			     100.0 * double(sequence_changed_primitives) / double(std::max<uint64_t>(sequence_primitives, 1)));
+		}
+
+		std::vector<std::vector<StageTiming>> frames;
+		rasterizer.read_stage_timings(frames);
+		rasterizer.set_stage_timing(false);
+		for (auto &frame : frames)
+			for (auto &timing : frame)
+				add_stage_sample(stages, prefix + timing.name, timing.milliseconds);
+	};
+
+	if (replay_mode == ReplayMode::Compare)
+	{
+		run_benchmark(true, "per-primitive/");
+		run_benchmark(false, "batched/");
+	}
+	else
+		run_benchmark(replay_mode == ReplayMode::PerPrimitive, "");
+
+	if (num_iterations != 0)
+	{
+		report_stage_timings(stages, json_path);
+		if (replay_mode == ReplayMode::Compare)
+			report_replay_mode_comparison(stages);
+	}
+
+	// Statistics add atomics to the raster shaders, so gather them in a separate, untimed iteration.
+	if (statistics)
+	{
+		rasterizer.set_statistics(true);
+		rasterizer.reset_statistics();
+		run_iteration(replay_mode == ReplayMode::PerPrimitive);
+		report_statistics(rasterizer.read_statistics());
+		rasterizer.set_statistics(false);
 	}
-	device.wait_idle();
-	auto end_run = Util::get_current_time_nsecs();
-	LOGI("CPU time: %.3f ms / frame\n", (double(end_run - start_run) / double(num_iterations)) * 1e-6);
 
 	rasterizer.save_canvas("canvas.png");
+
+	if (trace)
+	{
+		device.wait_idle();
+		rasterizer.resolve_trace();
+		rasterizer.set_trace_recorder(nullptr);
+		if (!trace->write_chrome_trace(trace_path.c_str()))
+		{
+			LOGE("Failed to write trace to %s.\n", trace_path.c_str());
+			return EXIT_FAILURE;
+		}
+		LOGI("Wrote %u trace events to %s, %u dropped.\n", unsigned(trace->get_num_events()), trace_path.c_str(),
+		     unsigned(trace->get_dropped_events()));
+	}
 }
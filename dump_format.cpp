@@ -0,0 +1,397 @@
+#include "dump_format.hpp"
+#include <string.h>
+#include <stdio.h>
+
+namespace RetroWarp
+{
+static const char DUMP_LEGACY_MAGIC[] = "RETROWARP DUMP01";
+static const char DUMP_MAGIC[] = "RETROWARP DUMP02";
+static const char SEQUENCE_MAGIC[] = "RETROWARP SEQ001";
+static const uint64_t DUMP_SECTION_ALIGNMENT = 64;
+
+static uint32_t make_fourcc(const char *fourcc)
+{
+	uint32_t value;
+	memcpy(&value, fourcc, sizeof(value));
+	return value;
+}
+
+size_t DumpRenderStateHash::operator()(const DumpRenderState &state) const
+{
+	uint64_t words[2];
+	memcpy(words, &state, sizeof(words));
+	return size_t(words[0] * 0x9e3779b97f4a7c15ull) ^ size_t(words[1]);
+}
+
+bool DumpRenderStateEqual::operator()(const DumpRenderState &a, const DumpRenderState &b) const
+{
+	return memcmp(&a, &b, sizeof(DumpRenderState)) == 0;
+}
+
+uint32_t DumpData::get_render_state_index(const DumpRenderState &state)
+{
+	// State tends to stay the same for long runs of primitives.
+	if (render_states.empty() || !DumpRenderStateEqual()(render_states[last_state_index], state))
+	{
+		auto itr = render_state_map.find(state);
+		if (itr == render_state_map.end())
+		{
+			last_state_index = uint32_t(render_states.size());
+			render_states.push_back(state);
+			render_state_map[state] = last_state_index;
+		}
+		else
+			last_state_index = itr->second;
+	}
+
+	return last_state_index;
+}
+
+void DumpData::add_primitive(const DumpRenderState &state, const PrimitiveSetup &setup)
+{
+	state_indices.push_back(get_render_state_index(state));
+	positions.push_back(setup.pos);
+	attributes.push_back(setup.attr);
+}
+
+void DumpData::add_mesh(const DumpRenderState &state, CullMode mode,
+                        const Vertex *mesh_vertices, size_t num_vertices,
+                        const uint32_t *mesh_indices, size_t num_indices)
+{
+	DumpMesh mesh = {};
+	mesh.render_state = get_render_state_index(state);
+	mesh.cull_mode = uint32_t(mode);
+	mesh.first_index = uint32_t(indices.size());
+	mesh.num_indices = uint32_t(num_indices);
+	meshes.push_back(mesh);
+
+	auto base_vertex = uint32_t(vertices.size());
+	vertices.insert(vertices.end(), mesh_vertices, mesh_vertices + num_vertices);
+	for (size_t i = 0; i < num_indices; i++)
+		indices.push_back(base_vertex + mesh_indices[i]);
+}
+
+void DumpData::set_viewport(const ViewportTransform &viewport_)
+{
+	viewport = viewport_;
+	has_viewport = true;
+}
+
+void DumpData::clear()
+{
+	width = 0;
+	height = 0;
+	num_textures = 0;
+	render_states.clear();
+	state_indices.clear();
+	positions.clear();
+	attributes.clear();
+	meshes.clear();
+	vertices.clear();
+	indices.clear();
+	has_viewport = false;
+	render_state_map.clear();
+	last_state_index = 0;
+}
+
+DumpView DumpData::get_view() const
+{
+	DumpView view;
+	view.width = width;
+	view.height = height;
+	view.num_textures = num_textures;
+	view.render_states = render_states.data();
+	view.num_render_states = render_states.size();
+	view.state_indices = state_indices.data();
+	view.positions = positions.data();
+	view.attributes = attributes.data();
+	view.num_primitives = positions.size();
+	if (has_viewport)
+	{
+		view.meshes = meshes.data();
+		view.num_meshes = meshes.size();
+		view.vertices = vertices.data();
+		view.num_vertices = vertices.size();
+		view.indices = indices.data();
+		view.num_indices = indices.size();
+		view.viewport = &viewport;
+	}
+	return view;
+}
+
+DumpVersion get_dump_version(const void *data, size_t size)
+{
+	if (size < 16)
+		return DumpVersion::Invalid;
+	else if (memcmp(data, DUMP_MAGIC, 16) == 0)
+		return DumpVersion::V2;
+	else if (memcmp(data, DUMP_LEGACY_MAGIC, 16) == 0)
+		return DumpVersion::Legacy;
+	else if (memcmp(data, SEQUENCE_MAGIC, 16) == 0)
+		return DumpVersion::Sequence;
+	else
+		return DumpVersion::Invalid;
+}
+
+template <typename T>
+static bool get_section_array(const T *&ptr, size_t &count, const uint8_t *blob, size_t size, const DumpSection &section)
+{
+	if (section.stride != sizeof(T) || (section.size % sizeof(T)) != 0)
+		return false;
+	if (section.offset > size || section.size > size - section.offset)
+		return false;
+	if (((uintptr_t(blob) + section.offset) % alignof(T)) != 0)
+		return false;
+
+	ptr = reinterpret_cast<const T *>(blob + section.offset);
+	count = size_t(section.size / sizeof(T));
+	return true;
+}
+
+bool parse_dump(DumpView &view, const void *data, size_t size)
+{
+	auto *blob = static_cast<const uint8_t *>(data);
+	if (get_dump_version(data, size) != DumpVersion::V2 || size < sizeof(DumpHeader))
+		return false;
+
+	DumpHeader header;
+	memcpy(&header, blob, sizeof(header));
+	if (header.num_sections > (size - sizeof(DumpHeader)) / sizeof(DumpSection))
+		return false;
+
+	view = {};
+	view.width = header.width;
+	view.height = header.height;
+	view.num_textures = header.num_textures;
+
+	size_t num_indices = 0, num_positions = 0, num_attributes = 0, num_viewports = 0;
+	bool has_states = false, has_indices = false, has_positions = false, has_attributes = false;
+	unsigned clip_space_sections = 0;
+
+	for (uint32_t i = 0; i < header.num_sections; i++)
+	{
+		DumpSection section;
+		memcpy(&section, blob + sizeof(DumpHeader) + i * sizeof(DumpSection), sizeof(section));
+
+		uint32_t fourcc = make_fourcc(section.fourcc);
+		bool ok = true;
+		if (fourcc == make_fourcc("RSTA"))
+		{
+			ok = get_section_array(view.render_states, view.num_render_states, blob, size, section);
+			has_states = true;
+		}
+		else if (fourcc == make_fourcc("SIDX"))
+		{
+			ok = get_section_array(view.state_indices, num_indices, blob, size, section);
+			has_indices = true;
+		}
+		else if (fourcc == make_fourcc("POS "))
+		{
+			ok = get_section_array(view.positions, num_positions, blob, size, section);
+			has_positions = true;
+		}
+		else if (fourcc == make_fourcc("ATTR"))
+		{
+			ok = get_section_array(view.attributes, num_attributes, blob, size, section);
+			has_attributes = true;
+		}
+		else if (fourcc == make_fourcc("MESH"))
+		{
+			ok = get_section_array(view.meshes, view.num_meshes, blob, size, section);
+			clip_space_sections++;
+		}
+		else if (fourcc == make_fourcc("VERT"))
+		{
+			ok = get_section_array(view.vertices, view.num_vertices, blob, size, section);
+			clip_space_sections++;
+		}
+		else if (fourcc == make_fourcc("INDX"))
+		{
+			ok = get_section_array(view.indices, view.num_indices, blob, size, section);
+			clip_space_sections++;
+		}
+		else if (fourcc == make_fourcc("VIEW"))
+		{
+			ok = get_section_array(view.viewport, num_viewports, blob, size, section);
+			clip_space_sections++;
+		}
+
+		if (!ok)
+			return false;
+	}
+
+	if (!has_states || !has_indices || !has_positions || !has_attributes)
+		return false;
+	if (num_indices != num_positions || num_positions != num_attributes)
+		return false;
+	view.num_primitives = num_positions;
+
+	for (size_t i = 0; i < view.num_primitives; i++)
+		if (view.state_indices[i] >= view.num_render_states)
+			return false;
+
+	if (clip_space_sections == 0)
+		return true;
+	if (clip_space_sections != 4 || num_viewports != 1)
+		return false;
+
+	for (size_t i = 0; i < view.num_meshes; i++)
+	{
+		auto &mesh = view.meshes[i];
+		if (mesh.render_state >= view.num_render_states || mesh.cull_mode > uint32_t(CullMode::CWOnly))
+			return false;
+		if ((mesh.num_indices % 3) != 0 || mesh.first_index > view.num_indices ||
+		    mesh.num_indices > view.num_indices - mesh.first_index)
+			return false;
+	}
+
+	for (size_t i = 0; i < view.num_indices; i++)
+		if (view.indices[i] >= view.num_vertices)
+			return false;
+
+	return true;
+}
+
+bool parse_dump_legacy(DumpData &dump, const void *data, size_t size)
+{
+	auto *blob = static_cast<const uint8_t *>(data);
+	if (get_dump_version(data, size) != DumpVersion::Legacy)
+		return false;
+
+	size_t offset = 16;
+	auto parse_uint = [&](uint32_t &value) -> bool {
+		if (offset + sizeof(uint32_t) > size)
+			return false;
+		memcpy(&value, blob + offset, sizeof(uint32_t));
+		offset += sizeof(uint32_t);
+		return true;
+	};
+
+	dump = {};
+	if (!parse_uint(dump.width) || !parse_uint(dump.height) || !parse_uint(dump.num_textures))
+		return false;
+
+	DumpRenderState state;
+	PrimitiveSetup setup;
+
+	while (offset != size)
+	{
+		uint32_t op;
+		if (!parse_uint(op))
+			return false;
+
+		if (op == make_fourcc("PRIM"))
+		{
+			if (offset + sizeof(setup) > size)
+				return false;
+			memcpy(&setup, blob + offset, sizeof(setup));
+			offset += sizeof(setup);
+			dump.add_primitive(state, setup);
+			continue;
+		}
+
+		uint32_t word;
+		if (!parse_uint(word))
+			return false;
+
+		if (op == make_fourcc("TEX "))
+			state.texture_index = word;
+		else if (op == make_fourcc("ATRS"))
+			state.alpha_threshold = uint8_t(word);
+		else if (op == make_fourcc("BSTA"))
+			state.blend_state = uint8_t(word);
+		else if (op == make_fourcc("CMOD"))
+			state.combiner_state = uint8_t(word);
+		else if (op == make_fourcc("CCOL"))
+			memcpy(state.constant_color, &word, sizeof(word));
+		else if (op == make_fourcc("DTST"))
+			state.depth_test = uint8_t(word);
+		else if (op == make_fourcc("DWRT"))
+			state.depth_write = uint8_t(word);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+static uint64_t align_section(uint64_t offset)
+{
+	return (offset + DUMP_SECTION_ALIGNMENT - 1) & ~(DUMP_SECTION_ALIGNMENT - 1);
+}
+
+bool write_dump(const DumpView &view, const DumpWriteCallback &write)
+{
+	struct Payload
+	{
+		const char *fourcc;
+		uint32_t stride;
+		const void *data;
+		size_t count;
+	};
+
+	const Payload payloads[] = {
+		{ "RSTA", sizeof(DumpRenderState), view.render_states, view.num_render_states },
+		{ "SIDX", sizeof(uint32_t), view.state_indices, view.num_primitives },
+		{ "POS ", sizeof(PrimitiveSetupPos), view.positions, view.num_primitives },
+		{ "ATTR", sizeof(PrimitiveSetupAttr), view.attributes, view.num_primitives },
+		{ "MESH", sizeof(DumpMesh), view.meshes, view.num_meshes },
+		{ "VERT", sizeof(Vertex), view.vertices, view.num_vertices },
+		{ "INDX", sizeof(uint32_t), view.indices, view.num_indices },
+		{ "VIEW", sizeof(ViewportTransform), view.viewport, 1 },
+	};
+	const uint32_t max_sections = sizeof(payloads) / sizeof(payloads[0]);
+	const uint32_t num_sections = view.viewport ? max_sections : 4;
+
+	DumpHeader header = {};
+	memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+	header.width = view.width;
+	header.height = view.height;
+	header.num_textures = view.num_textures;
+	header.num_sections = num_sections;
+
+	DumpSection sections[max_sections] = {};
+	uint64_t offset = sizeof(DumpHeader) + num_sections * sizeof(DumpSection);
+	for (uint32_t i = 0; i < num_sections; i++)
+	{
+		offset = align_section(offset);
+		memcpy(sections[i].fourcc, payloads[i].fourcc, 4);
+		sections[i].stride = payloads[i].stride;
+		sections[i].offset = offset;
+		sections[i].size = uint64_t(payloads[i].stride) * payloads[i].count;
+		offset += sections[i].size;
+	}
+
+	bool ok = write(&header, sizeof(header)) &&
+	          write(sections, num_sections * sizeof(DumpSection));
+
+	static const uint8_t zero_padding[DUMP_SECTION_ALIGNMENT] = {};
+	uint64_t written = sizeof(DumpHeader) + num_sections * sizeof(DumpSection);
+	for (uint32_t i = 0; ok && i < num_sections; i++)
+	{
+		size_t padding = size_t(sections[i].offset - written);
+		if (padding)
+			ok = write(zero_padding, padding);
+		if (ok && sections[i].size)
+			ok = write(payloads[i].data, size_t(sections[i].size));
+		written = sections[i].offset + sections[i].size;
+	}
+
+	return ok;
+}
+
+bool write_dump(const char *path, const DumpView &view)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	bool ok = write_dump(view, [file](const void *data, size_t size) {
+		return fwrite(data, size, 1, file) == 1;
+	});
+
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+}
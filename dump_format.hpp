@@ -0,0 +1,172 @@
+#pragma once
+
+#include "primitive_setup.hpp"
+#include "triangle_converter.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <vector>
+#include <unordered_map>
+
+namespace RetroWarp
+{
+// Frame dumps, as written by the viewer and replayed by dump-bench.
+//
+// "RETROWARP DUMP01" is the legacy format, a stream of 4-byte opcodes each followed by a state word or PrimitiveSetup.
+//
+// "RETROWARP DUMP02" starts with DumpHeader, followed by num_sections DumpSection entries.
+// Every section is 64 byte aligned, so once the file is memory mapped, the arrays can be used in-place.
+// - RSTA: DumpRenderState[], every unique render state used by the frame.
+// - SIDX: uint32_t[], index into RSTA for every primitive.
+// - POS : PrimitiveSetupPos[], one for every primitive.
+// - ATTR: PrimitiveSetupAttr[], one for every primitive.
+//
+// Optionally, the frame is also stored before clipping and triangle setup, so that work can be replayed,
+// including at a different resolution. These sections are either all present or all absent:
+// - MESH: DumpMesh[], one for every draw.
+// - VERT: Vertex[], clip-space vertices of all meshes.
+// - INDX: uint32_t[], three per triangle, indexing into VERT.
+// - VIEW: ViewportTransform, exactly one.
+// Readers ignore sections they do not know about.
+
+// Render state as raw values of the RasterizerGPU enums, so dumps don't depend on the GPU implementation.
+struct DumpRenderState
+{
+	uint32_t texture_index = 0;
+	uint8_t constant_color[4] = {};
+	// COMBINER_MODE_TEX_MOD_COLOR | COMBINER_SAMPLE_BIT.
+	uint8_t combiner_state = 0x80;
+	uint8_t alpha_threshold = 0;
+	// BlendState::Replace.
+	uint8_t blend_state = 0;
+	// DepthTest::LE.
+	uint8_t depth_test = 1;
+	// DepthWrite::On.
+	uint8_t depth_write = 0x80;
+	uint8_t padding[3] = {};
+};
+static_assert(sizeof(DumpRenderState) == 16, "DumpRenderState must be 16 bytes.");
+
+struct DumpRenderStateHash
+{
+	size_t operator()(const DumpRenderState &state) const;
+};
+
+struct DumpRenderStateEqual
+{
+	bool operator()(const DumpRenderState &a, const DumpRenderState &b) const;
+};
+
+struct DumpMesh
+{
+	// Index into RSTA.
+	uint32_t render_state;
+	// CullMode.
+	uint32_t cull_mode;
+	uint32_t first_index;
+	uint32_t num_indices;
+};
+
+struct DumpHeader
+{
+	char magic[16];
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_textures;
+	uint32_t num_sections;
+};
+
+struct DumpSection
+{
+	char fourcc[4];
+	// Size of one element.
+	uint32_t stride;
+	uint64_t offset;
+	uint64_t size;
+};
+
+// Non-owning view of a frame. Either points into a memory mapped DUMP02 file, or into DumpData.
+struct DumpView
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t num_textures = 0;
+
+	const DumpRenderState *render_states = nullptr;
+	size_t num_render_states = 0;
+
+	const uint32_t *state_indices = nullptr;
+	const PrimitiveSetupPos *positions = nullptr;
+	const PrimitiveSetupAttr *attributes = nullptr;
+	size_t num_primitives = 0;
+
+	// Clip-space data, viewport is nullptr if the frame was only stored after triangle setup.
+	const DumpMesh *meshes = nullptr;
+	size_t num_meshes = 0;
+	const Vertex *vertices = nullptr;
+	size_t num_vertices = 0;
+	const uint32_t *indices = nullptr;
+	size_t num_indices = 0;
+	const ViewportTransform *viewport = nullptr;
+};
+
+// Frame built in memory, deduplicating render states as primitives are added.
+class DumpData
+{
+public:
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t num_textures = 0;
+
+	void add_primitive(const DumpRenderState &state, const PrimitiveSetup &setup);
+	// Indices are relative to the vertices of this mesh.
+	void add_mesh(const DumpRenderState &state, CullMode mode,
+	              const Vertex *vertices, size_t num_vertices,
+	              const uint32_t *indices, size_t num_indices);
+	// Meshes are only part of the view once a viewport is set.
+	void set_viewport(const ViewportTransform &viewport);
+	DumpView get_view() const;
+	// Removes all primitives and render states, but keeps allocations around for the next frame.
+	void clear();
+
+private:
+	std::vector<DumpRenderState> render_states;
+	std::vector<uint32_t> state_indices;
+	std::vector<PrimitiveSetupPos> positions;
+	std::vector<PrimitiveSetupAttr> attributes;
+
+	std::vector<DumpMesh> meshes;
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	ViewportTransform viewport = {};
+	bool has_viewport = false;
+
+	std::unordered_map<DumpRenderState, uint32_t, DumpRenderStateHash, DumpRenderStateEqual> render_state_map;
+	uint32_t last_state_index = 0;
+	uint32_t get_render_state_index(const DumpRenderState &state);
+};
+
+enum class DumpVersion
+{
+	Invalid,
+	Legacy,
+	V2,
+	// Multiple frames, see sequence_format.hpp.
+	Sequence
+};
+
+DumpVersion get_dump_version(const void *data, size_t size);
+
+// Zero-copy, the view points into data, which must stay alive and be at least 4 byte aligned.
+bool parse_dump(DumpView &view, const void *data, size_t size);
+
+// The legacy format must be decoded into a copy.
+bool parse_dump_legacy(DumpData &dump, const void *data, size_t size);
+
+// Called with consecutive pieces of the file, returns false to abort.
+using DumpWriteCallback = std::function<bool (const void *data, size_t size)>;
+
+bool write_dump(const char *path, const DumpView &view);
+// Same, but streams the file through write, e.g. into a CaptureWriter.
+bool write_dump(const DumpView &view, const DumpWriteCallback &write);
+}
@@ -0,0 +1,451 @@
+#include "dump_format.hpp"
+#include "triangle_converter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <random>
+#include <string>
+#include <algorithm>
+
+// Writes procedural stress scenes as dumps which dump-bench can replay, without Vulkan or Granite.
+// Output only depends on the options and seed.
+
+using namespace RetroWarp;
+
+// Raw values of the RasterizerGPU enums, like DumpRenderState.
+enum
+{
+	COMBINER_SAMPLE_BIT = 0x80,
+	COMBINER_ADD_CONSTANT_BIT = 0x40,
+	// TEX_MOD_COLOR, TEX and COLOR in the low bits.
+	NUM_COMBINER_MODES = 3,
+	BLEND_STATE_ALPHA = 2,
+	DEPTH_WRITE_OFF = 0
+};
+
+struct Options
+{
+	std::string scene;
+	std::string path;
+	unsigned width = 640;
+	unsigned height = 360;
+	uint32_t seed = 1;
+	unsigned count = 0;
+	unsigned layers = 8;
+	unsigned states = 1024;
+	unsigned textures = 4;
+	// Defaults to 2048 for large-texture, 256 otherwise.
+	unsigned texture_size = 0;
+};
+
+// std:: distributions are implementation defined, so derive values from the raw engine output instead.
+class Random
+{
+public:
+	explicit Random(uint32_t seed)
+		: engine(seed)
+	{
+	}
+
+	float unorm()
+	{
+		return float(engine() >> 8) * (1.0f / 16777216.0f);
+	}
+
+	float range(float lo, float hi)
+	{
+		return lo + (hi - lo) * unorm();
+	}
+
+	uint32_t below(uint32_t count)
+	{
+		return uint32_t((uint64_t(engine()) * count) >> 32);
+	}
+
+private:
+	std::mt19937 engine;
+};
+
+class SceneBuilder
+{
+public:
+	SceneBuilder(unsigned width, unsigned height, unsigned num_textures)
+	{
+		dump.width = width;
+		dump.height = height;
+		dump.num_textures = num_textures;
+		viewport = { -0.5f, -0.5f, float(width), float(height), 0.0f, 1.0f };
+		dump.set_viewport(viewport);
+	}
+
+	// Position in pixels, with W = 1.
+	Vertex make_vertex(float x, float y, float z, float u, float v, const float color[4]) const
+	{
+		Vertex vert = {};
+		vert.x = 2.0f * (x - viewport.x) / viewport.width - 1.0f;
+		vert.y = 2.0f * (y - viewport.y) / viewport.height - 1.0f;
+		vert.z = z;
+		vert.w = 1.0f;
+		vert.u = u;
+		vert.v = v;
+		memcpy(vert.color, color, sizeof(vert.color));
+		return vert;
+	}
+
+	// Stores the mesh in clip-space, as well as the primitives after setup.
+	void add_mesh(const DumpRenderState &state, const Vertex *vertices, size_t num_vertices,
+	              const uint32_t *indices, size_t num_indices)
+	{
+		dump.add_mesh(state, CullMode::None, vertices, num_vertices, indices, num_indices);
+
+		InputPrimitive input = {};
+		PrimitiveSetup setups[MAX_SETUPS_PER_TRIANGLE];
+		for (size_t i = 0; i + 2 < num_indices; i += 3)
+		{
+			input.vertices[0] = vertices[indices[i + 0]];
+			input.vertices[1] = vertices[indices[i + 1]];
+			input.vertices[2] = vertices[indices[i + 2]];
+			unsigned count = setup_clipped_triangles(setups, input, CullMode::None, viewport);
+			for (unsigned j = 0; j < count; j++)
+				dump.add_primitive(state, setups[j]);
+		}
+	}
+
+	// UV is in texels, uv_scale texels per pixel starting at u0, v0.
+	void add_quad(const DumpRenderState &state, float x, float y, float width, float height, float z,
+	              const float color[4], float uv_scale = 1.0f, float u0 = 0.0f, float v0 = 0.0f)
+	{
+		float u1 = u0 + uv_scale * width;
+		float v1 = v0 + uv_scale * height;
+		const Vertex vertices[4] = {
+			make_vertex(x, y, z, u0, v0, color),
+			make_vertex(x + width, y, z, u1, v0, color),
+			make_vertex(x, y + height, z, u0, v1, color),
+			make_vertex(x + width, y + height, z, u1, v1, color),
+		};
+		static const uint32_t indices[6] = { 0, 1, 2, 2, 1, 3 };
+		add_mesh(state, vertices, 4, indices, 6);
+	}
+
+	void add_triangle(const DumpRenderState &state, const Vertex &a, const Vertex &b, const Vertex &c)
+	{
+		const Vertex vertices[3] = { a, b, c };
+		static const uint32_t indices[3] = { 0, 1, 2 };
+		add_mesh(state, vertices, 3, indices, 3);
+	}
+
+	DumpData dump;
+	ViewportTransform viewport;
+};
+
+static const float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+static DumpRenderState make_state(unsigned texture_index)
+{
+	DumpRenderState state;
+	state.texture_index = texture_index;
+	return state;
+}
+
+// Opaque full screen quads, drawn back to front so every layer passes the depth test.
+static void generate_overdraw(SceneBuilder &builder, const Options &options, Random &)
+{
+	for (unsigned i = 0; i < options.layers; i++)
+	{
+		float z = 0.9f - 0.8f * float(i) / float(std::max(options.layers, 1u));
+		builder.add_quad(make_state(i % options.textures), 0.0f, 0.0f, float(options.width), float(options.height),
+		                 z, white);
+	}
+}
+
+// Triangles covering about one pixel each, scattered over the screen.
+static void generate_tiny(SceneBuilder &builder, const Options &options, Random &rnd)
+{
+	unsigned count = options.count ? options.count : 64 * 1024;
+	auto state = make_state(0);
+	for (unsigned i = 0; i < count; i++)
+	{
+		float x = rnd.range(0.0f, float(options.width - 1));
+		float y = rnd.range(0.0f, float(options.height - 1));
+		float z = rnd.range(0.1f, 0.9f);
+		builder.add_triangle(state,
+		                     builder.make_vertex(x, y, z, x, y, white),
+		                     builder.make_vertex(x + 1.5f, y, z, x + 1.5f, y, white),
+		                     builder.make_vertex(x, y + 1.5f, z, x, y + 1.5f, white));
+	}
+}
+
+// Full screen quads in random depth order.
+static void generate_fullscreen(SceneBuilder &builder, const Options &options, Random &rnd)
+{
+	unsigned count = options.count ? options.count : 16;
+	for (unsigned i = 0; i < count; i++)
+	{
+		builder.add_quad(make_state(i % options.textures), 0.0f, 0.0f, float(options.width), float(options.height),
+		                 rnd.range(0.1f, 0.9f), white);
+	}
+}
+
+// Small quads, each with a different render state than the one before.
+static void generate_state_thrash(SceneBuilder &builder, const Options &options, Random &rnd)
+{
+	unsigned count = options.count ? options.count : 16 * 1024;
+	unsigned num_states = options.states;
+
+	std::vector<DumpRenderState> states(num_states);
+	for (unsigned i = 0; i < num_states; i++)
+	{
+		auto &state = states[i];
+		state.texture_index = i % options.textures;
+		state.combiner_state = uint8_t(COMBINER_SAMPLE_BIT | COMBINER_ADD_CONSTANT_BIT | ((i / options.textures) % NUM_COMBINER_MODES));
+		// Unique for every state, on top of texture and combiner mode.
+		state.constant_color[0] = uint8_t(i);
+		state.constant_color[1] = uint8_t(i >> 8);
+		state.constant_color[2] = uint8_t(rnd.below(64));
+		state.constant_color[3] = 0;
+	}
+
+	unsigned state_index = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		// Never repeat the previous state.
+		if (num_states > 1)
+			state_index = (state_index + 1 + rnd.below(num_states - 1)) % num_states;
+
+		float size = rnd.range(4.0f, 32.0f);
+		float x = rnd.range(-size, float(options.width));
+		float y = rnd.range(-size, float(options.height));
+		builder.add_quad(states[state_index], x, y, size, size, rnd.range(0.1f, 0.9f), white);
+	}
+}
+
+// Alpha blended quads stacked back to front, with depth writes off.
+static void generate_alpha_blend(SceneBuilder &builder, const Options &options, Random &rnd)
+{
+	for (unsigned i = 0; i < options.layers; i++)
+	{
+		auto state = make_state(i % options.textures);
+		state.blend_state = BLEND_STATE_ALPHA;
+		state.depth_write = DEPTH_WRITE_OFF;
+
+		float color[4] = { rnd.range(0.25f, 1.0f), rnd.range(0.25f, 1.0f), rnd.range(0.25f, 1.0f), rnd.range(0.1f, 0.5f) };
+		float width = rnd.range(0.5f, 1.0f) * float(options.width);
+		float height = rnd.range(0.5f, 1.0f) * float(options.height);
+		float x = rnd.range(0.0f, float(options.width) - width);
+		float y = rnd.range(0.0f, float(options.height) - height);
+		float z = 0.9f - 0.8f * float(i) / float(std::max(options.layers, 1u));
+		builder.add_quad(state, x, y, width, height, z, color);
+	}
+}
+
+// Screen covered by a grid of quads, each sampling a random part of one large texture at a random scale.
+static void generate_large_texture(SceneBuilder &builder, const Options &options, Random &rnd)
+{
+	unsigned cells = 8;
+	float cell_width = float(options.width) / float(cells);
+	float cell_height = float(options.height) / float(cells);
+	for (unsigned y = 0; y < cells; y++)
+	{
+		for (unsigned x = 0; x < cells; x++)
+		{
+			auto state = make_state(rnd.below(options.textures));
+			float uv_scale = rnd.range(0.5f, 4.0f);
+			float u0 = rnd.range(0.0f, float(options.texture_size));
+			float v0 = rnd.range(0.0f, float(options.texture_size));
+			builder.add_quad(state, float(x) * cell_width, float(y) * cell_height, cell_width, cell_height,
+			                 0.5f, white, uv_scale, u0, v0);
+		}
+	}
+}
+
+// 32-bit uncompressed TGA, which dump-bench loads like any other .tex.N file.
+static bool write_texture(const std::string &path, unsigned size, Random &rnd)
+{
+	std::vector<uint8_t> pixels(size_t(size) * size * 4);
+	uint8_t colors[2][3];
+	for (auto &color : colors)
+		for (auto &c : color)
+			c = uint8_t(rnd.below(256));
+
+	unsigned check_size = std::max(size / 8, 1u);
+	for (unsigned y = 0; y < size; y++)
+	{
+		for (unsigned x = 0; x < size; x++)
+		{
+			auto &color = colors[((x / check_size) ^ (y / check_size)) & 1];
+			uint8_t *pixel = &pixels[(size_t(y) * size + x) * 4];
+			uint8_t noise = uint8_t(rnd.below(32));
+			pixel[0] = uint8_t(std::min(color[2] + noise, 255));
+			pixel[1] = uint8_t(std::min(color[1] + noise, 255));
+			pixel[2] = uint8_t(std::min(color[0] + noise, 255));
+			pixel[3] = 0xff;
+		}
+	}
+
+	uint8_t header[18] = {};
+	// Uncompressed true-color.
+	header[2] = 2;
+	header[12] = uint8_t(size);
+	header[13] = uint8_t(size >> 8);
+	header[14] = uint8_t(size);
+	header[15] = uint8_t(size >> 8);
+	header[16] = 32;
+	// 8 alpha bits, top-left origin.
+	header[17] = 0x28;
+
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+	          fwrite(pixels.data(), pixels.size(), 1, file) == 1;
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+
+static void print_help()
+{
+	fprintf(stderr, "Usage: dump-gen --scene <overdraw|tiny|fullscreen|state-thrash|alpha-blend|large-texture>\n"
+	                "\t[--width <pixels>] [--height <pixels>] [--seed <seed>]\n"
+	                "\t[--count <primitives>] [--layers <layers>] [--states <render states>]\n"
+	                "\t[--textures <count>] [--texture-size <pixels>] <output>\n");
+}
+
+static bool parse_uint(unsigned &value, const char *arg)
+{
+	char *end = nullptr;
+	unsigned long parsed = strtoul(arg, &end, 0);
+	if (!*arg || *end)
+		return false;
+	value = unsigned(parsed);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool has_value = i + 1 < argc;
+		unsigned seed = 0;
+		bool ok = true;
+
+		if (!strcmp(argv[i], "--scene") && has_value)
+			options.scene = argv[++i];
+		else if (!strcmp(argv[i], "--width") && has_value)
+			ok = parse_uint(options.width, argv[++i]);
+		else if (!strcmp(argv[i], "--height") && has_value)
+			ok = parse_uint(options.height, argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && has_value)
+		{
+			ok = parse_uint(seed, argv[++i]);
+			options.seed = seed;
+		}
+		else if (!strcmp(argv[i], "--count") && has_value)
+			ok = parse_uint(options.count, argv[++i]);
+		else if (!strcmp(argv[i], "--layers") && has_value)
+			ok = parse_uint(options.layers, argv[++i]);
+		else if (!strcmp(argv[i], "--states") && has_value)
+		{
+			ok = parse_uint(options.states, argv[++i]);
+			if (ok && (options.states < 1 || options.states > 1024))
+			{
+				fprintf(stderr, "Render states must be between 1 and 1024.\n");
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "--textures") && has_value)
+			ok = parse_uint(options.textures, argv[++i]);
+		else if (!strcmp(argv[i], "--texture-size") && has_value)
+			ok = parse_uint(options.texture_size, argv[++i]);
+		else if (argv[i][0] != '-' && options.path.empty())
+			options.path = argv[i];
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			print_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (options.scene.empty() || options.path.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (options.width < 1 || options.height < 1 || options.width > 2048 || options.height > 2048)
+	{
+		fprintf(stderr, "Resolution must be between 1 and 2048.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!options.texture_size)
+		options.texture_size = options.scene == "large-texture" ? 2048 : 256;
+
+	// Texture masks require POT textures, and dump-bench starts at mip level 1.
+	if (options.textures < 1 || options.texture_size < 2 || options.texture_size > 4096 ||
+	    (options.texture_size & (options.texture_size - 1)) != 0)
+	{
+		fprintf(stderr, "Need at least one texture, texture size must be a power of two between 2 and 4096.\n");
+		return EXIT_FAILURE;
+	}
+
+	struct Scene
+	{
+		const char *name;
+		void (*generate)(SceneBuilder &, const Options &, Random &);
+	};
+
+	static const Scene scenes[] = {
+		{ "overdraw", generate_overdraw },
+		{ "tiny", generate_tiny },
+		{ "fullscreen", generate_fullscreen },
+		{ "state-thrash", generate_state_thrash },
+		{ "alpha-blend", generate_alpha_blend },
+		{ "large-texture", generate_large_texture },
+	};
+
+	auto itr = std::find_if(std::begin(scenes), std::end(scenes), [&](const Scene &scene) {
+		return options.scene == scene.name;
+	});
+
+	if (itr == std::end(scenes))
+	{
+		fprintf(stderr, "Unknown scene %s.\n", options.scene.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Separate streams, so the textures don't change with scene parameters.
+	Random scene_rnd(options.seed);
+	Random texture_rnd(options.seed ^ 0x9e3779b9u);
+
+	SceneBuilder builder(options.width, options.height, options.textures);
+	itr->generate(builder, options, scene_rnd);
+	auto view = builder.dump.get_view();
+
+	if (!write_dump(options.path.c_str(), view))
+	{
+		fprintf(stderr, "Failed to write %s.\n", options.path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0; i < options.textures; i++)
+	{
+		auto tex_path = options.path + ".tex." + std::to_string(i);
+		if (!write_texture(tex_path, options.texture_size, texture_rnd))
+		{
+			fprintf(stderr, "Failed to write %s.\n", tex_path.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("Wrote %s: %u x %u, %u primitives, %u render states, %u meshes, %u textures of %u x %u.\n",
+	       options.path.c_str(), options.width, options.height, unsigned(view.num_primitives),
+	       unsigned(view.num_render_states), unsigned(view.num_meshes), options.textures,
+	       options.texture_size, options.texture_size);
+	return EXIT_SUCCESS;
+}
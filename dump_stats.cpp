@@ -0,0 +1,380 @@
+#include "dump_format.hpp"
+#include "sequence_format.hpp"
+#include "tile_coverage.hpp"
+#include "rasterizer_limits.hpp"
+#include "canvas.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+
+// Characterizes the workload of a capture on the CPU, without Vulkan or Granite.
+
+using namespace RetroWarp;
+
+// Bucket 0 counts zeroes, bucket N counts values in [2^(N-1), 2^N).
+struct Histogram
+{
+	std::vector<uint64_t> buckets;
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t max_value = 0;
+
+	void add(uint64_t value)
+	{
+		unsigned bucket = 0;
+		while (bucket < 64 && (value >> bucket) != 0)
+			bucket++;
+		if (bucket >= buckets.size())
+			buckets.resize(bucket + 1);
+		buckets[bucket]++;
+		count++;
+		sum += value;
+		max_value = std::max(max_value, value);
+	}
+};
+
+static void print_histogram(const char *title, const Histogram &histogram)
+{
+	printf("%s: %.2f average, %llu max\n", title,
+	       double(histogram.sum) / double(std::max<uint64_t>(histogram.count, 1)),
+	       static_cast<unsigned long long>(histogram.max_value));
+
+	for (size_t i = 0; i < histogram.buckets.size(); i++)
+	{
+		if (!histogram.buckets[i])
+			continue;
+
+		char range[64];
+		if (i == 0)
+			snprintf(range, sizeof(range), "0");
+		else if (i == 1)
+			snprintf(range, sizeof(range), "1");
+		else
+			snprintf(range, sizeof(range), "%llu - %llu", 1ull << (i - 1), (1ull << i) - 1);
+
+		double percent = 100.0 * double(histogram.buckets[i]) / double(histogram.count);
+		printf("  %-16s %10llu %6.2f %%\n", range, static_cast<unsigned long long>(histogram.buckets[i]), percent);
+	}
+}
+
+// Replays the batching decisions of RasterizerGPU::Impl::allocate_primitives() for the split pipeline.
+struct FlushModel
+{
+	explicit FlushModel(unsigned tile_size_log2_)
+		: tile_size_log2(tile_size_log2_)
+	{
+	}
+
+	unsigned tile_size_log2;
+	Histogram tiles_per_primitive;
+
+	uint64_t batches = 0;
+	uint64_t flushes_primitives = 0;
+	uint64_t flushes_tile_instances = 0;
+	uint64_t flushes_shader_states = 0;
+	uint64_t flushes_render_states = 0;
+
+	int count = 0;
+	int tile_instances = 0;
+	unsigned shader_state_count = 0;
+	uint32_t last_shader_state = 0;
+	unsigned render_state_count = 0;
+	uint32_t last_render_state = 0;
+
+	void add_primitive(unsigned num_tiles, uint32_t shader_state, uint32_t render_state)
+	{
+		tiles_per_primitive.add(num_tiles);
+
+		bool shader_state_changed = shader_state_count != 0 && shader_state != last_shader_state;
+		bool render_state_changed = render_state_count != 0 && render_state != last_render_state;
+
+		if (count + 1 > MAX_PRIMITIVES)
+			flush(flushes_primitives);
+		else if (tile_instances + int(num_tiles) > MAX_NUM_TILE_INSTANCES)
+			flush(flushes_tile_instances);
+		else if (shader_state_changed && shader_state_count == MAX_NUM_SHADER_STATE_INDICES)
+			flush(flushes_shader_states);
+		else if (render_state_changed && render_state_count == MAX_NUM_RENDER_STATE_INDICES)
+			flush(flushes_render_states);
+
+		if (shader_state_count == 0 || shader_state != last_shader_state)
+			shader_state_count++;
+		if (render_state_count == 0 || render_state != last_render_state)
+			render_state_count++;
+		last_shader_state = shader_state;
+		last_render_state = render_state;
+		count++;
+		tile_instances += int(num_tiles);
+	}
+
+	void flush(uint64_t &reason)
+	{
+		reason++;
+		end_frame();
+	}
+
+	void end_frame()
+	{
+		if (count)
+			batches++;
+		count = 0;
+		tile_instances = 0;
+		shader_state_count = 0;
+		render_state_count = 0;
+	}
+};
+
+struct Stats
+{
+	unsigned frames = 0;
+	uint64_t primitives = 0;
+	uint64_t render_state_changes = 0;
+	uint64_t shader_state_changes = 0;
+	size_t max_render_states = 0;
+	std::unordered_set<uint32_t> shader_states;
+
+	Histogram primitive_area;
+	Histogram pixel_depth_complexity;
+	uint64_t fragments = 0;
+	uint64_t covered_pixels = 0;
+	uint64_t screen_pixels = 0;
+
+	FlushModel flush_models[2] = { FlushModel(3), FlushModel(4) };
+};
+
+// Shader state as computed by RasterizerGPU::Impl::compute_shader_state().
+// Dumps do not store texture formats, captures only use one, so it is left out.
+static uint32_t get_shader_state(const DumpRenderState &state)
+{
+	return uint32_t(state.combiner_state) | (uint32_t(state.alpha_threshold) << 8u);
+}
+
+// Same span rules as RasterizerCPU::render_primitive(), clipped to the framebuffer.
+// Returns the number of pixels covered.
+static uint64_t accumulate_coverage(Canvas<uint16_t> &overdraw, const PrimitiveSetupPos &pos)
+{
+	int width = int(overdraw.get_width());
+	int height = int(overdraw.get_height());
+
+	int span_begin_y = std::max((pos.y_lo + (1 << SUBPIXELS_LOG2) - 1) >> SUBPIXELS_LOG2, 0);
+	int span_end_y = std::min((pos.y_hi - 1) >> SUBPIXELS_LOG2, height - 1);
+	constexpr int raster_rounding = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
+
+	uint64_t pixels = 0;
+	for (int y = span_begin_y; y <= span_end_y; y++)
+	{
+		int y_sub = y << SUBPIXELS_LOG2;
+		auto x_a = int32_t(uint32_t(pos.x_a) + uint32_t(pos.dxdy_a) * uint32_t(y_sub - pos.y_lo));
+		auto x_b = int32_t(uint32_t(pos.x_b) + uint32_t(pos.dxdy_b) * uint32_t(y_sub - pos.y_lo));
+		auto x_c = int32_t(uint32_t(pos.x_c) + uint32_t(pos.dxdy_c) * uint32_t(y_sub - pos.y_mid));
+		int primary_x = x_a;
+		int secondary_x = y_sub >= pos.y_mid ? x_c : x_b;
+
+		int start_x, end_x;
+		if (pos.flags & PRIMITIVE_RIGHT_MAJOR_BIT)
+		{
+			start_x = (secondary_x + raster_rounding) >> (16 + SUBPIXELS_LOG2);
+			end_x = (primary_x - 1) >> (16 + SUBPIXELS_LOG2);
+		}
+		else
+		{
+			start_x = (primary_x + raster_rounding) >> (16 + SUBPIXELS_LOG2);
+			end_x = (secondary_x - 1) >> (16 + SUBPIXELS_LOG2);
+		}
+
+		start_x = std::max(start_x, 0);
+		end_x = std::min(end_x, width - 1);
+		for (int x = start_x; x <= end_x; x++)
+		{
+			auto &count = overdraw.get(x, y);
+			if (count != 0xffff)
+				count++;
+		}
+		if (start_x <= end_x)
+			pixels += uint64_t(end_x - start_x + 1);
+	}
+
+	return pixels;
+}
+
+static bool analyze_frame(Stats &stats, const DumpView &view)
+{
+	if (view.width == 0 || view.height == 0 || view.width > 2048 || view.height > 2048)
+	{
+		fprintf(stderr, "Invalid resolution %u x %u.\n", view.width, view.height);
+		return false;
+	}
+
+	Canvas<uint16_t> overdraw;
+	overdraw.resize(view.width, view.height);
+	TileCoverageRect scissor = { 0, 0, int(view.width), int(view.height) };
+
+	for (size_t i = 0; i < view.num_primitives; i++)
+	{
+		uint32_t render_state = view.state_indices[i];
+		uint32_t shader_state = get_shader_state(view.render_states[render_state]);
+		stats.shader_states.insert(shader_state);
+
+		if (i != 0)
+		{
+			uint32_t last_render_state = view.state_indices[i - 1];
+			if (render_state != last_render_state)
+				stats.render_state_changes++;
+			if (shader_state != get_shader_state(view.render_states[last_render_state]))
+				stats.shader_state_changes++;
+		}
+
+		uint64_t pixels = accumulate_coverage(overdraw, view.positions[i]);
+		stats.primitive_area.add(pixels);
+		stats.fragments += pixels;
+
+		for (auto &model : stats.flush_models)
+			model.add_primitive(compute_tile_coverage(view.positions[i], model.tile_size_log2, scissor), shader_state, render_state);
+	}
+
+	for (auto &model : stats.flush_models)
+		model.end_frame();
+
+	for (unsigned y = 0; y < view.height; y++)
+	{
+		for (unsigned x = 0; x < view.width; x++)
+		{
+			unsigned count = overdraw.get(x, y);
+			stats.pixel_depth_complexity.add(count);
+			if (count)
+				stats.covered_pixels++;
+		}
+	}
+
+	stats.screen_pixels += uint64_t(view.width) * view.height;
+	stats.primitives += view.num_primitives;
+	stats.max_render_states = std::max(stats.max_render_states, view.num_render_states);
+	stats.frames++;
+	return true;
+}
+
+static void report(const Stats &stats)
+{
+	double frames = double(std::max(stats.frames, 1u));
+	printf("Frames: %u\n", stats.frames);
+	printf("Primitives: %.1f / frame\n", double(stats.primitives) / frames);
+	printf("Render states: %u distinct, %.1f changes / frame\n",
+	       unsigned(stats.max_render_states), double(stats.render_state_changes) / frames);
+	printf("Shader states: %u distinct, %.1f changes / frame\n",
+	       unsigned(stats.shader_states.size()), double(stats.shader_state_changes) / frames);
+	printf("\n");
+
+	print_histogram("Primitive area (pixels)", stats.primitive_area);
+	printf("\n");
+
+	printf("Overdraw: %.2f fragments / covered pixel, %.2f fragments / pixel, %.2f %% of pixels covered\n",
+	       double(stats.fragments) / double(std::max<uint64_t>(stats.covered_pixels, 1)),
+	       double(stats.fragments) / double(std::max<uint64_t>(stats.screen_pixels, 1)),
+	       100.0 * double(stats.covered_pixels) / double(std::max<uint64_t>(stats.screen_pixels, 1)));
+	print_histogram("Depth complexity (fragments / pixel)", stats.pixel_depth_complexity);
+
+	for (auto &model : stats.flush_models)
+	{
+		unsigned tile_size = 1u << model.tile_size_log2;
+		printf("\n");
+		char title[64];
+		snprintf(title, sizeof(title), "Tiles / primitive, %ux%u tiles", tile_size, tile_size);
+		print_histogram(title, model.tiles_per_primitive);
+		printf("Batches, %ux%u tiles: %.1f / frame\n", tile_size, tile_size, double(model.batches) / frames);
+		printf("  Flushes on MAX_PRIMITIVES: %.1f / frame\n", double(model.flushes_primitives) / frames);
+		printf("  Flushes on MAX_NUM_TILE_INSTANCES: %.1f / frame\n", double(model.flushes_tile_instances) / frames);
+		printf("  Flushes on MAX_NUM_SHADER_STATE_INDICES: %.1f / frame\n", double(model.flushes_shader_states) / frames);
+		printf("  Flushes on MAX_NUM_RENDER_STATE_INDICES: %.1f / frame\n", double(model.flushes_render_states) / frames);
+	}
+}
+
+static bool read_file(std::vector<uint64_t> &data, size_t &size, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	bool ok = fseek(file, 0, SEEK_END) == 0;
+	long len = ok ? ftell(file) : -1;
+	ok = len >= 0 && fseek(file, 0, SEEK_SET) == 0;
+	if (ok)
+	{
+		// 8 byte aligned, so parsed arrays can be used in-place.
+		size = size_t(len);
+		data.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+		ok = size == 0 || fread(data.data(), size, 1, file) == 1;
+	}
+
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: dump-stats <capture>\n");
+		return EXIT_FAILURE;
+	}
+
+	std::vector<uint64_t> data;
+	size_t size = 0;
+	if (!read_file(data, size, argv[1]))
+	{
+		fprintf(stderr, "Failed to read %s.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	Stats stats;
+	DumpView view;
+	DumpData legacy_dump;
+	SequenceReader sequence;
+
+	switch (get_dump_version(data.data(), size))
+	{
+	case DumpVersion::V2:
+		if (!parse_dump(view, data.data(), size))
+		{
+			fprintf(stderr, "Failed to parse dump.\n");
+			return EXIT_FAILURE;
+		}
+		if (!analyze_frame(stats, view))
+			return EXIT_FAILURE;
+		break;
+
+	case DumpVersion::Legacy:
+		if (!parse_dump_legacy(legacy_dump, data.data(), size))
+		{
+			fprintf(stderr, "Failed to parse legacy dump.\n");
+			return EXIT_FAILURE;
+		}
+		if (!analyze_frame(stats, legacy_dump.get_view()))
+			return EXIT_FAILURE;
+		break;
+
+	case DumpVersion::Sequence:
+		if (!sequence.init(data.data(), size))
+		{
+			fprintf(stderr, "Failed to parse sequence.\n");
+			return EXIT_FAILURE;
+		}
+		while (sequence.next_frame(view))
+			if (!analyze_frame(stats, view))
+				return EXIT_FAILURE;
+		if (sequence.failed())
+		{
+			fprintf(stderr, "Sequence is corrupt at frame %u.\n", sequence.get_frame_index());
+			return EXIT_FAILURE;
+		}
+		break;
+
+	default:
+		fprintf(stderr, "Failed to parse header.\n");
+		return EXIT_FAILURE;
+	}
+
+	report(stats);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#include "json_util.hpp"
+#include <stdint.h>
+
+namespace RetroWarp
+{
+void write_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', file);
+
+		if (uint8_t(*str) >= 0x20)
+			fputc(*str, file);
+		else
+			fprintf(file, "\\u%04x", unsigned(uint8_t(*str)));
+	}
+	fputc('"', file);
+}
+}
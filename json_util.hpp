@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdio.h>
+
+namespace RetroWarp
+{
+// Writes str as a quoted JSON string. Names like stages and trace events are built at runtime, so escape them.
+void write_json_string(FILE *file, const char *str);
+}
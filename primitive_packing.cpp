@@ -0,0 +1,165 @@
+#include "primitive_packing.hpp"
+#include <algorithm>
+#include <math.h>
+
+namespace RetroWarp
+{
+static int16_t quantize_snorm16(float value, float scale)
+{
+	if (scale == 0.0f)
+		return 0;
+	float q = roundf(value * (float(0x7fff) / scale));
+	return int16_t(std::max(std::min(q, float(0x7fff)), -float(0x7fff)));
+}
+
+PrimitiveSetupAttrPacked pack_primitive_attributes(const PrimitiveSetupAttr &attr)
+{
+	PrimitiveSetupAttrPacked packed = {};
+	packed.z = attr.z;
+	packed.dzdx = attr.dzdx;
+	packed.dzdy = attr.dzdy;
+
+	// Gradients are quantized against the largest one, so the mantissa of the largest uses all 15 bits.
+	float max_gradient = std::max(std::max(fabsf(attr.djdx), fabsf(attr.dkdx)),
+	                              std::max(fabsf(attr.djdy), fabsf(attr.dkdy)));
+	int exponent = 0;
+	if (max_gradient > 0.0f)
+		frexpf(max_gradient, &exponent);
+	packed.gradient_exponent = int16_t(exponent);
+
+	float gradient_scale = ldexpf(1.0f, exponent);
+	packed.djdx = quantize_snorm16(attr.djdx, gradient_scale);
+	packed.dkdx = quantize_snorm16(attr.dkdx, gradient_scale);
+	packed.djdy = quantize_snorm16(attr.djdy, gradient_scale);
+	packed.dkdy = quantize_snorm16(attr.dkdy, gradient_scale);
+
+	const float us[3] = { attr.u_a, attr.u_b, attr.u_c };
+	const float vs[3] = { attr.v_a, attr.v_b, attr.v_c };
+	const float ws[3] = { attr.w_a, attr.w_b, attr.w_c };
+
+	float max_uv = 0.0f;
+	float max_w = 0.0f;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		max_uv = std::max(max_uv, std::max(fabsf(us[i]), fabsf(vs[i])));
+		max_w = std::max(max_w, fabsf(ws[i]));
+	}
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		packed.u[i] = quantize_snorm16(us[i], max_uv);
+		packed.v[i] = quantize_snorm16(vs[i], max_uv);
+		packed.w[i] = quantize_snorm16(ws[i], max_w);
+	}
+	packed.uv_scale = max_w != 0.0f ? max_uv / max_w : 0.0f;
+
+	packed.u_offset = attr.u_offset;
+	packed.v_offset = attr.v_offset;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		packed.color_a[i] = attr.color_a[i];
+		packed.color_b[i] = attr.color_b[i];
+		packed.color_c[i] = attr.color_c[i];
+	}
+
+	return packed;
+}
+
+PrimitiveSetupAttr unpack_primitive_attributes(const PrimitiveSetupAttrPacked &packed)
+{
+	PrimitiveSetupAttr attr = {};
+	attr.z = packed.z;
+	attr.dzdx = packed.dzdx;
+	attr.dzdy = packed.dzdy;
+
+	float gradient_scale = ldexpf(1.0f, packed.gradient_exponent) / float(0x7fff);
+	attr.djdx = float(packed.djdx) * gradient_scale;
+	attr.dkdx = float(packed.dkdx) * gradient_scale;
+	attr.djdy = float(packed.djdy) * gradient_scale;
+	attr.dkdy = float(packed.dkdy) * gradient_scale;
+
+	attr.u_a = float(packed.u[0]) * packed.uv_scale;
+	attr.u_b = float(packed.u[1]) * packed.uv_scale;
+	attr.u_c = float(packed.u[2]) * packed.uv_scale;
+	attr.v_a = float(packed.v[0]) * packed.uv_scale;
+	attr.v_b = float(packed.v[1]) * packed.uv_scale;
+	attr.v_c = float(packed.v[2]) * packed.uv_scale;
+	attr.w_a = float(packed.w[0]);
+	attr.w_b = float(packed.w[1]);
+	attr.w_c = float(packed.w[2]);
+
+	attr.u_offset = packed.u_offset;
+	attr.v_offset = packed.v_offset;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		attr.color_a[i] = packed.color_a[i];
+		attr.color_b[i] = packed.color_b[i];
+		attr.color_c[i] = packed.color_c[i];
+	}
+
+	return attr;
+}
+
+static bool interpolate_uv(const PrimitiveSetupAttr &attr, const float bary[3], double &u, double &v)
+{
+	double w = attr.w_a * bary[0] + attr.w_b * bary[1] + attr.w_c * bary[2];
+	if (w <= 0.0)
+		return false;
+
+	u = (attr.u_a * bary[0] + attr.u_b * bary[1] + attr.u_c * bary[2]) / w;
+	v = (attr.v_a * bary[0] + attr.v_b * bary[1] + attr.v_c * bary[2]) / w;
+	return true;
+}
+
+void accumulate_packed_attribute_error(PackedAttributeError &error, const PrimitiveSetup &setup)
+{
+	// Primitives which were rejected in setup never produce fragments.
+	if (setup.pos.y_hi <= setup.pos.y_lo)
+		return;
+
+	PrimitiveSetupAttr decoded = unpack_primitive_attributes(pack_primitive_attributes(setup.attr));
+
+	static const float sample_barycentrics[4][3] = {
+		{ 1.0f, 0.0f, 0.0f },
+		{ 0.0f, 1.0f, 0.0f },
+		{ 0.0f, 0.0f, 1.0f },
+		{ 1.0f / 3.0f, 1.0f / 3.0f, 1.0f / 3.0f },
+	};
+
+	for (auto &bary : sample_barycentrics)
+	{
+		double ref_u, ref_v, u, v;
+		if (!interpolate_uv(setup.attr, bary, ref_u, ref_v) || !interpolate_uv(decoded, bary, u, v))
+			continue;
+
+		double uv_error = std::max(fabs(u - ref_u), fabs(v - ref_v));
+		error.max_uv_error = std::max(error.max_uv_error, uv_error);
+		error.total_uv_error += uv_error;
+		error.uv_samples++;
+	}
+
+	// Barycentrics are evaluated relative to the interpolation base, see rasterizer_helpers.h.
+	int x_lo = std::min(std::min(setup.pos.x_a, setup.pos.x_b), setup.pos.x_c) >> 16;
+	int x_hi = std::max(std::max(setup.pos.x_a, setup.pos.x_b), setup.pos.x_c) >> 16;
+	int x_end_a = (setup.pos.x_a + setup.pos.dxdy_a * (setup.pos.y_hi - setup.pos.y_lo)) >> 16;
+	x_lo = std::min(x_lo, x_end_a);
+	x_hi = std::max(x_hi, x_end_a);
+
+	int base_x = setup.pos.x_a >> 16;
+	int base_y = setup.pos.y_lo;
+	const int corners_x[2] = { x_lo - base_x, x_hi - base_x };
+	const int corners_y[2] = { 0, setup.pos.y_hi - base_y };
+
+	for (int dy : corners_y)
+	{
+		for (int dx : corners_x)
+		{
+			double dj = (double(decoded.djdx) - setup.attr.djdx) * dx + (double(decoded.djdy) - setup.attr.djdy) * dy;
+			double dk = (double(decoded.dkdx) - setup.attr.dkdx) * dx + (double(decoded.dkdy) - setup.attr.dkdy) * dy;
+			error.max_barycentric_error = std::max(error.max_barycentric_error, std::max(fabs(dj), fabs(dk)));
+		}
+	}
+
+	error.primitives++;
+}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "primitive_setup.hpp"
+
+namespace RetroWarp
+{
+// Compact encoding of primitive attributes for upload to the GPU.
+// Depth and colors are kept as-is, UV and W are normalized to 16-bit per primitive,
+// and barycentric gradients share one exponent.
+PrimitiveSetupAttrPacked pack_primitive_attributes(const PrimitiveSetupAttr &attr);
+
+// UV and W are returned with a common scale which differs from the original attributes.
+// It cancels out when interpolating UV / W.
+PrimitiveSetupAttr unpack_primitive_attributes(const PrimitiveSetupAttrPacked &packed);
+
+struct PackedAttributeError
+{
+	// Error in perspective correct UV, in texels, sampled at the vertices and center of primitives.
+	double max_uv_error = 0.0;
+	double total_uv_error = 0.0;
+	uint64_t uv_samples = 0;
+
+	// Error in barycentric weights at the corners of the primitive bounding box.
+	double max_barycentric_error = 0.0;
+	uint64_t primitives = 0;
+};
+
+void accumulate_packed_attribute_error(PackedAttributeError &error, const PrimitiveSetup &setup);
+}
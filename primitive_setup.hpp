@@ -40,6 +40,30 @@ struct PrimitiveSetupAttr
 	int16_t v_offset;
 };
 
+// Optional compact encoding of PrimitiveSetupAttr for the GPU, see primitive_packing.hpp.
+// Must match PrimitiveSetupAttrPacked in assets/shaders/primitive_setup.h.
+struct PrimitiveSetupAttrPacked
+{
+	float z, dzdx, dzdy;
+	// Ratio between the scales of UV and W, which are normalized separately.
+	float uv_scale;
+	// Barycentric gradients, mantissas with a shared exponent.
+	int16_t djdx, dkdx;
+	int16_t djdy, dkdy;
+	int16_t u_offset;
+	int16_t v_offset;
+	// Normalized to [-0x7fff, 0x7fff].
+	int16_t u[3];
+	int16_t v[3];
+	int16_t w[3];
+	int16_t gradient_exponent;
+	uint8_t color_a[4];
+	uint8_t color_b[4];
+	uint8_t color_c[4];
+};
+
+static_assert(sizeof(PrimitiveSetupAttrPacked) == 60, "PrimitiveSetupAttrPacked must be 60 bytes.");
+
 struct PrimitiveSetup
 {
 	PrimitiveSetupPos pos;
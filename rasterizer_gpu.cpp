@@ -1,11 +1,22 @@
 #include <context.hpp>
 #include "rasterizer_gpu.hpp"
+#include "primitive_packing.hpp"
+#include "tile_coverage.hpp"
+#include "rasterizer_limits.hpp"
+#include "trace_recorder.hpp"
 #include "context.hpp"
 #include "device.hpp"
 #include <stdexcept>
 #include "math.hpp"
 #include "stb_image_write.h"
+#include "logging.hpp"
 #include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 using namespace Granite;
 using namespace Vulkan;
@@ -17,12 +28,55 @@ struct BBox
 	int min_x, max_x, min_y, max_y;
 };
 
-constexpr unsigned MAX_NUM_SHADER_STATE_INDICES = 64;
-constexpr unsigned MAX_NUM_RENDER_STATE_INDICES = 1024;
 constexpr unsigned VRAM_SIZE = 64 * 1024 * 1024;
+// With a compact work list, this many shader states or more are shaded by one dynamic state combiner dispatch.
+constexpr unsigned MIN_SHADER_STATES_MERGED_COMBINER = 8;
+// Flushes whose statistics can be in flight before read_statistics() or the next flush has to wait for one.
+constexpr unsigned STATISTICS_RING_SIZE = 8;
+
+// Byte range [begin, end) of VRAM.
+struct VRAMRange
+{
+	uint32_t begin, end;
+};
+
+static bool vram_ranges_overlap(const VRAMRange &a, const VRAMRange &b)
+{
+	return a.begin < b.end && b.begin < a.end;
+}
+
+struct DisplayList
+{
+	// One batch per flush which happened while recording.
+	// Buffers are the device-local staging buffers, which are never written to again once recorded.
+	struct Batch
+	{
+		BufferHandle positions;
+		BufferHandle attributes;
+		BufferHandle shader_state_index;
+		BufferHandle render_state_index;
+		BufferHandle render_state;
+		// Non-null if the batch was compacted after GPU triangle setup, see Impl::compact_triangle_setup().
+		BufferHandle primitive_counts;
+		uint32_t shader_states[MAX_NUM_SHADER_STATE_INDICES];
+		unsigned shader_state_count;
+		unsigned render_state_count;
+		unsigned count;
+		unsigned num_conservative_tile_instances;
+		bool depth_may_increase;
+		bool split_capable;
+		bool opaque_depth_write;
+		bool non_opaque_depth_write;
+		bool packed_attributes;
+		std::vector<VRAMRange> texture_ranges;
+	};
+	std::vector<Batch> batches;
+};
 
 struct RasterizerGPU::Impl
 {
+	~Impl();
+
 	Device *device;
 	BufferHandle vram_buffer;
 
@@ -32,12 +86,28 @@ struct RasterizerGPU::Impl
 		uint32_t width = 0;
 		uint32_t height = 0;
 		uint32_t stride = 0;
+
+		bool operator==(const Framebuffer &other) const
+		{
+			return offset == other.offset && width == other.width && height == other.height && stride == other.stride;
+		}
 	};
 
 	Framebuffer color, depth;
 
+	// Framebuffers which a range of primitives in a batch renders into, see set_color_framebuffer().
+	struct RenderTarget
+	{
+		Framebuffer color, depth;
+		uint32_t color_clear_generation;
+		uint32_t depth_clear_generation;
+		unsigned first_primitive;
+	};
+
 	bool subgroup = false;
-	bool ubershader = false;
+	PipelineMode pipeline_mode = PipelineMode::Split;
+	bool packed_attributes = false;
+	AutoPipelineThresholds auto_pipeline;
 	bool async_compute = false;
 
 	struct
@@ -65,8 +135,87 @@ struct RasterizerGPU::Impl
 		BufferHandle flags[2];
 		unsigned index = 0;
 		Semaphore rop_complete[2];
+		// Framebuffer memory written by the ROP signalling rop_complete, color and depth of every target.
+		std::vector<VRAMRange> rop_ranges[2];
 	} tile_instance_data;
 
+	struct
+	{
+		// Farthest depth value per tile, written by ROP and consumed by binning.
+		BufferHandle max_depth;
+		// Number of flushes which must pass before max_depth can be trusted again.
+		unsigned invalid_flushes = 0;
+		bool cull = false;
+	} hiz;
+
+	struct
+	{
+		// Per-tile fast clear flags, color tiles followed by depth tiles.
+		// A tile is considered cleared if its flag matches the current generation.
+		// Generation 1 is never used for clears, so nothing is cleared initially.
+		BufferHandle tile_flags;
+		uint32_t generation = 1;
+		uint32_t color_generation = 1;
+		uint32_t depth_generation = 1;
+		uint16_t color_value = 0;
+		uint16_t depth_value = 0;
+		bool pending = false;
+	} fast_clear;
+
+	struct
+	{
+		// Tiles which had any primitive binned, so ROP can skip empty tiles with an indirect dispatch.
+		// Indirect dispatch arguments followed by packed tile coordinates, one list per tile instance index.
+		BufferHandle list[2];
+		// Generation in which each tile was last appended.
+		BufferHandle tile_generation;
+		uint32_t generation = 0;
+		bool enabled = true;
+	} active_tiles;
+
+	struct
+	{
+		// Nearest opaque depth for every pixel, laid out as one tile after the other.
+		// Only read by the combiner of the same flush, so one buffer is enough.
+		BufferHandle depth;
+		bool enabled = false;
+	} depth_prepass;
+
+	struct
+	{
+		// Persistent presentation images, cycled through so we don't overwrite an image which is still being read.
+		ImageHandle images[3];
+		unsigned index = 0;
+		unsigned width = 0;
+		unsigned height = 0;
+	} present;
+
+	struct PendingReadback
+	{
+		ReadbackHandle handle;
+		ReadbackFormat format;
+		unsigned width, height;
+		BufferHandle buffer;
+		Fence fence;
+		ReadbackCallback callback;
+	};
+
+	struct
+	{
+		std::deque<PendingReadback> pending;
+		std::vector<BufferHandle> buffer_pool;
+		std::vector<u8vec4> unpacked;
+		ReadbackHandle next_handle = 1;
+
+		// PNG encoding worker.
+		std::thread worker;
+		std::mutex lock;
+		std::condition_variable cond;
+		std::deque<std::function<void ()>> jobs;
+		unsigned jobs_in_flight = 0;
+		bool shutdown = false;
+	} readback;
+
 	struct RenderState
 	{
 		int16_t scissor_x = 0;
@@ -82,6 +231,17 @@ struct RasterizerGPU::Impl
 	};
 	static_assert(sizeof(RenderState) == 64, "Sizeof render state must be 64.");
 
+	struct TriangleSetupJob
+	{
+		BufferHandle vertices;
+		BufferHandle indices;
+		uint32_t first_index;
+		uint32_t primitive_offset;
+		uint32_t triangle_count;
+		CullMode cull_mode;
+		ViewportTransform viewport;
+	};
+
 	struct
 	{
 		BufferHandle positions;
@@ -95,19 +255,52 @@ struct RasterizerGPU::Impl
 		BufferHandle render_state_index_gpu;
 		BufferHandle render_state_gpu;
 		PrimitiveSetupPos *mapped_positions = nullptr;
-		PrimitiveSetupAttr *mapped_attributes = nullptr;
+		// PrimitiveSetupAttr, or PrimitiveSetupAttrPacked if packed_attributes is set.
+		void *mapped_attributes = nullptr;
 		uint8_t *mapped_shader_state_index = nullptr;
 		uint16_t *mapped_render_state_index = nullptr;
 		RenderState *mapped_render_state = nullptr;
 		unsigned count = 0;
 		unsigned num_conservative_tile_instances = 0;
 		bool host_visible = false;
+		bool depth_may_increase = false;
+		// Shader states and conservative tile counts were tracked, so the split pipeline can render this batch.
+		bool split_capable = false;
+		// Whether any render state writing depth is opaque, or not, see depth_state_is_opaque().
+		bool opaque_depth_write = false;
+		bool non_opaque_depth_write = false;
+		// Attribute layout of this batch, see set_packed_attributes().
+		bool packed_attributes = false;
+		// VRAM which textures sampled by this batch can read from.
+		std::vector<VRAMRange> texture_ranges;
+		// Targets in the order they were rendered to. Each one covers primitives up to the first primitive of the next.
+		std::vector<RenderTarget> targets;
+		// HiZ only describes one depth buffer, so binning cannot cull if targets use different ones.
+		bool mixed_depth_targets = false;
+		// The depth target changed while this batch was pending, HiZ starts over once its ROP is done.
+		bool reset_hiz = false;
+
+		// Triangles which are set up on the GPU before binning, one primitive slot each.
+		std::vector<TriangleSetupJob> setup_jobs;
+		// Once GPU triangle setup has run, count is only an upper bound, the real count lives here.
+		// Layout matches PrimitiveOffsets in primitive_offsets.comp.
+		BufferHandle primitive_counts;
+		// Indirect binning dispatches derived from primitive_counts for the current flush.
+		BufferHandle binning_dispatch;
 	} staging;
 
 	struct
 	{
 		BufferHandle item_count_per_variant;
+		// One range of MAX_NUM_TILE_INSTANCES + 1 items for every variant.
 		BufferHandle work_list_per_variant;
+
+		// Compact work list, see set_compact_work_list().
+		// Binning writes items in tile instance order, they are then scattered into one list sorted by variant.
+		BufferHandle work_list_unsorted;
+		BufferHandle work_list_sorted;
+		BufferHandle work_list_offsets;
+		bool compact = false;
 	} raster_work;
 
 	struct
@@ -121,6 +314,71 @@ struct RasterizerGPU::Impl
 		unsigned render_state_count = 0;
 	} state;
 
+	// Non-null while recording a display list.
+	std::shared_ptr<DisplayList> recording;
+
+	struct TimingInterval
+	{
+		QueryPoolHandle start;
+		QueryPoolHandle end;
+		const char *name;
+	};
+
+	struct
+	{
+		bool enabled = false;
+		std::vector<TimingInterval> current;
+		std::deque<std::vector<TimingInterval>> frames;
+	} stage_timing;
+
+	void register_time_interval(const QueryPoolHandle &start, const QueryPoolHandle &end, const char *name);
+	void read_stage_timings(std::vector<std::vector<StageTiming>> &frames);
+
+	struct
+	{
+		TraceRecorder *recorder = nullptr;
+		// GPU ticks are mapped to the recorder clock relative to one calibration point.
+		// Zero if the device does not support timestamps.
+		double ns_per_tick = 0.0;
+		uint64_t calibration_ticks = 0;
+		int64_t calibration_ns = 0;
+		std::deque<TimingInterval> pending;
+	} trace;
+
+	void set_trace_recorder(TraceRecorder *recorder);
+	void resolve_trace();
+
+	// Snapshot of the counters taken at the end of one flush.
+	struct StatisticsReadback
+	{
+		BufferHandle counters;
+		// Copy of the indirect dispatch arguments, one uvec4 per shader state.
+		BufferHandle item_counts;
+		uint32_t shader_states[MAX_NUM_SHADER_STATE_INDICES];
+		unsigned shader_state_count;
+		// Signalled once the snapshot has landed, null if the slot is free.
+		Fence fence;
+	};
+
+	struct
+	{
+		bool enabled = false;
+		// Layout matches statistics.h. Counters are 32-bit and never cleared while rendering, since the next flush
+		// might already be binning on the async queue. Totals accumulate the difference between snapshots instead.
+		BufferHandle counters;
+		uint32_t last_counters[8] = {};
+		StatisticsReadback ring[STATISTICS_RING_SIZE];
+		unsigned ring_index = 0;
+		PipelineStatistics totals;
+	} statistics;
+
+	void begin_statistics_snapshot();
+	void copy_variant_statistics(CommandBuffer &cmd);
+	Fence *copy_statistics_counters(CommandBuffer &cmd);
+	void fold_statistics(StatisticsReadback &readback);
+	PipelineStatistics read_statistics();
+	void reset_statistics();
+
 	void init(Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size);
 
 	void reset_staging();
@@ -131,24 +389,83 @@ struct RasterizerGPU::Impl
 	void init_prefix_sum_buffers();
 	void init_tile_buffers();
 	void init_raster_work_buffers();
+	void init_hiz_buffer();
+	void init_fast_clear_buffer();
+	void init_statistics_buffer();
+	void init_active_tile_buffers();
+	void init_depth_prepass_buffer();
 	void flush();
+	void dispatch_batch();
+	void record_batch();
+	void install_batch(const DisplayList::Batch &batch);
+	void replay(const DisplayList &list);
 	void flush_ubershader();
 	void flush_split();
+	bool select_ubershader() const;
+	void set_pipeline_mode(PipelineMode mode);
+	void set_compact_work_list(bool enable);
+	void set_indirect_rop(bool enable);
+	void set_depth_prepass(bool enable);
+	void set_packed_attributes(bool enable);
+	void add_texture_range(const TextureDescriptor &tex);
+	bool batch_samples_vram_range(const VRAMRange &range) const;
+	bool batch_renders_texture(const TextureDescriptor &tex, bool include_last_target) const;
+	void wait_for_render_to_texture(CommandBuffer::Type queue_type);
+	void record_rop_ranges();
+	size_t get_attribute_size() const;
+	bool use_depth_prepass() const;
 	ImageHandle copy_to_framebuffer();
 
-	void queue_primitive(const PrimitiveSetup &setup);
-	unsigned compute_num_conservative_tiles(const PrimitiveSetup &setup) const;
+	unsigned allocate_primitives(unsigned count, unsigned num_conservative_tiles, bool gpu_setup = false);
+	void queue_primitive(const PrimitiveSetupPos &pos, const PrimitiveSetupAttr &attr);
+	void queue_triangles(const Vertex *vertices, size_t vertex_count, const uint32_t *indices, size_t triangle_count,
+	                     CullMode mode, const ViewportTransform &vp);
+	unsigned compute_num_conservative_tiles(const PrimitiveSetupPos &pos) const;
+	unsigned compute_num_conservative_tiles(const BBox &bbox) const;
+	bool compute_unclipped_bbox(BBox &bbox, const Vertex *vertices, const uint32_t *indices, const ViewportTransform &vp) const;
+
+	void dispatch_triangle_setup(CommandBuffer &cmd, const TriangleSetupJob &job, unsigned max_setups, bool packed,
+	                             const Buffer &positions, const Buffer &attributes, const Buffer *counts);
+	void run_triangle_setup();
+	void compact_triangle_setup(CommandBuffer &cmd);
+	void build_binning_dispatch(CommandBuffer &cmd, unsigned index, unsigned primitives_per_group,
+	                            unsigned groups_y, unsigned groups_z);
+	size_t validate_triangle_setup(const Vertex *vertices, size_t vertex_count, const uint32_t *indices, size_t triangle_count,
+	                               CullMode mode, const ViewportTransform &vp);
 
-	BBox compute_bbox(const PrimitiveSetup &setup) const;
 	bool clip_bbox_scissor(BBox &clipped_bbox, const BBox &bbox) const;
 
-	void set_fb_info(CommandBuffer &cmd);
+	RenderTarget get_current_target(unsigned first_primitive) const;
+	bool target_is_current(const RenderTarget &target) const;
+	void get_batch_resolution(uint32_t &width, uint32_t &height) const;
+	void set_fb_info(CommandBuffer &cmd, const RenderTarget &target, unsigned primitive_end);
+	void set_batch_fb_info(CommandBuffer &cmd, unsigned target_index);
 	void clear_indirect_buffer(CommandBuffer &cmd);
+	void reset_active_tiles(CommandBuffer &cmd);
+	void dispatch_rop(CommandBuffer &cmd);
+	void run_depth_prepass(CommandBuffer &cmd);
 	void binning_low_res_prepass(CommandBuffer &cmd);
 	void binning_full_res(CommandBuffer &cmd, bool ubershader);
+	void build_compact_work_list(CommandBuffer &cmd);
 	void dispatch_combiner_work(CommandBuffer &cmd);
 	void run_rop(CommandBuffer &cmd);
 	void run_rop_ubershader(CommandBuffer &cmd);
+	void run_rop_targets(CommandBuffer &cmd, bool ubershader);
+
+	void begin_hiz();
+	void end_hiz();
+	void reset_hiz(CommandBuffer &cmd, uint32_t value);
+
+	void fast_clear_tiles(CommandBuffer &cmd, bool depth_tiles);
+	void resolve_fast_clears();
+
+	ReadbackHandle request_readback(ReadbackFormat format, ReadbackCallback callback);
+	ReadbackHandle request_vram_readback(uint32_t offset, size_t size, ReadbackCallback callback);
+	BufferHandle allocate_readback_buffer(VkDeviceSize size);
+	void complete_readback(PendingReadback &pending);
+	void poll_readbacks(bool wait);
+	void queue_readback_job(std::function<void ()> job);
+	void readback_worker();
 
 	bool can_support_minimum_subgroup_size(unsigned size) const;
 	bool supports_subgroup_size_control(uint32_t minimum_size, uint32_t maximum_size) const;
@@ -167,9 +484,6 @@ struct FBInfo
 {
 	uvec2 resolution;
 	uvec2 resolution_tiles;
-	uint32_t primitive_count;
-	uint32_t primitive_count_32;
-	uint32_t primitive_count_1024;
 
 	uint32_t color_offset;
 	uint32_t color_width;
@@ -180,17 +494,33 @@ struct FBInfo
 	uint32_t depth_width;
 	uint32_t depth_height;
 	uint32_t depth_stride;
+
+	uint32_t hiz_cull;
+
+	uint32_t color_clear_value;
+	uint32_t depth_clear_value;
+	uint32_t color_clear_generation;
+	uint32_t depth_clear_generation;
+
+	uint32_t active_tile_generation;
+
+	uint32_t primitive_begin;
+	uint32_t primitive_end;
+};
+
+struct PrimitiveCounts
+{
+	uint32_t primitive_count;
+	uint32_t primitive_count_32;
+	uint32_t primitive_count_1024;
 };
 
-constexpr int MAX_PRIMITIVES = 0x4000;
 constexpr int TILE_BINNING_STRIDE = MAX_PRIMITIVES / 32;
 constexpr int TILE_BINNING_STRIDE_COARSE = TILE_BINNING_STRIDE / 32;
 constexpr int MAX_WIDTH = 2048;
 constexpr int MAX_HEIGHT = 2048;
 constexpr int TILE_DOWNSAMPLE = 8;
 constexpr int TILE_DOWNSAMPLE_LOG2 = 3;
-constexpr int MAX_NUM_TILE_INSTANCES = 0xffff;
-const int RASTER_ROUNDING = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
 
 struct TileRasterWork
 {
@@ -206,10 +536,29 @@ void RasterizerGPU::Impl::reset_staging()
 	state.shader_state_count = 0;
 }
 
+static bool depth_state_may_increase_depth(uint8_t depth_state)
+{
+	if ((depth_state & uint8_t(DepthWrite::On)) == 0)
+		return false;
+
+	auto test = DepthTest(depth_state & 7);
+	return test != DepthTest::LE && test != DepthTest::LEQ && test != DepthTest::EQ && test != DepthTest::Never;
+}
+
+// Opaque fragments overwrite color completely and can only move depth closer. Must match depth_prepass.comp.
+static bool depth_state_is_opaque(uint8_t depth_state, uint8_t blend_state, uint8_t alpha_threshold)
+{
+	auto test = DepthTest(depth_state & 7);
+	return (depth_state & uint8_t(DepthWrite::On)) != 0 &&
+	       (test == DepthTest::LE || test == DepthTest::LEQ) &&
+	       BlendState(blend_state) == BlendState::Replace &&
+	       alpha_threshold == 0;
+}
+
 uint32_t RasterizerGPU::Impl::compute_shader_state() const
 {
 	// Ignore shader state for ubershaders.
-	if (ubershader)
+	if (pipeline_mode == PipelineMode::Ubershader)
 		return 0;
 
 	uint32_t shader_state = 0;
@@ -219,39 +568,6 @@ uint32_t RasterizerGPU::Impl::compute_shader_state() const
 	return shader_state;
 }
 
-BBox RasterizerGPU::Impl::compute_bbox(const PrimitiveSetup &setup) const
-{
-	int lo_x = std::numeric_limits<int>::max();
-	int hi_x = std::numeric_limits<int>::min();
-	int lo_y = std::numeric_limits<int>::max();
-	int hi_y = std::numeric_limits<int>::min();
-
-	lo_x = std::min(lo_x, setup.pos.x_a);
-	lo_x = std::min(lo_x, setup.pos.x_b);
-	lo_x = std::min(lo_x, setup.pos.x_c);
-	hi_x = std::max(hi_x, setup.pos.x_a);
-	hi_x = std::max(hi_x, setup.pos.x_b);
-	hi_x = std::max(hi_x, setup.pos.x_c);
-
-	int end_point_a = setup.pos.x_a + setup.pos.dxdy_a * (setup.pos.y_hi - setup.pos.y_lo);
-	int end_point_b = setup.pos.x_b + setup.pos.dxdy_b * (setup.pos.y_mid - setup.pos.y_lo);
-	int end_point_c = setup.pos.x_c + setup.pos.dxdy_c * (setup.pos.y_hi - setup.pos.y_mid);
-
-	lo_x = std::min(lo_x, end_point_a);
-	lo_x = std::min(lo_x, end_point_b);
-	lo_x = std::min(lo_x, end_point_c);
-	hi_x = std::max(hi_x, end_point_a);
-	hi_x = std::max(hi_x, end_point_b);
-	hi_x = std::max(hi_x, end_point_c);
-
-	BBox bbox = {};
-	bbox.min_x = (lo_x + RASTER_ROUNDING) >> (16 + SUBPIXELS_LOG2);
-	bbox.max_x = (hi_x - 1) >> (16 + SUBPIXELS_LOG2);
-	bbox.min_y = (setup.pos.y_lo + (1 << SUBPIXELS_LOG2) - 1) >> SUBPIXELS_LOG2;
-	bbox.max_y = (setup.pos.y_hi - 1) >> SUBPIXELS_LOG2;
-	return bbox;
-}
-
 bool RasterizerGPU::Impl::clip_bbox_scissor(BBox &clipped_bbox, const BBox &bbox) const
 {
 	int scissor_x = state.current_render_state.scissor_x;
@@ -267,9 +583,67 @@ bool RasterizerGPU::Impl::clip_bbox_scissor(BBox &clipped_bbox, const BBox &bbox
 	return clipped_bbox.min_x <= clipped_bbox.max_x && clipped_bbox.min_y <= clipped_bbox.max_y;
 }
 
-unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetup &setup) const
+unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetupPos &pos) const
+{
+	// The setup is final, so count exactly which tiles binning will touch rather than the bounding box.
+	// Large primitives only covering a diagonal band of tiles would otherwise dominate the flush budget.
+	const auto &rs = state.current_render_state;
+	TileCoverageRect scissor = { rs.scissor_x, rs.scissor_y, rs.scissor_width, rs.scissor_height };
+	return compute_tile_coverage(pos, unsigned(tile_size_log2), scissor);
+}
+
+static int clamp_screen_coord(float v)
+{
+	if (!(v > -4096.0f))
+		return -4096;
+	else if (v > 4096.0f)
+		return 4096;
+	else
+		return int(floorf(v));
+}
+
+bool RasterizerGPU::Impl::compute_unclipped_bbox(BBox &bbox, const Vertex *vertices, const uint32_t *indices,
+                                                 const ViewportTransform &vp) const
+{
+	// Mirrors the clip rules in setup_clipped_triangles().
+	// If no vertex needs clipping, setup produces at most one primitive, which lies within the projected triangle.
+	static const float MIN_W = 1.0f / 1024.0f;
+
+	float lo_x = std::numeric_limits<float>::max();
+	float hi_x = std::numeric_limits<float>::lowest();
+	float lo_y = std::numeric_limits<float>::max();
+	float hi_y = std::numeric_limits<float>::lowest();
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		auto &v = vertices[indices[i]];
+		if (!(v.w >= MIN_W))
+			return false;
+
+		float iw = 1.0f / v.w;
+		float x = vp.x + (0.5f * (v.x * iw) + 0.5f) * vp.width;
+		float y = vp.y + (0.5f * (v.y * iw) + 0.5f) * vp.height;
+		float z = v.z * iw;
+
+		if (!(x >= -2048.0f && x <= 2047.0f && y >= -2048.0f && y <= 2047.0f && z >= 0.0f && z <= 1.0f))
+			return false;
+
+		lo_x = std::min(lo_x, x);
+		hi_x = std::max(hi_x, x);
+		lo_y = std::min(lo_y, y);
+		hi_y = std::max(hi_y, y);
+	}
+
+	// Pad by a pixel to cover rounding in setup.
+	bbox.min_x = clamp_screen_coord(lo_x) - 1;
+	bbox.max_x = clamp_screen_coord(hi_x) + 1;
+	bbox.min_y = clamp_screen_coord(lo_y) - 1;
+	bbox.max_y = clamp_screen_coord(hi_y) + 1;
+	return true;
+}
+
+unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const BBox &bbox) const
 {
-	auto bbox = compute_bbox(setup);
 	BBox clipped_bbox;
 	if (!clip_bbox_scissor(clipped_bbox, bbox))
 		return 0;
@@ -283,6 +657,8 @@ unsigned RasterizerGPU::Impl::compute_num_conservative_tiles(const PrimitiveSetu
 
 void RasterizerGPU::Impl::begin_staging()
 {
+	staging.packed_attributes = packed_attributes;
+
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
 
@@ -290,12 +666,12 @@ void RasterizerGPU::Impl::begin_staging()
 	info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupPos);
 	staging.positions_gpu = device->create_buffer(info);
 	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-	info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupAttr);
+	info.size = MAX_PRIMITIVES * get_attribute_size();
 	staging.attributes_gpu = device->create_buffer(info);
 	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	info.size = MAX_PRIMITIVES * sizeof(uint8_t);
 	staging.shader_state_index_gpu = device->create_buffer(info);
-	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	info.size = MAX_PRIMITIVES * sizeof(uint16_t);
 	staging.render_state_index_gpu = device->create_buffer(info);
 	info.size = MAX_NUM_RENDER_STATE_INDICES * sizeof(RenderState);
@@ -304,9 +680,7 @@ void RasterizerGPU::Impl::begin_staging()
 	staging.mapped_positions = static_cast<PrimitiveSetupPos *>(
 			device->map_host_buffer(*staging.positions_gpu,
 			                       MEMORY_ACCESS_WRITE_BIT));
-	staging.mapped_attributes = static_cast<PrimitiveSetupAttr *>(
-			device->map_host_buffer(*staging.attributes_gpu,
-			                       MEMORY_ACCESS_WRITE_BIT));
+	staging.mapped_attributes = device->map_host_buffer(*staging.attributes_gpu, MEMORY_ACCESS_WRITE_BIT);
 	staging.mapped_shader_state_index = static_cast<uint8_t *>(
 			device->map_host_buffer(*staging.shader_state_index_gpu,
 			                        MEMORY_ACCESS_WRITE_BIT));
@@ -335,7 +709,7 @@ void RasterizerGPU::Impl::begin_staging()
 		info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupPos);
 		staging.positions = device->create_buffer(info);
 
-		info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupAttr);
+		info.size = MAX_PRIMITIVES * get_attribute_size();
 		staging.attributes = device->create_buffer(info);
 
 		info.size = MAX_PRIMITIVES * sizeof(uint8_t);
@@ -350,9 +724,7 @@ void RasterizerGPU::Impl::begin_staging()
 		staging.mapped_positions = static_cast<PrimitiveSetupPos *>(
 				device->map_host_buffer(*staging.positions,
 				                        MEMORY_ACCESS_WRITE_BIT));
-		staging.mapped_attributes = static_cast<PrimitiveSetupAttr *>(
-				device->map_host_buffer(*staging.attributes,
-				                        MEMORY_ACCESS_WRITE_BIT));
+		staging.mapped_attributes = device->map_host_buffer(*staging.attributes, MEMORY_ACCESS_WRITE_BIT);
 		staging.mapped_shader_state_index = static_cast<uint8_t *>(
 				device->map_host_buffer(*staging.shader_state_index,
 				                        MEMORY_ACCESS_WRITE_BIT));
@@ -369,6 +741,7 @@ void RasterizerGPU::Impl::begin_staging()
 
 	staging.count = 0;
 	staging.num_conservative_tile_instances = 0;
+	staging.split_capable = pipeline_mode != PipelineMode::Ubershader;
 }
 
 void RasterizerGPU::Impl::end_staging()
@@ -394,7 +767,7 @@ void RasterizerGPU::Impl::end_staging()
 	{
 		auto cmd = device->request_command_buffer(CommandBuffer::Type::AsyncTransfer);
 		cmd->copy_buffer(*staging.positions_gpu, 0, *staging.positions, 0, staging.count * sizeof(PrimitiveSetupPos));
-		cmd->copy_buffer(*staging.attributes_gpu, 0, *staging.attributes, 0, staging.count * sizeof(PrimitiveSetupAttr));
+		cmd->copy_buffer(*staging.attributes_gpu, 0, *staging.attributes, 0, staging.count * get_attribute_size());
 		cmd->copy_buffer(*staging.shader_state_index_gpu, 0, *staging.shader_state_index, 0, staging.count * sizeof(uint8_t));
 		cmd->copy_buffer(*staging.render_state_index_gpu, 0, *staging.render_state_index, 0, staging.count * sizeof(uint16_t));
 		cmd->copy_buffer(*staging.render_state_gpu, 0, *staging.render_state, 0, state.render_state_count * sizeof(RenderState));
@@ -416,16 +789,70 @@ void RasterizerGPU::Impl::clear_indirect_buffer(CommandBuffer &cmd)
 	cmd.set_specialization_constant_mask(0);
 }
 
+void RasterizerGPU::Impl::reset_active_tiles(CommandBuffer &cmd)
+{
+	// Must happen after waiting for the ROP which last consumed this list.
+	// Use a compute shader rather than a transfer, since we only wait for ROP in the compute stage.
+	cmd.begin_region("reset-active-tiles");
+	cmd.set_program("assets://shaders/clear_indirect_buffers.comp");
+	cmd.set_specialization_constant_mask(1);
+	cmd.set_specialization_constant(0, 1u);
+	cmd.set_storage_buffer(0, 0, *active_tiles.list[tile_instance_data.index], 0, 4 * sizeof(uint32_t));
+	cmd.dispatch(1, 1, 1);
+	cmd.set_specialization_constant_mask(0);
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	cmd.end_region();
+}
+
+void RasterizerGPU::Impl::dispatch_rop(CommandBuffer &cmd)
+{
+	if (active_tiles.enabled)
+	{
+		cmd.dispatch_indirect(*active_tiles.list[tile_instance_data.index], 0);
+	}
+	else
+	{
+		uint32_t width, height;
+		get_batch_resolution(width, height);
+		cmd.dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	}
+}
+
+void RasterizerGPU::Impl::run_depth_prepass(CommandBuffer &cmd)
+{
+	cmd.begin_region("depth-prepass");
+	cmd.set_program("assets://shaders/depth_prepass.comp", {
+		{"TILE_SIZE", tile_size},
+		{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0},
+		{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0}
+	});
+
+	cmd.set_storage_buffer(0, 0, *depth_prepass.depth);
+	cmd.set_storage_buffer(0, 1, *binning.mask_buffer[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_coarse[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 3, *staging.positions_gpu);
+	cmd.set_storage_buffer(0, 4, *staging.attributes_gpu);
+	cmd.set_uniform_buffer(0, 5, *staging.render_state_index_gpu);
+	cmd.set_uniform_buffer(0, 6, *staging.render_state_gpu);
+	if (active_tiles.enabled)
+		cmd.set_storage_buffer(0, 7, *active_tiles.list[tile_instance_data.index]);
+
+	// Same tiles as ROP, which are all the tiles the combiner can touch.
+	dispatch_rop(cmd);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd.end_region();
+}
+
 void RasterizerGPU::Impl::binning_low_res_prepass(CommandBuffer &cmd)
 {
-	uint32_t width = std::max(color.width, depth.width);
-	uint32_t height = std::max(color.height, depth.height);
+	uint32_t width, height;
+	get_batch_resolution(width, height);
 
-	cmd.begin_region("binning-low-res-prepass");
-	cmd.set_storage_buffer(0, 0, *binning.mask_buffer_low_res);
-	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
-	cmd.set_uniform_buffer(0, 2, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 3, *staging.render_state_gpu);
+	uint32_t groups_y = (width + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size);
+	uint32_t groups_z = (height + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size);
 
 	auto &features = device->get_device_features();
 	uint32_t subgroup_size = features.subgroup_properties.subgroupSize;
@@ -442,9 +869,22 @@ void RasterizerGPU::Impl::binning_low_res_prepass(CommandBuffer &cmd)
 #endif
 
 	const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_BASIC_BIT;
-	if (subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
-	    (features.subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
-	    can_support_minimum_subgroup_size(32) && subgroup_size <= 64)
+	bool use_subgroup = subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
+	                    (features.subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
+	                    can_support_minimum_subgroup_size(32) && subgroup_size <= 64;
+	// One primitive per invocation.
+	uint32_t group_size = use_subgroup ? subgroup_size : 32;
+
+	if (staging.primitive_counts)
+		build_binning_dispatch(cmd, 0, group_size, groups_y, groups_z);
+
+	cmd.begin_region("binning-low-res-prepass");
+	cmd.set_storage_buffer(0, 0, *binning.mask_buffer_low_res);
+	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
+	cmd.set_uniform_buffer(0, 2, *staging.render_state_index_gpu);
+	cmd.set_uniform_buffer(0, 3, *staging.render_state_gpu);
+
+	if (use_subgroup)
 	{
 		cmd.set_program("assets://shaders/binning_low_res.comp", {{ "SUBGROUP", 1 }, { "TILE_SIZE", tile_size }});
 		cmd.set_specialization_constant_mask(1);
@@ -455,43 +895,29 @@ void RasterizerGPU::Impl::binning_low_res_prepass(CommandBuffer &cmd)
 			cmd.enable_subgroup_size_control(true);
 			cmd.set_subgroup_size_log2(true, 5, trailing_zeroes(subgroup_size));
 		}
-		cmd.dispatch((staging.count + subgroup_size - 1) / subgroup_size,
-		             (width + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size),
-		             (height + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size));
-		cmd.enable_subgroup_size_control(false);
 	}
 	else
 	{
 		// Fallback with shared memory.
 		cmd.set_program("assets://shaders/binning_low_res.comp", {{ "SUBGROUP", 0 }, { "TILE_SIZE", tile_size }});
-		cmd.dispatch((staging.count + 31) / 32,
-		             (width + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size),
-		             (height + TILE_DOWNSAMPLE * tile_size - 1) / (TILE_DOWNSAMPLE * tile_size));
 	}
+
+	if (staging.primitive_counts)
+		cmd.dispatch_indirect(*staging.binning_dispatch, 0);
+	else
+		cmd.dispatch((staging.count + group_size - 1) / group_size, groups_y, groups_z);
+
+	cmd.enable_subgroup_size_control(false);
 	cmd.end_region();
 	cmd.set_specialization_constant_mask(0);
 }
 
 void RasterizerGPU::Impl::binning_full_res(CommandBuffer &cmd, bool ubershader)
 {
-	uint32_t width = std::max(color.width, depth.width);
-	uint32_t height = std::max(color.height, depth.height);
-	cmd.begin_region("binning-full-res");
-	cmd.set_storage_buffer(0, 0, *binning.mask_buffer[tile_instance_data.index]);
-	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
-	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_low_res);
-	cmd.set_storage_buffer(0, 3, *binning.mask_buffer_coarse[tile_instance_data.index]);
-
-	cmd.set_uniform_buffer(0, 4, *staging.render_state_index_gpu);
-	cmd.set_uniform_buffer(0, 5, *staging.render_state_gpu);
-
-	if (!ubershader)
-	{
-		cmd.set_storage_buffer(0, 6, *tile_count.tile_offset[tile_instance_data.index]);
-		cmd.set_storage_buffer(0, 7, *raster_work.item_count_per_variant);
-		cmd.set_storage_buffer(0, 8, *raster_work.work_list_per_variant);
-		cmd.set_storage_buffer(0, 9, *staging.shader_state_index_gpu);
-	}
+	uint32_t width, height;
+	get_batch_resolution(width, height);
+	uint32_t groups_y = (width + tile_size - 1) / tile_size;
+	uint32_t groups_z = (height + tile_size - 1) / tile_size;
 
 	auto &features = device->get_device_features();
 	uint32_t subgroup_size = features.subgroup_properties.subgroupSize;
@@ -507,18 +933,55 @@ void RasterizerGPU::Impl::binning_full_res(CommandBuffer &cmd, bool ubershader)
 	}
 #endif
 
-	uint32_t num_masks = (staging.count + 31) / 32;
-
 	const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BALLOT_BIT |
 	                                        VK_SUBGROUP_FEATURE_BASIC_BIT |
 	                                        VK_SUBGROUP_FEATURE_VOTE_BIT |
 	                                        VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+	bool use_subgroup = subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
+	                    (features.subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
+	                    can_support_minimum_subgroup_size(32);
+	// One mask of 32 primitives per invocation.
+	uint32_t group_size = use_subgroup ? subgroup_size : 32;
+
+	if (staging.primitive_counts)
+		build_binning_dispatch(cmd, 1, 32 * group_size, groups_y, groups_z);
+
+	cmd.begin_region("binning-full-res");
+	cmd.set_storage_buffer(0, 0, *binning.mask_buffer[tile_instance_data.index]);
+	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
+	cmd.set_storage_buffer(0, 2, *binning.mask_buffer_low_res);
+	cmd.set_storage_buffer(0, 3, *binning.mask_buffer_coarse[tile_instance_data.index]);
+
+	cmd.set_uniform_buffer(0, 4, *staging.render_state_index_gpu);
+	cmd.set_uniform_buffer(0, 5, *staging.render_state_gpu);
+	cmd.set_storage_buffer(0, 10, *hiz.max_depth);
+	cmd.set_storage_buffer(0, 11, *staging.attributes_gpu);
+	if (statistics.enabled)
+		cmd.set_storage_buffer(0, 12, *statistics.counters);
+	if (active_tiles.enabled)
+	{
+		cmd.set_storage_buffer(0, 13, *active_tiles.list[tile_instance_data.index]);
+		cmd.set_storage_buffer(0, 14, *active_tiles.tile_generation);
+	}
+
+	if (!ubershader)
+	{
+		cmd.set_storage_buffer(0, 6, *tile_count.tile_offset[tile_instance_data.index]);
+		cmd.set_storage_buffer(0, 7, *raster_work.item_count_per_variant);
+		if (raster_work.compact)
+			cmd.set_storage_buffer(0, 8, *raster_work.work_list_unsorted);
+		else
+			cmd.set_storage_buffer(0, 8, *raster_work.work_list_per_variant);
+		cmd.set_storage_buffer(0, 9, *staging.shader_state_index_gpu);
+	}
 
-	if (subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
-	    (features.subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
-	    can_support_minimum_subgroup_size(32))
+	if (use_subgroup)
 	{
-		cmd.set_program("assets://shaders/binning.comp", {{ "SUBGROUP", 1 }, { "UBERSHADER", ubershader ? 1 : 0 }, { "TILE_SIZE", tile_size }});
+		cmd.set_program("assets://shaders/binning.comp", {{ "SUBGROUP", 1 }, { "UBERSHADER", ubershader ? 1 : 0 }, { "TILE_SIZE", tile_size },
+		                                                  { "STATISTICS", statistics.enabled ? 1 : 0 },
+		                                                  { "COMPACT_WORK_LIST", raster_work.compact ? 1 : 0 },
+		                                                  { "ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0 },
+		                                                  { "PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0 }});
 		cmd.set_specialization_constant_mask(1);
 		cmd.set_specialization_constant(0, subgroup_size);
 
@@ -527,22 +990,28 @@ void RasterizerGPU::Impl::binning_full_res(CommandBuffer &cmd, bool ubershader)
 			cmd.enable_subgroup_size_control(true);
 			cmd.set_subgroup_size_log2(true, 5, trailing_zeroes(subgroup_size));
 		}
-
-		cmd.dispatch((num_masks + subgroup_size - 1) / subgroup_size,
-		             (width + tile_size - 1) / tile_size,
-		             (height + tile_size - 1) / tile_size);
-
-		cmd.enable_subgroup_size_control(false);
 	}
 	else
 	{
 		// Fallback with shared memory.
-		cmd.set_program("assets://shaders/binning.comp", {{ "SUBGROUP", 0 }, { "UBERSHADER", ubershader ? 1 : 0 }, { "TILE_SIZE", tile_size }});
-		cmd.dispatch((num_masks + 31) / 32,
-		             (width + tile_size - 1) / tile_size,
-		             (height + tile_size - 1) / tile_size);
+		cmd.set_program("assets://shaders/binning.comp", {{ "SUBGROUP", 0 }, { "UBERSHADER", ubershader ? 1 : 0 }, { "TILE_SIZE", tile_size },
+		                                                  { "STATISTICS", statistics.enabled ? 1 : 0 },
+		                                                  { "COMPACT_WORK_LIST", raster_work.compact ? 1 : 0 },
+		                                                  { "ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0 },
+		                                                  { "PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0 }});
+	}
+
+	if (staging.primitive_counts)
+	{
+		cmd.dispatch_indirect(*staging.binning_dispatch, 16);
+	}
+	else
+	{
+		uint32_t num_masks = (staging.count + 31) / 32;
+		cmd.dispatch((num_masks + group_size - 1) / group_size, groups_y, groups_z);
 	}
 
+	cmd.enable_subgroup_size_control(false);
 	cmd.end_region();
 	cmd.set_specialization_constant_mask(0);
 }
@@ -576,8 +1045,40 @@ bool RasterizerGPU::Impl::supports_subgroup_size_control(uint32_t minimum_size,
 	return true;
 }
 
+void RasterizerGPU::Impl::build_compact_work_list(CommandBuffer &cmd)
+{
+	cmd.begin_region("build-compact-work-list");
+	cmd.set_program("assets://shaders/work_list_offsets.comp");
+	cmd.set_specialization_constant_mask(1);
+	cmd.set_specialization_constant(0, MAX_NUM_SHADER_STATE_INDICES);
+	cmd.set_storage_buffer(0, 0, *raster_work.item_count_per_variant);
+	cmd.set_storage_buffer(0, 1, *raster_work.work_list_offsets);
+	cmd.dispatch(1, 1, 1);
+	cmd.set_specialization_constant_mask(0);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+	            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+	cmd.set_program("assets://shaders/work_list_scatter.comp");
+	cmd.set_storage_buffer(0, 0, *raster_work.item_count_per_variant);
+	cmd.set_storage_buffer(0, 1, *raster_work.work_list_offsets);
+	cmd.set_storage_buffer(0, 2, *raster_work.work_list_unsorted);
+	cmd.set_storage_buffer(0, 3, *raster_work.work_list_sorted);
+	cmd.set_storage_buffer(0, 4, *staging.shader_state_index_gpu);
+	cmd.dispatch_indirect(*raster_work.work_list_offsets, 0);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	cmd.end_region();
+}
+
 void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 {
+	// Many states mean many small dispatches, shade everything in one go instead.
+	bool merged = raster_work.compact && state.shader_state_count >= MIN_SHADER_STATES_MERGED_COMBINER;
+	bool prepass = use_depth_prepass();
+
 	cmd.begin_region("dispatch-combiner-work");
 	cmd.set_storage_buffer(0, 1, *tile_instance_data.color[tile_instance_data.index]);
 	cmd.set_storage_buffer(0, 2, *tile_instance_data.depth[tile_instance_data.index]);
@@ -587,6 +1088,10 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 	cmd.set_uniform_buffer(0, 6, *staging.render_state_index_gpu);
 	cmd.set_uniform_buffer(0, 7, *staging.render_state_gpu);
 	cmd.set_storage_buffer(0, 8, *vram_buffer);
+	if (statistics.enabled)
+		cmd.set_storage_buffer(0, 9, *statistics.counters);
+	if (prepass)
+		cmd.set_storage_buffer(0, 11, *depth_prepass.depth);
 
 	auto &features = device->get_device_features();
 	uint32_t subgroup_size = features.subgroup_properties.subgroupSize;
@@ -601,6 +1106,11 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 			{"SUBGROUP", 0},
 			{"TILE_SIZE", tile_size},
 			{"TILE_SIZE_SQUARE", tile_size * tile_size},
+			{"STATISTICS", statistics.enabled ? 1 : 0},
+			{"COMPACT_WORK_LIST", raster_work.compact ? 1 : 0},
+			{"DYNAMIC_STATE", merged ? 1 : 0},
+			{"DEPTH_PREPASS", prepass ? 1 : 0},
+			{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 	else if (subgroup && features.compute_shader_derivative_features.computeDerivativeGroupLinear)
@@ -610,6 +1120,11 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 				{"SUBGROUP", 0},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"COMPACT_WORK_LIST", raster_work.compact ? 1 : 0},
+				{"DYNAMIC_STATE", merged ? 1 : 0},
+				{"DEPTH_PREPASS", prepass ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 	else if (subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
@@ -620,6 +1135,11 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 				{"SUBGROUP", 1},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"COMPACT_WORK_LIST", raster_work.compact ? 1 : 0},
+				{"DYNAMIC_STATE", merged ? 1 : 0},
+				{"DEPTH_PREPASS", prepass ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 
 		if (supports_subgroup_size_control(4, 64))
@@ -634,18 +1154,44 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 				{"SUBGROUP", 0},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"COMPACT_WORK_LIST", raster_work.compact ? 1 : 0},
+				{"DYNAMIC_STATE", merged ? 1 : 0},
+				{"DEPTH_PREPASS", prepass ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 
-	cmd.set_specialization_constant_mask(1);
+	if (merged)
+	{
+		cmd.set_storage_buffer(0, 0, *raster_work.work_list_sorted);
+		cmd.dispatch_indirect(*raster_work.work_list_offsets, 16);
+	}
+	else if (raster_work.compact)
+	{
+		cmd.set_storage_buffer(0, 0, *raster_work.work_list_sorted);
+		cmd.set_storage_buffer(0, 10, *raster_work.work_list_offsets);
+		cmd.set_specialization_constant_mask(1);
 
-	for (unsigned variant = 0; variant < state.shader_state_count; variant++)
+		for (unsigned variant = 0; variant < state.shader_state_count; variant++)
+		{
+			cmd.set_specialization_constant(0, state.shader_states[variant]);
+			cmd.push_constants(&variant, 0, sizeof(variant));
+			cmd.dispatch_indirect(*raster_work.item_count_per_variant, 16 * variant);
+		}
+	}
+	else
 	{
-		cmd.set_specialization_constant(0, state.shader_states[variant]);
-		cmd.set_storage_buffer(0, 0, *raster_work.work_list_per_variant,
-		                       variant * (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork),
-		                       (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork));
-		cmd.dispatch_indirect(*raster_work.item_count_per_variant, 16 * variant);
+		cmd.set_specialization_constant_mask(1);
+
+		for (unsigned variant = 0; variant < state.shader_state_count; variant++)
+		{
+			cmd.set_specialization_constant(0, state.shader_states[variant]);
+			cmd.set_storage_buffer(0, 0, *raster_work.work_list_per_variant,
+			                       variant * (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork),
+			                       (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork));
+			cmd.dispatch_indirect(*raster_work.item_count_per_variant, 16 * variant);
+		}
 	}
 
 	cmd.end_region();
@@ -653,36 +1199,95 @@ void RasterizerGPU::Impl::dispatch_combiner_work(CommandBuffer &cmd)
 	cmd.set_specialization_constant_mask(0);
 }
 
-void RasterizerGPU::Impl::set_fb_info(CommandBuffer &cmd)
+RasterizerGPU::Impl::RenderTarget RasterizerGPU::Impl::get_current_target(unsigned first_primitive) const
 {
-	uint32_t width = std::max(color.width, depth.width);
-	uint32_t height = std::max(color.height, depth.height);
-
-	auto *fb_info = cmd.allocate_typed_constant_data<FBInfo>(2, 0, 1);
-	fb_info->resolution.x = width;
-	fb_info->resolution.y = height;
-	fb_info->resolution_tiles.x = (width + tile_size - 1) / tile_size;
-	fb_info->resolution_tiles.y = (height + tile_size - 1) / tile_size;
-	fb_info->primitive_count = staging.count;
-	uint32_t num_masks = (staging.count + 31) / 32;
-	fb_info->primitive_count_32 = num_masks;
-	fb_info->primitive_count_1024 = (staging.count + 1023) / 1024;
+	RenderTarget target;
+	target.color = color;
+	target.depth = depth;
+	target.color_clear_generation = fast_clear.color_generation;
+	target.depth_clear_generation = fast_clear.depth_generation;
+	target.first_primitive = first_primitive;
+	return target;
+}
 
-	fb_info->color_offset = color.offset >> 1u;
-	fb_info->color_width = color.width;
-	fb_info->color_height = color.height;
-	fb_info->color_stride = color.stride >> 1u;
-	fb_info->depth_offset = depth.offset >> 1u;
-	fb_info->depth_width = depth.width;
-	fb_info->depth_height = depth.height;
-	fb_info->depth_stride = depth.stride >> 1u;
+bool RasterizerGPU::Impl::target_is_current(const RenderTarget &target) const
+{
+	return target.color == color && target.depth == depth;
 }
 
-void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
+void RasterizerGPU::Impl::get_batch_resolution(uint32_t &width, uint32_t &height) const
 {
-	uint32_t width = std::max(color.width, depth.width);
-	uint32_t height = std::max(color.height, depth.height);
+	if (staging.targets.empty())
+	{
+		width = std::max(color.width, depth.width);
+		height = std::max(color.height, depth.height);
+		return;
+	}
 
+	// Binning covers every target of the batch, the scissor keeps primitives within their own.
+	width = 0;
+	height = 0;
+	for (auto &target : staging.targets)
+	{
+		width = std::max(width, std::max(target.color.width, target.depth.width));
+		height = std::max(height, std::max(target.color.height, target.depth.height));
+	}
+}
+
+void RasterizerGPU::Impl::set_fb_info(CommandBuffer &cmd, const RenderTarget &target, unsigned primitive_end)
+{
+	uint32_t width, height;
+	get_batch_resolution(width, height);
+
+	auto *fb_info = cmd.allocate_typed_constant_data<FBInfo>(2, 0, 1);
+	fb_info->resolution.x = width;
+	fb_info->resolution.y = height;
+	fb_info->resolution_tiles.x = (width + tile_size - 1) / tile_size;
+	fb_info->resolution_tiles.y = (height + tile_size - 1) / tile_size;
+
+	fb_info->color_offset = target.color.offset >> 1u;
+	fb_info->color_width = target.color.width;
+	fb_info->color_height = target.color.height;
+	fb_info->color_stride = target.color.stride >> 1u;
+	fb_info->depth_offset = target.depth.offset >> 1u;
+	fb_info->depth_width = target.depth.width;
+	fb_info->depth_height = target.depth.height;
+	fb_info->depth_stride = target.depth.stride >> 1u;
+
+	fb_info->hiz_cull = hiz.cull ? 1 : 0;
+
+	fb_info->color_clear_value = fast_clear.color_value;
+	fb_info->depth_clear_value = fast_clear.depth_value;
+	fb_info->color_clear_generation = target.color_clear_generation;
+	fb_info->depth_clear_generation = target.depth_clear_generation;
+
+	fb_info->active_tile_generation = active_tiles.generation;
+
+	fb_info->primitive_begin = target.first_primitive;
+	fb_info->primitive_end = primitive_end;
+
+	if (staging.primitive_counts)
+	{
+		cmd.set_uniform_buffer(2, 1, *staging.primitive_counts, 0, sizeof(PrimitiveCounts));
+	}
+	else
+	{
+		auto *counts = cmd.allocate_typed_constant_data<PrimitiveCounts>(2, 1, 1);
+		counts->primitive_count = staging.count;
+		counts->primitive_count_32 = (staging.count + 31) / 32;
+		counts->primitive_count_1024 = (staging.count + 1023) / 1024;
+	}
+}
+
+void RasterizerGPU::Impl::set_batch_fb_info(CommandBuffer &cmd, unsigned target_index)
+{
+	unsigned primitive_end = target_index + 1 < staging.targets.size() ?
+	                         staging.targets[target_index + 1].first_primitive : unsigned(MAX_PRIMITIVES);
+	set_fb_info(cmd, staging.targets[target_index], primitive_end);
+}
+
+void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
+{
 	cmd.begin_region("run-rop");
 	cmd.set_storage_buffer(0, 0, *vram_buffer);
 	cmd.set_storage_buffer(0, 1, *binning.mask_buffer[tile_instance_data.index]);
@@ -692,6 +1297,12 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 	cmd.set_uniform_buffer(0, 5, *staging.shader_state_index_gpu);
 	cmd.set_uniform_buffer(0, 6, *staging.render_state_index_gpu);
 	cmd.set_uniform_buffer(0, 7, *staging.render_state_gpu);
+	cmd.set_storage_buffer(0, 8, *hiz.max_depth);
+	cmd.set_storage_buffer(0, 9, *fast_clear.tile_flags);
+	if (statistics.enabled)
+		cmd.set_storage_buffer(0, 10, *statistics.counters);
+	if (active_tiles.enabled)
+		cmd.set_storage_buffer(0, 11, *active_tiles.list[tile_instance_data.index]);
 
 	auto &features = device->get_device_features();
 	const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BASIC_BIT |
@@ -705,6 +1316,9 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 			{"SUBGROUP", 0},
 			{"TILE_SIZE", tile_size},
 			{"TILE_SIZE_SQUARE", tile_size * tile_size},
+			{"STATISTICS", statistics.enabled ? 1 : 0},
+			{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0},
+			{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 	else if (subgroup && features.compute_shader_derivative_features.computeDerivativeGroupLinear)
@@ -714,6 +1328,9 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 				{"SUBGROUP", 0},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 	else if (subgroup && (features.subgroup_properties.supportedOperations & required) == required &&
@@ -724,6 +1341,9 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 				{"SUBGROUP", 1},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 
 		if (supports_subgroup_size_control(4, 128))
@@ -738,21 +1358,24 @@ void RasterizerGPU::Impl::run_rop_ubershader(CommandBuffer &cmd)
 				{"SUBGROUP", 0},
 				{"TILE_SIZE", tile_size},
 				{"TILE_SIZE_SQUARE", tile_size * tile_size},
+				{"STATISTICS", statistics.enabled ? 1 : 0},
+				{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0},
+				{"PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0},
 		});
 	}
 
-	cmd.dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	dispatch_rop(cmd);
 	cmd.end_region();
 	cmd.enable_subgroup_size_control(false);
 }
 
 void RasterizerGPU::Impl::run_rop(CommandBuffer &cmd)
 {
-	uint32_t width = std::max(color.width, depth.width);
-	uint32_t height = std::max(color.height, depth.height);
 	cmd.begin_region("run-rop");
 	cmd.set_program("assets://shaders/rop.comp", {
-		{"TILE_SIZE", tile_size}
+		{"TILE_SIZE", tile_size},
+		{"STATISTICS", statistics.enabled ? 1 : 0},
+		{"ACTIVE_TILE_LIST", active_tiles.enabled ? 1 : 0}
 	});
 
 	cmd.set_storage_buffer(0, 0, *vram_buffer);
@@ -764,22 +1387,48 @@ void RasterizerGPU::Impl::run_rop(CommandBuffer &cmd)
 	cmd.set_storage_buffer(0, 6, *tile_count.tile_offset[tile_instance_data.index]);
 	cmd.set_uniform_buffer(0, 7, *staging.render_state_index_gpu);
 	cmd.set_uniform_buffer(0, 8, *staging.render_state_gpu);
-
-	cmd.dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	cmd.set_storage_buffer(0, 9, *hiz.max_depth);
+	cmd.set_storage_buffer(0, 10, *fast_clear.tile_flags);
+	if (statistics.enabled)
+		cmd.set_storage_buffer(0, 11, *statistics.counters);
+	if (active_tiles.enabled)
+		cmd.set_storage_buffer(0, 12, *active_tiles.list[tile_instance_data.index]);
+
+	dispatch_rop(cmd);
 	cmd.end_region();
 }
 
+void RasterizerGPU::Impl::run_rop_targets(CommandBuffer &cmd, bool ubershader)
+{
+	// Binning and shading covered every target of the batch at once, ROP writes out one target after the other.
+	for (unsigned i = 0; i < staging.targets.size(); i++)
+	{
+		if (i != 0)
+		{
+			cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+			            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+		}
+
+		set_batch_fb_info(cmd, i);
+		if (ubershader)
+			run_rop_ubershader(cmd);
+		else
+			run_rop(cmd);
+	}
+
+	if (staging.reset_hiz)
+		reset_hiz(cmd, ~0u);
+}
+
 void RasterizerGPU::Impl::flush_ubershader()
 {
-	end_staging();
-	if (staging.count == 0)
-		return;
+	begin_hiz();
 
 	auto queue_type = async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
 
 	auto cmd = device->request_command_buffer(queue_type);
 
-	set_fb_info(*cmd);
+	set_batch_fb_info(*cmd, 0);
 
 	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
@@ -788,7 +1437,7 @@ void RasterizerGPU::Impl::flush_ubershader()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t0, t1, "binning-low-res-prepass");
+	register_time_interval(t0, t1, "binning-low-res-prepass");
 	device->submit(cmd);
 
 	auto &rop_sem = tile_instance_data.rop_complete[tile_instance_data.index];
@@ -799,54 +1448,62 @@ void RasterizerGPU::Impl::flush_ubershader()
 	}
 
 	cmd = device->request_command_buffer(queue_type);
-	set_fb_info(*cmd);
+	set_batch_fb_info(*cmd, 0);
+
+	if (active_tiles.enabled)
+		reset_active_tiles(*cmd);
 
 	t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
 	binning_full_res(*cmd, true);
 
 	auto t2 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t1, t2, "binning-full-res");
+	register_time_interval(t1, t2, "binning-full-res");
 
 	Semaphore sem;
 	device->submit(cmd, nullptr, 1, &sem);
-	device->add_wait_semaphore(CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+	device->add_wait_semaphore(CommandBuffer::Type::Generic, sem,
+	                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, true);
 
 	cmd = device->request_command_buffer();
-	set_fb_info(*cmd);
 
 	t2 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
-	run_rop_ubershader(*cmd);
+	run_rop_targets(*cmd, true);
 
 	auto t3 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t2, t3, "rop-ubershader");
+	register_time_interval(t2, t3, "rop-ubershader");
+
+	Fence *statistics_fence = statistics.enabled ? copy_statistics_counters(*cmd) : nullptr;
 
 	sem.reset();
-	device->submit(cmd, nullptr, 1, &sem);
+	device->submit(cmd, statistics_fence, 1, &sem);
 	tile_instance_data.rop_complete[tile_instance_data.index] = sem;
-	reset_staging();
+	record_rop_ranges();
+	end_hiz();
 
-	device->register_time_interval("GPU", t0, t3, "iteration");
+	// Unless ROP only visits active tiles, it visits every tile, so all fast clears have been resolved.
+	if (!active_tiles.enabled)
+		fast_clear.pending = false;
+
+	register_time_interval(t0, t3, "iteration");
 	tile_instance_data.index ^= 1;
 }
 
 void RasterizerGPU::Impl::flush_split()
 {
-	end_staging();
-	if (staging.count == 0)
-		return;
+	begin_hiz();
 
 	auto queue_type = async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
 
 	auto cmd = device->request_command_buffer(queue_type);
 
-	set_fb_info(*cmd);
+	set_batch_fb_info(*cmd, 0);
 
 	// This part can overlap with previous flush.
 	// Clear indirect buffer.
@@ -861,7 +1518,7 @@ void RasterizerGPU::Impl::flush_split()
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t0, t1, "binning-low-res-prepass");
+	register_time_interval(t0, t1, "binning-low-res-prepass");
 	device->submit(cmd);
 
 	// Need to wait until an earlier pass of ROP completes.
@@ -874,8 +1531,14 @@ void RasterizerGPU::Impl::flush_split()
 		rop_sem.reset();
 	}
 
+	// The combiner might sample what ROP of the previous flush is still writing.
+	wait_for_render_to_texture(queue_type);
+
 	cmd = device->request_command_buffer(queue_type);
-	set_fb_info(*cmd);
+	set_batch_fb_info(*cmd, 0);
+
+	if (active_tiles.enabled)
+		reset_active_tiles(*cmd);
 
 	t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
@@ -887,40 +1550,66 @@ void RasterizerGPU::Impl::flush_split()
 	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
 	auto t2 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t1, t2, "binning-full-res");
+	register_time_interval(t1, t2, "binning-full-res");
+
+	if (raster_work.compact)
+	{
+		build_compact_work_list(*cmd);
+		auto t_work_list = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		register_time_interval(t2, t_work_list, "build-compact-work-list");
+		t2 = t_work_list;
+	}
+
+	if (use_depth_prepass())
+	{
+		run_depth_prepass(*cmd);
+		auto t_prepass = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		register_time_interval(t2, t_prepass, "depth-prepass");
+		t2 = t_prepass;
+	}
 
 	dispatch_combiner_work(*cmd);
 
 	auto t3 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t2, t3, "dispatch-combiner-work");
+	register_time_interval(t2, t3, "dispatch-combiner-work");
+
+	if (statistics.enabled)
+		copy_variant_statistics(*cmd);
 
 	// Hand off shaded result to ROP.
 	Semaphore sem;
 	device->submit(cmd, nullptr, 1, &sem);
-	device->add_wait_semaphore(CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+	device->add_wait_semaphore(CommandBuffer::Type::Generic, sem,
+	                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, true);
 	cmd = device->request_command_buffer();
-	set_fb_info(*cmd);
 
 	t3 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
 	// ROP.
-	run_rop(*cmd);
+	run_rop_targets(*cmd, false);
 
 	auto t4 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	device->register_time_interval("GPU", t3, t4, "rop");
+	register_time_interval(t3, t4, "rop");
+
+	register_time_interval(t0, t4, "iteration");
 
-	device->register_time_interval("GPU", t0, t4, "iteration");
+	Fence *statistics_fence = statistics.enabled ? copy_statistics_counters(*cmd) : nullptr;
 
 	sem.reset();
-	device->submit(cmd, nullptr, 1, &sem);
+	device->submit(cmd, statistics_fence, 1, &sem);
 	tile_instance_data.rop_complete[tile_instance_data.index] = sem;
+	record_rop_ranges();
 
-	reset_staging();
+	end_hiz();
+
+	// Unless ROP only visits active tiles, it visits every tile, so all fast clears have been resolved.
+	if (!active_tiles.enabled)
+		fast_clear.pending = false;
 
 	tile_instance_data.index ^= 1;
 }
@@ -985,13 +1674,215 @@ void RasterizerGPU::Impl::init_raster_work_buffers()
 	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 
-	// Round MAX_NUM_TILE_INSTANCES up to 0x10000.
-	info.size = (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork) * MAX_NUM_SHADER_STATE_INDICES;
-	raster_work.work_list_per_variant = device->create_buffer(info);
+	// Work lists are only allocated for the mode in use, the per-variant list is large.
+	// Device defers destruction, so it's fine to release a list which is still in flight.
+	if (raster_work.compact)
+		raster_work.work_list_per_variant.reset();
+	else
+	{
+		raster_work.work_list_unsorted.reset();
+		raster_work.work_list_sorted.reset();
+		raster_work.work_list_offsets.reset();
+	}
+
+	if (raster_work.compact && !raster_work.work_list_sorted)
+	{
+		info.size = (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork);
+		raster_work.work_list_unsorted = device->create_buffer(info);
+		raster_work.work_list_sorted = device->create_buffer(info);
+
+		// Two indirect dispatches followed by the offset of each variant.
+		info.size = 8 * sizeof(uint32_t) + MAX_NUM_SHADER_STATE_INDICES * sizeof(uint32_t);
+		info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+		raster_work.work_list_offsets = device->create_buffer(info);
+	}
+	else if (!raster_work.compact && !raster_work.work_list_per_variant)
+	{
+		// Round MAX_NUM_TILE_INSTANCES up to 0x10000.
+		info.size = (MAX_NUM_TILE_INSTANCES + 1) * sizeof(TileRasterWork) * MAX_NUM_SHADER_STATE_INDICES;
+		raster_work.work_list_per_variant = device->create_buffer(info);
+	}
+
+	if (!raster_work.item_count_per_variant)
+	{
+		info.size = MAX_NUM_SHADER_STATE_INDICES * (4 * sizeof(uint32_t));
+		info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+		raster_work.item_count_per_variant = device->create_buffer(info);
+	}
+}
+
+void RasterizerGPU::Impl::init_hiz_buffer()
+{
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+	info.size = max_tiles_x * max_tiles_y * sizeof(uint32_t);
+	hiz.max_depth = device->create_buffer(info);
+
+	auto cmd = device->request_command_buffer();
+	reset_hiz(*cmd, ~0u);
+	device->submit(cmd);
+}
+
+void RasterizerGPU::Impl::reset_hiz(CommandBuffer &cmd, uint32_t value)
+{
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+	            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	cmd.fill_buffer(*hiz.max_depth, value);
+	cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+
+	// The fill happens on the generic queue. With async compute, binning only observes it once it has waited
+	// for a ROP pass which was submitted after the fill, which is two flushes from now.
+	if (async_compute)
+		hiz.invalid_flushes = std::max(hiz.invalid_flushes, 3u);
+}
+
+void RasterizerGPU::Impl::init_fast_clear_buffer()
+{
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	info.size = 2 * max_tiles_x * max_tiles_y * sizeof(uint32_t);
+	fast_clear.tile_flags = device->create_buffer(info);
+
+	auto cmd = device->request_command_buffer();
+	cmd->fill_buffer(*fast_clear.tile_flags, 0);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	device->submit(cmd);
+}
+
+void RasterizerGPU::Impl::init_statistics_buffer()
+{
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+	             VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+	info.size = 8 * sizeof(uint32_t);
+	statistics.counters = device->create_buffer(info);
+
+	info.domain = BufferDomain::CachedHost;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	for (auto &readback : statistics.ring)
+	{
+		info.size = 8 * sizeof(uint32_t);
+		readback.counters = device->create_buffer(info);
+		info.size = MAX_NUM_SHADER_STATE_INDICES * 4 * sizeof(uint32_t);
+		readback.item_counts = device->create_buffer(info);
+	}
+
+	auto cmd = device->request_command_buffer();
+	cmd->fill_buffer(*statistics.counters, 0);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	device->submit(cmd);
+}
+
+void RasterizerGPU::Impl::init_active_tile_buffers()
+{
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+	             VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+
+	info.size = 4 * sizeof(uint32_t) + max_tiles_x * max_tiles_y * sizeof(uint32_t);
+	for (auto &list : active_tiles.list)
+		list = device->create_buffer(info);
+
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = max_tiles_x * max_tiles_y * sizeof(uint32_t);
+	active_tiles.tile_generation = device->create_buffer(info);
+
+	auto cmd = device->request_command_buffer();
+	cmd->fill_buffer(*active_tiles.tile_generation, 0);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	device->submit(cmd);
+}
+
+void RasterizerGPU::Impl::init_depth_prepass_buffer()
+{
+	// Only allocated while the prepass is enabled.
+	if (!depth_prepass.enabled)
+	{
+		depth_prepass.depth.reset();
+		return;
+	}
+
+	if (depth_prepass.depth)
+		return;
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = max_tiles_x * max_tiles_y * tile_size * tile_size * sizeof(uint16_t);
+	depth_prepass.depth = device->create_buffer(info);
+}
+
+void RasterizerGPU::Impl::fast_clear_tiles(CommandBuffer &cmd, bool depth_tiles)
+{
+	VkDeviceSize size = max_tiles_x * max_tiles_y * sizeof(uint32_t);
+	uint32_t generation = ++fast_clear.generation;
+	if (depth_tiles)
+		fast_clear.depth_generation = generation;
+	else
+		fast_clear.color_generation = generation;
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+	            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	cmd.fill_buffer(*fast_clear.tile_flags, generation, depth_tiles ? size : 0, size);
+	cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	fast_clear.pending = true;
+}
+
+void RasterizerGPU::Impl::resolve_fast_clears()
+{
+	// Write out cleared tiles which were never visited by ROP.
+	if (!fast_clear.pending)
+		return;
+
+	uint32_t width = std::max(color.width, depth.width);
+	uint32_t height = std::max(color.height, depth.height);
+
+	// A batch might still be pending for other targets, clears always belong to the current one.
+	auto cmd = device->request_command_buffer();
+	set_fb_info(*cmd, get_current_target(0), MAX_PRIMITIVES);
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT);
+	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	cmd->set_program("assets://shaders/resolve_fast_clear.comp", {{ "TILE_SIZE", tile_size }});
+	cmd->set_storage_buffer(0, 0, *vram_buffer);
+	cmd->set_storage_buffer(0, 1, *fast_clear.tile_flags);
+	cmd->dispatch((width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, 1);
+	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	register_time_interval(t0, t1, "resolve-fast-clear");
+	device->submit(cmd);
+
+	fast_clear.pending = false;
+}
+
+void RasterizerGPU::Impl::begin_hiz()
+{
+	// If this batch can push depth further away, the per-tile maximum is no longer conservative.
+	// Binning of the next flush may also overlap with our ROP, so it cannot trust the values either.
+	if (staging.depth_may_increase)
+		hiz.invalid_flushes = std::max(hiz.invalid_flushes, 2u);
+	hiz.cull = hiz.invalid_flushes == 0 && !staging.mixed_depth_targets;
+}
 
-	info.size = MAX_NUM_SHADER_STATE_INDICES * (4 * sizeof(uint32_t));
-	info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
-	raster_work.item_count_per_variant = device->create_buffer(info);
+void RasterizerGPU::Impl::end_hiz()
+{
+	if (hiz.invalid_flushes)
+		hiz.invalid_flushes--;
 }
 
 template <typename T>
@@ -1026,7 +1917,7 @@ void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_
 {
 	device = &device_;
 	subgroup = subgroup_;
-	ubershader = ubershader_;
+	pipeline_mode = ubershader_ ? PipelineMode::Ubershader : PipelineMode::Split;
 	async_compute = async_compute_;
 	tile_size = tile_size_;
 
@@ -1048,6 +1939,10 @@ void RasterizerGPU::Impl::init(Device &device_, bool subgroup_, bool ubershader_
 	init_prefix_sum_buffers();
 	init_tile_buffers();
 	init_raster_work_buffers();
+	init_hiz_buffer();
+	init_fast_clear_buffer();
+	init_statistics_buffer();
+	init_active_tile_buffers();
 
 	BufferCreateInfo vram_info = {};
 	vram_info.domain = BufferDomain::Device;
@@ -1073,11 +1968,18 @@ void RasterizerGPU::set_texture_descriptor(const TextureDescriptor &desc)
 
 void RasterizerGPU::set_color_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride)
 {
-	flush();
-	impl->color.offset = offset;
-	impl->color.width = width;
-	impl->color.height = height;
-	impl->color.stride = stride;
+	auto &fb = impl->color;
+	// The batch keeps track of its targets, so switching does not flush, see Impl::allocate_primitives().
+	if (fb.offset != offset || fb.width != width || fb.height != height || fb.stride != stride)
+	{
+		// Fast clears belong to the current target. ROP of a pending batch then reads the resolved tiles from VRAM.
+		impl->resolve_fast_clears();
+		impl->fast_clear.color_generation = ++impl->fast_clear.generation;
+		fb.offset = offset;
+		fb.width = width;
+		fb.height = height;
+		fb.stride = stride;
+	}
 
 	impl->state.current_render_state.scissor_x = 0;
 	impl->state.current_render_state.scissor_y = 0;
@@ -1087,52 +1989,49 @@ void RasterizerGPU::set_color_framebuffer(unsigned offset, unsigned width, unsig
 
 void RasterizerGPU::set_depth_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride)
 {
-	flush();
-	impl->depth.offset = offset;
-	impl->depth.width = width;
-	impl->depth.height = height;
-	impl->depth.stride = stride;
+	auto &fb = impl->depth;
+	if (fb.offset == offset && fb.width == width && fb.height == height && fb.stride == stride)
+		return;
+
+	impl->resolve_fast_clears();
+	impl->fast_clear.depth_generation = ++impl->fast_clear.generation;
+	fb.offset = offset;
+	fb.width = width;
+	fb.height = height;
+	fb.stride = stride;
+
+	// Contents of the new depth buffer are unknown.
+	// HiZ still describes the old one for a pending batch, so only reset it once the batch is done with it.
+	// Recorded batches do not touch HiZ until they are replayed.
+	if (impl->staging.count != 0 && !impl->recording)
+	{
+		impl->staging.reset_hiz = true;
+		return;
+	}
+
+	auto cmd = impl->device->request_command_buffer();
+	impl->reset_hiz(*cmd, ~0u);
+	impl->device->submit(cmd);
 }
 
 void RasterizerGPU::clear_depth(uint16_t z)
 {
 	flush();
 	auto cmd = impl->device->request_command_buffer();
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT);
 	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	cmd->set_storage_buffer(0, 0, *impl->vram_buffer);
-	cmd->set_program("assets://shaders/clear_framebuffer.comp",
-	                 {{ "TILE_SIZE", impl->tile_size }});
-
-	struct Registers
-	{
-		uint32_t offset;
-		uint32_t width;
-		uint32_t height;
-		uint32_t stride;
-		uint32_t value;
-	} registers;
-
-	registers.offset = impl->depth.offset >> 1;
-	registers.width = impl->depth.width;
-	registers.height = impl->depth.height;
-	registers.stride = impl->depth.stride >> 1;
-	registers.value = z;
-	cmd->push_constants(&registers, 0, sizeof(registers));
-
-	cmd->dispatch((registers.width + 15) / 16, (registers.height + 15) / 16, 1);
-
+	impl->fast_clear.depth_value = z;
+	impl->fast_clear_tiles(*cmd, true);
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	impl->device->register_time_interval("GPU", t0, t1, "clear-depth");
+	impl->register_time_interval(t0, t1, "clear-depth");
+	impl->reset_hiz(*cmd, z);
 	impl->device->submit(cmd);
 }
 
 void RasterizerGPU::copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt)
 {
 	flush();
+	impl->resolve_fast_clears();
+	TraceScope scope(impl->trace.recorder, "texture-upload");
 
 	struct Registers
 	{
@@ -1183,42 +2082,92 @@ void RasterizerGPU::copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_
 	registers.height = height;
 	cmd->push_constants(&registers, 0, sizeof(registers));
 	cmd->dispatch(registers.blocks_width, registers.blocks_height, 1);
+
+	// Uploads are not expected to alias the depth buffer, but if they do, HiZ must start over.
+	uint32_t upload_end = offset + registers.blocks_width * registers.blocks_height * 64 * sizeof(uint16_t);
+	uint32_t depth_end = impl->depth.offset + impl->depth.stride * impl->depth.height;
+	if (offset < depth_end && impl->depth.offset < upload_end)
+		impl->reset_hiz(*cmd, ~0u);
+
 	impl->device->submit(cmd);
 }
 
-void RasterizerGPU::clear_color(uint32_t rgba)
+bool RasterizerGPU::read_vram(uint32_t offset, void *data, size_t size)
 {
+	if (offset > VRAM_SIZE || size > VRAM_SIZE - offset)
+		return false;
+	if (!size)
+		return true;
+
 	flush();
+	impl->resolve_fast_clears();
+	TraceScope scope(impl->trace.recorder, "readback");
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::CachedHost;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = size;
+	auto readback_buffer = impl->device->create_buffer(info);
+
 	auto cmd = impl->device->request_command_buffer();
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT);
-	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	cmd->set_storage_buffer(0, 0, *impl->vram_buffer);
-	cmd->set_program("assets://shaders/clear_framebuffer.comp",
-	                 {{ "TILE_SIZE", impl->tile_size }});
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	cmd->copy_buffer(*readback_buffer, 0, *impl->vram_buffer, offset, size);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
 
-	struct Registers
-	{
-		uint32_t offset;
-		uint32_t width;
-		uint32_t height;
-		uint32_t stride;
-		uint32_t value;
-	} registers;
+	Fence fence;
+	impl->device->submit(cmd, &fence);
+	fence->wait();
 
-	registers.offset = impl->color.offset >> 1;
-	registers.width = impl->color.width;
-	registers.height = impl->color.height;
-	registers.stride = impl->color.stride >> 1;
-	registers.value = rgba;
-	cmd->push_constants(&registers, 0, sizeof(registers));
+	auto *mapped = impl->device->map_host_buffer(*readback_buffer, MEMORY_ACCESS_READ_BIT);
+	memcpy(data, mapped, size);
+	impl->device->unmap_host_buffer(*readback_buffer, MEMORY_ACCESS_READ_BIT);
+	return true;
+}
+
+bool RasterizerGPU::write_vram(uint32_t offset, const void *data, size_t size)
+{
+	if (offset > VRAM_SIZE || size > VRAM_SIZE - offset)
+		return false;
+	if (!size)
+		return true;
+
+	flush();
+	impl->resolve_fast_clears();
+	TraceScope scope(impl->trace.recorder, "texture-upload");
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Host;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	info.size = size;
+	auto buffer = impl->device->create_buffer(info, data);
+
+	auto cmd = impl->device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	cmd->copy_buffer(*impl->vram_buffer, offset, *buffer, 0, size);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+	uint32_t upload_end = offset + uint32_t(size);
+	uint32_t depth_end = impl->depth.offset + impl->depth.stride * impl->depth.height;
+	if (offset < depth_end && impl->depth.offset < upload_end)
+		impl->reset_hiz(*cmd, ~0u);
 
-	cmd->dispatch((registers.width + 15) / 16, (registers.height + 15) / 16, 1);
+	impl->device->submit(cmd);
+	return true;
+}
 
+void RasterizerGPU::clear_color(uint32_t rgba)
+{
+	flush();
+	auto cmd = impl->device->request_command_buffer();
+	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	impl->fast_clear.color_value = uint16_t(rgba);
+	impl->fast_clear_tiles(*cmd, false);
 	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-	impl->device->register_time_interval("GPU", t0, t1, "clear-color");
+	impl->register_time_interval(t0, t1, "clear-color");
 	impl->device->submit(cmd);
 }
 
@@ -1240,18 +2189,19 @@ void RasterizerGPU::set_scissor(int x, int y, int width, int height)
 	impl->state.current_render_state.scissor_height = height;
 }
 
-void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetup &setup)
+unsigned RasterizerGPU::Impl::allocate_primitives(unsigned count, unsigned num_conservative_tiles, bool gpu_setup)
 {
-	unsigned num_conservative_tiles = ubershader ? 0 : compute_num_conservative_tiles(setup);
-
 	state.current_shader_state = compute_shader_state();
 	bool shader_state_changed = state.shader_state_count != 0 &&
 	                            state.current_shader_state != state.shader_states[state.shader_state_count - 1];
 
 	bool render_state_changed = memcmp(&state.current_render_state, &state.last_render_state, sizeof(RenderState)) != 0;
+	bool target_changed = staging.count != 0 && !target_is_current(staging.targets.back());
+	bool multiple_targets = target_changed || staging.targets.size() > 1;
+	bool samples_texture = (state.current_render_state.combiner_state & COMBINER_SAMPLE_BIT) != 0;
 
 	bool need_flush = false;
-	if (staging.count == MAX_PRIMITIVES)
+	if (staging.count + count > MAX_PRIMITIVES)
 		need_flush = true;
 	else if (staging.num_conservative_tile_instances + num_conservative_tiles > MAX_NUM_TILE_INSTANCES)
 		need_flush = true;
@@ -1259,13 +2209,33 @@ void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetup &setup)
 		need_flush = true;
 	else if (render_state_changed && state.render_state_count == MAX_NUM_RENDER_STATE_INDICES)
 		need_flush = true;
-
+	else if (multiple_targets && (recording || gpu_setup || !staging.setup_jobs.empty()))
+	{
+		// Display lists replay into whatever target is bound at the time, and compaction after GPU triangle setup
+		// moves primitives around, so we would not know where a target begins.
+		need_flush = true;
+	}
+	else if ((render_state_changed || target_changed) && samples_texture &&
+	         batch_renders_texture(state.current_render_state.tex, target_changed))
+	{
+		// Shading can happen for the whole batch before any ROP, so sampling what an earlier target renders
+		// needs that target to be flushed first.
+		need_flush = true;
+	}
+
 	if (need_flush)
 		flush();
 
 	if (staging.count == 0)
 		begin_staging();
 
+	if (staging.targets.empty() || !target_is_current(staging.targets.back()))
+	{
+		if (!staging.targets.empty() && !(staging.targets.front().depth == depth))
+			staging.mixed_depth_targets = true;
+		staging.targets.push_back(get_current_target(staging.count));
+	}
+
 	unsigned current_shader_state;
 	unsigned current_render_state;
 
@@ -1280,6 +2250,15 @@ void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetup &setup)
 
 	if (state.render_state_count == 0 || render_state_changed)
 	{
+		auto &render_state = state.current_render_state;
+		if (depth_state_may_increase_depth(render_state.depth_state))
+			staging.depth_may_increase = true;
+		if (depth_state_is_opaque(render_state.depth_state, render_state.blend_state, render_state.alpha_threshold))
+			staging.opaque_depth_write = true;
+		else if ((render_state.depth_state & uint8_t(DepthWrite::On)) != 0)
+			staging.non_opaque_depth_write = true;
+		if (samples_texture)
+			add_texture_range(render_state.tex);
 		staging.mapped_render_state[state.render_state_count] = state.current_render_state;
 		state.last_render_state = state.current_render_state;
 		current_render_state = state.render_state_count;
@@ -1288,39 +2267,359 @@ void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetup &setup)
 	else
 		current_render_state = state.render_state_count - 1;
 
-	staging.mapped_positions[staging.count] = setup.pos;
-	staging.mapped_attributes[staging.count] = setup.attr;
-	staging.mapped_shader_state_index[staging.count] = current_shader_state;
-	staging.mapped_render_state_index[staging.count] = current_render_state;
+	for (unsigned i = 0; i < count; i++)
+	{
+		staging.mapped_shader_state_index[staging.count + i] = current_shader_state;
+		staging.mapped_render_state_index[staging.count + i] = current_render_state;
+	}
 
-	staging.count++;
+	unsigned primitive_index = staging.count;
+	staging.count += count;
 	staging.num_conservative_tile_instances += num_conservative_tiles;
+	return primitive_index;
+}
+
+void RasterizerGPU::Impl::queue_primitive(const PrimitiveSetupPos &pos, const PrimitiveSetupAttr &attr)
+{
+	unsigned num_conservative_tiles = pipeline_mode == PipelineMode::Ubershader ? 0 : compute_num_conservative_tiles(pos);
+	unsigned primitive_index = allocate_primitives(1, num_conservative_tiles);
+	staging.mapped_positions[primitive_index] = pos;
+	if (staging.packed_attributes)
+		static_cast<PrimitiveSetupAttrPacked *>(staging.mapped_attributes)[primitive_index] = pack_primitive_attributes(attr);
+	else
+		static_cast<PrimitiveSetupAttr *>(staging.mapped_attributes)[primitive_index] = attr;
+}
+
+void RasterizerGPU::Impl::queue_triangles(const Vertex *vertices, size_t vertex_count,
+                                          const uint32_t *indices, size_t triangle_count,
+                                          CullMode mode, const ViewportTransform &vp)
+{
+	if (triangle_count == 0)
+		return;
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Host;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = vertex_count * sizeof(Vertex);
+	auto vertex_buffer = device->create_buffer(info, vertices);
+	info.size = triangle_count * 3 * sizeof(uint32_t);
+	auto index_buffer = device->create_buffer(info, indices);
+
+	for (size_t i = 0; i < triangle_count; i++)
+	{
+		// Clipping can split a triangle into up to MAX_SETUPS_PER_TRIANGLE primitives, and we would have to reserve
+		// that many slots and tiles up front. Such triangles are rare, so set them up here, which gives exact counts.
+		BBox bbox;
+		if (!compute_unclipped_bbox(bbox, vertices, indices + 3 * i, vp))
+		{
+			InputPrimitive input = {};
+			for (unsigned j = 0; j < 3; j++)
+				input.vertices[j] = vertices[indices[3 * i + j]];
+
+			PrimitiveSetup setups[MAX_SETUPS_PER_TRIANGLE];
+			unsigned count = setup_clipped_triangles(setups, input, mode, vp);
+			for (unsigned j = 0; j < count; j++)
+				queue_primitive(setups[j].pos, setups[j].attr);
+			continue;
+		}
+
+		unsigned num_conservative_tiles = pipeline_mode == PipelineMode::Ubershader ? 0 : compute_num_conservative_tiles(bbox);
+		unsigned primitive_index = allocate_primitives(1, num_conservative_tiles, true);
+
+		// Extend the current job if we're still contiguous, a flush or a triangle set up on the CPU might have happened in between.
+		auto *job = staging.setup_jobs.empty() ? nullptr : &staging.setup_jobs.back();
+		if (!job || job->indices.get() != index_buffer.get() ||
+		    job->first_index + 3 * job->triangle_count != 3 * i ||
+		    job->primitive_offset + job->triangle_count != primitive_index)
+		{
+			staging.setup_jobs.push_back({ vertex_buffer, index_buffer, uint32_t(3 * i), primitive_index, 0, mode, vp });
+			job = &staging.setup_jobs.back();
+		}
+
+		job->triangle_count++;
+	}
+}
+
+void RasterizerGPU::Impl::dispatch_triangle_setup(CommandBuffer &cmd, const TriangleSetupJob &job, unsigned max_setups,
+                                                  bool packed, const Buffer &positions, const Buffer &attributes,
+                                                  const Buffer *counts)
+{
+	struct Registers
+	{
+		uint32_t first_index;
+		uint32_t primitive_offset;
+		uint32_t triangle_count;
+		uint32_t cull_mode;
+		float viewport[6];
+		uint32_t max_setups;
+	} registers;
+
+	registers.first_index = job.first_index;
+	registers.primitive_offset = job.primitive_offset;
+	registers.triangle_count = job.triangle_count;
+	registers.cull_mode = uint32_t(job.cull_mode);
+	registers.viewport[0] = job.viewport.x;
+	registers.viewport[1] = job.viewport.y;
+	registers.viewport[2] = job.viewport.width;
+	registers.viewport[3] = job.viewport.height;
+	registers.viewport[4] = job.viewport.min_depth;
+	registers.viewport[5] = job.viewport.max_depth;
+	registers.max_setups = max_setups;
+
+	if (counts)
+	{
+		cmd.set_program("assets://shaders/triangle_setup.comp", {{ "SETUP_COUNT_BUFFER", 4 }, { "PACKED_ATTRIBUTES", packed ? 1 : 0 }});
+		cmd.set_storage_buffer(0, 4, *counts);
+	}
+	else
+		cmd.set_program("assets://shaders/triangle_setup.comp", {{ "PACKED_ATTRIBUTES", packed ? 1 : 0 }});
+
+	cmd.set_storage_buffer(0, 0, *job.vertices);
+	cmd.set_storage_buffer(0, 1, *job.indices);
+	cmd.set_storage_buffer(0, 2, positions);
+	cmd.set_storage_buffer(0, 3, attributes);
+	cmd.push_constants(&registers, 0, sizeof(registers));
+	cmd.dispatch((job.triangle_count + 63) / 64, 1, 1);
+}
+
+void RasterizerGPU::Impl::run_triangle_setup()
+{
+	if (staging.setup_jobs.empty())
+		return;
+
+	// Runs after end_staging(), so any staging copies to the GPU buffers have already been waited for.
+	auto cmd = device->request_command_buffer(async_compute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic);
+	auto t0 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+
+	// queue_triangles() only sends triangles here which need no clipping, so they produce at most one primitive.
+	for (auto &job : staging.setup_jobs)
+		dispatch_triangle_setup(*cmd, job, 1, staging.packed_attributes, *staging.positions_gpu, *staging.attributes_gpu, nullptr);
+
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	compact_triangle_setup(*cmd);
+
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT);
+
+	auto t1 = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	register_time_interval(t0, t1, "triangle-setup");
+	device->submit(cmd);
+	staging.setup_jobs.clear();
+}
+
+void RasterizerGPU::Impl::compact_triangle_setup(CommandBuffer &cmd)
+{
+	// Culled triangles leave empty slots behind. Move everything else into a dense list, so binning never sees them.
+	// The count is only known on the GPU from here on, binning is dispatched indirectly over it.
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = 4 * sizeof(uint32_t) + staging.count * sizeof(uint32_t);
+	auto primitive_offsets = device->create_buffer(info);
+
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = MAX_PRIMITIVES * sizeof(PrimitiveSetupPos);
+	auto positions = device->create_buffer(info);
+	info.size = MAX_PRIMITIVES * get_attribute_size();
+	auto attributes = device->create_buffer(info);
+	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = MAX_PRIMITIVES * sizeof(uint8_t);
+	auto shader_state_index = device->create_buffer(info);
+	info.size = MAX_PRIMITIVES * sizeof(uint16_t);
+	auto render_state_index = device->create_buffer(info);
+
+	uint32_t count = staging.count;
+
+	cmd.begin_region("compact-triangle-setup");
+	cmd.set_program("assets://shaders/primitive_offsets.comp");
+	cmd.set_storage_buffer(0, 0, *staging.positions_gpu);
+	cmd.set_storage_buffer(0, 1, *primitive_offsets);
+	cmd.push_constants(&count, 0, sizeof(count));
+	cmd.dispatch(1, 1, 1);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	cmd.set_program("assets://shaders/primitive_scatter.comp", {{ "PACKED_ATTRIBUTES", staging.packed_attributes ? 1 : 0 }});
+	cmd.set_storage_buffer(0, 0, *primitive_offsets);
+	cmd.set_storage_buffer(0, 1, *staging.positions_gpu);
+	cmd.set_storage_buffer(0, 2, *staging.attributes_gpu);
+	cmd.set_storage_buffer(0, 3, *staging.shader_state_index_gpu);
+	cmd.set_storage_buffer(0, 4, *staging.render_state_index_gpu);
+	cmd.set_storage_buffer(0, 5, *positions);
+	cmd.set_storage_buffer(0, 6, *attributes);
+	cmd.set_storage_buffer(0, 7, *shader_state_index);
+	cmd.set_storage_buffer(0, 8, *render_state_index);
+	cmd.push_constants(&count, 0, sizeof(count));
+	cmd.dispatch((count + 63) / 64, 1, 1);
+	cmd.end_region();
+
+	staging.positions_gpu = positions;
+	staging.attributes_gpu = attributes;
+	staging.shader_state_index_gpu = shader_state_index;
+	staging.render_state_index_gpu = render_state_index;
+	staging.primitive_counts = primitive_offsets;
+}
+
+void RasterizerGPU::Impl::build_binning_dispatch(CommandBuffer &cmd, unsigned index, unsigned primitives_per_group,
+                                                 unsigned groups_y, unsigned groups_z)
+{
+	struct Registers
+	{
+		uint32_t index;
+		uint32_t primitives_per_group;
+		uint32_t groups_y;
+		uint32_t groups_z;
+	} registers = { index, primitives_per_group, groups_y, groups_z };
+
+	cmd.set_program("assets://shaders/binning_dispatch.comp");
+	cmd.set_storage_buffer(0, 0, *staging.primitive_counts, 0, 4 * sizeof(uint32_t));
+	cmd.set_storage_buffer(0, 1, *staging.binning_dispatch);
+	cmd.push_constants(&registers, 0, sizeof(registers));
+	cmd.dispatch(1, 1, 1);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+}
+
+size_t RasterizerGPU::Impl::validate_triangle_setup(const Vertex *vertices, size_t vertex_count,
+                                                    const uint32_t *indices, size_t triangle_count,
+                                                    CullMode mode, const ViewportTransform &vp)
+{
+	if (triangle_count == 0)
+		return 0;
+
+	BufferCreateInfo info = {};
+	info.domain = BufferDomain::Host;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.size = vertex_count * sizeof(Vertex);
+	auto vertex_buffer = device->create_buffer(info, vertices);
+	info.size = triangle_count * 3 * sizeof(uint32_t);
+	auto index_buffer = device->create_buffer(info, indices);
+
+	// Every triangle owns MAX_SETUPS_PER_TRIANGLE output slots here, so go through the mesh in chunks.
+	constexpr size_t TRIANGLES_PER_CHUNK = 1024;
+	info.domain = BufferDomain::CachedHost;
+	info.size = TRIANGLES_PER_CHUNK * MAX_SETUPS_PER_TRIANGLE * sizeof(PrimitiveSetupPos);
+	auto positions = device->create_buffer(info);
+	info.size = TRIANGLES_PER_CHUNK * MAX_SETUPS_PER_TRIANGLE * sizeof(PrimitiveSetupAttr);
+	auto attributes = device->create_buffer(info);
+	info.size = TRIANGLES_PER_CHUNK * sizeof(uint32_t);
+	auto counts = device->create_buffer(info);
+
+	size_t mismatches = 0;
+	for (size_t chunk_start = 0; chunk_start < triangle_count; chunk_start += TRIANGLES_PER_CHUNK)
+	{
+		size_t chunk_count = std::min(triangle_count - chunk_start, TRIANGLES_PER_CHUNK);
+		TriangleSetupJob job = { vertex_buffer, index_buffer, uint32_t(3 * chunk_start), 0, uint32_t(chunk_count), mode, vp };
+		auto cmd = device->request_command_buffer();
+		// Always compare against the full precision layout, which is bit-exact with the CPU.
+		dispatch_triangle_setup(*cmd, job, MAX_SETUPS_PER_TRIANGLE, false, *positions, *attributes, counts.get());
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+		Fence fence;
+		device->submit(cmd, &fence);
+		fence->wait();
+
+		auto *gpu_positions = static_cast<const PrimitiveSetupPos *>(device->map_host_buffer(*positions, MEMORY_ACCESS_READ_BIT));
+		auto *gpu_attributes = static_cast<const PrimitiveSetupAttr *>(device->map_host_buffer(*attributes, MEMORY_ACCESS_READ_BIT));
+		auto *gpu_counts = static_cast<const uint32_t *>(device->map_host_buffer(*counts, MEMORY_ACCESS_READ_BIT));
+
+		for (size_t i = 0; i < chunk_count; i++)
+		{
+			size_t triangle = chunk_start + i;
+			InputPrimitive input = {};
+			for (unsigned j = 0; j < 3; j++)
+				input.vertices[j] = vertices[indices[3 * triangle + j]];
+
+			PrimitiveSetup cpu_setups[MAX_SETUPS_PER_TRIANGLE];
+			unsigned cpu_count = setup_clipped_triangles(cpu_setups, input, mode, vp);
+
+			bool match = cpu_count == gpu_counts[i];
+			for (unsigned j = 0; match && j < cpu_count; j++)
+			{
+				size_t gpu_index = i * MAX_SETUPS_PER_TRIANGLE + j;
+				match = memcmp(&cpu_setups[j].pos, &gpu_positions[gpu_index], sizeof(PrimitiveSetupPos)) == 0 &&
+				        memcmp(&cpu_setups[j].attr, &gpu_attributes[gpu_index], sizeof(PrimitiveSetupAttr)) == 0;
+			}
+
+			if (!match)
+			{
+				if (mismatches < 16)
+					LOGE("Triangle setup mismatch for triangle %u (CPU: %u, GPU: %u primitives).\n",
+					     unsigned(triangle), cpu_count, gpu_counts[i]);
+				mismatches++;
+			}
+		}
+
+		device->unmap_host_buffer(*positions, MEMORY_ACCESS_READ_BIT);
+		device->unmap_host_buffer(*attributes, MEMORY_ACCESS_READ_BIT);
+		device->unmap_host_buffer(*counts, MEMORY_ACCESS_READ_BIT);
+	}
+
+	return mismatches;
 }
 
 void RasterizerGPU::rasterize_primitives(const RetroWarp::PrimitiveSetup *setup, size_t count)
 {
 	for (size_t i = 0; i < count; i++)
-		impl->queue_primitive(setup[i]);
+		impl->queue_primitive(setup[i].pos, setup[i].attr);
+}
+
+void RasterizerGPU::rasterize_primitives(const PrimitiveSetupPos *positions, const PrimitiveSetupAttr *attributes, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		impl->queue_primitive(positions[i], attributes[i]);
+}
+
+void RasterizerGPU::rasterize_triangles(const Vertex *vertices, size_t vertex_count,
+                                        const uint32_t *indices, size_t triangle_count,
+                                        CullMode mode, const ViewportTransform &vp)
+{
+	impl->queue_triangles(vertices, vertex_count, indices, triangle_count, mode, vp);
+}
+
+size_t RasterizerGPU::validate_triangle_setup(const Vertex *vertices, size_t vertex_count,
+                                              const uint32_t *indices, size_t triangle_count,
+                                              CullMode mode, const ViewportTransform &vp)
+{
+	return impl->validate_triangle_setup(vertices, vertex_count, indices, triangle_count, mode, vp);
 }
 
 ImageHandle RasterizerGPU::copy_to_framebuffer()
 {
 	flush();
+	impl->resolve_fast_clears();
 	return impl->copy_to_framebuffer();
 }
 
 ImageHandle RasterizerGPU::Impl::copy_to_framebuffer()
 {
-	ImageCreateInfo info = ImageCreateInfo::immutable_2d_image(color.width, color.height, VK_FORMAT_A1R5G5B5_UNORM_PACK16);
-	info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-	auto image = device->create_image(info);
+	if (present.width != color.width || present.height != color.height)
+	{
+		ImageCreateInfo info = ImageCreateInfo::immutable_2d_image(color.width, color.height, VK_FORMAT_A1R5G5B5_UNORM_PACK16);
+		info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		for (auto &present_image : present.images)
+			present_image = device->create_image(info);
+
+		present.width = color.width;
+		present.height = color.height;
+		present.index = 0;
+	}
+
+	auto image = present.images[present.index];
+	present.index = (present.index + 1) % (sizeof(present.images) / sizeof(present.images[0]));
 
 	auto cmd = device->request_command_buffer();
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
 	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	// Contents are fully overwritten, but wait for earlier reads of this image to complete.
 	cmd->image_barrier(*image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-	                   VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+	                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 	                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
 	cmd->copy_buffer_to_image(*image, *vram_buffer, color.offset, {}, { color.width, color.height, 1 }, color.stride / 2, 0,
 	                          { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
@@ -1331,26 +2630,59 @@ ImageHandle RasterizerGPU::Impl::copy_to_framebuffer()
 	return image;
 }
 
-bool RasterizerGPU::save_canvas(const char *path)
+static void unpack_argb1555_to_rgba8(u8vec4 *dst, const uint16_t *src, size_t count)
 {
-	impl->flush();
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned v = src[i];
+		unsigned r = (v >> 10) & 31;
+		unsigned g = (v >> 5) & 31;
+		unsigned b = (v >> 0) & 31;
+		dst[i] = u8vec4((r << 3) | (r >> 2), (g << 3) | (g >> 2), (b << 3) | (b >> 2), 0xffu);
+	}
+}
 
-	auto cmd = impl->device->request_command_buffer();
-	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_TRANSFER_BIT,
-	             VK_ACCESS_TRANSFER_READ_BIT);
+BufferHandle RasterizerGPU::Impl::allocate_readback_buffer(VkDeviceSize size)
+{
+	for (auto itr = readback.buffer_pool.begin(); itr != readback.buffer_pool.end(); ++itr)
+	{
+		if ((*itr)->get_create_info().size >= size)
+		{
+			auto buffer = std::move(*itr);
+			readback.buffer_pool.erase(itr);
+			return buffer;
+		}
+	}
 
 	BufferCreateInfo info;
-	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	info.domain = BufferDomain::CachedHost;
-	info.size = impl->color.width * impl->color.height * sizeof(uint16_t);
-	auto dst_buffer = impl->device->create_buffer(info);
-	cmd->set_program("assets://shaders/read_framebuffer.comp", {{ "TILE_SIZE", impl->tile_size }});
-	cmd->set_storage_buffer(0, 0, *dst_buffer);
-	cmd->set_storage_buffer(0, 1, *impl->vram_buffer);
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	info.size = size;
+	return device->create_buffer(info);
+}
+
+ReadbackHandle RasterizerGPU::Impl::request_readback(ReadbackFormat format, ReadbackCallback callback)
+{
+	flush();
+	resolve_fast_clears();
+
+	PendingReadback pending;
+	pending.handle = readback.next_handle++;
+	pending.format = format;
+	pending.width = color.width;
+	pending.height = color.height;
+	pending.callback = std::move(callback);
+	pending.buffer = allocate_readback_buffer(color.width * color.height * sizeof(uint16_t));
+
+	auto cmd = device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_READ_BIT);
+
+	cmd->set_program("assets://shaders/read_framebuffer.comp", {{ "TILE_SIZE", tile_size }});
+	cmd->set_storage_buffer(0, 0, *pending.buffer);
+	cmd->set_storage_buffer(0, 1, *vram_buffer);
 
 	struct Registers
 	{
@@ -1359,34 +2691,203 @@ bool RasterizerGPU::save_canvas(const char *path)
 		uint32_t height;
 		uint32_t stride;
 	} registers;
-	registers.offset = impl->color.offset >> 1;
-	registers.width = impl->color.width;
-	registers.height = impl->color.height;
-	registers.stride = impl->color.stride >> 1;
+	registers.offset = color.offset >> 1;
+	registers.width = color.width;
+	registers.height = color.height;
+	registers.stride = color.stride >> 1;
 	cmd->push_constants(&registers, 0, sizeof(registers));
 
-	cmd->dispatch((impl->color.width + 15) / 16, (impl->color.height + 15) / 16, 1);
+	cmd->dispatch((color.width + 15) / 16, (color.height + 15) / 16, 1);
+	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
 
-	Fence fence;
-	impl->device->submit(cmd, &fence);
+	device->submit(cmd, &pending.fence);
 
-	fence->wait();
+	auto handle = pending.handle;
+	readback.pending.push_back(std::move(pending));
+	return handle;
+}
 
-	std::vector<u8vec4> readback_result(impl->color.width * impl->color.height);
+ReadbackHandle RasterizerGPU::Impl::request_vram_readback(uint32_t offset, size_t size, ReadbackCallback callback)
+{
+	flush();
+	resolve_fast_clears();
 
-	const auto unpack = [](uint16_t v) -> u8vec4 {
-		unsigned r = (v >> 10) & 31;
-		unsigned g = (v >> 5) & 31;
-		unsigned b = (v >> 0) & 31;
-		unsigned a = v >> 15;
-		return u8vec4((r << 3) | (r >> 2), (g << 3) | (g >> 2), (b << 3) | (b >> 2), 0xffu);
-	};
+	PendingReadback pending;
+	pending.handle = readback.next_handle++;
+	pending.format = ReadbackFormat::Raw;
+	pending.width = unsigned(size);
+	pending.height = 1;
+	pending.callback = std::move(callback);
+	pending.buffer = allocate_readback_buffer(size);
+
+	auto cmd = device->request_command_buffer();
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	cmd->copy_buffer(*pending.buffer, 0, *vram_buffer, offset, size);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+	device->submit(cmd, &pending.fence);
+
+	auto handle = pending.handle;
+	readback.pending.push_back(std::move(pending));
+	return handle;
+}
+
+void RasterizerGPU::Impl::complete_readback(PendingReadback &pending)
+{
+	TraceScope scope(trace.recorder, "readback");
+	auto *ptr = static_cast<const uint16_t *>(device->map_host_buffer(*pending.buffer, MEMORY_ACCESS_READ_BIT));
+
+	ReadbackFrame frame = {};
+	frame.handle = pending.handle;
+	frame.format = pending.format;
+	frame.width = pending.width;
+	frame.height = pending.height;
+
+	if (pending.format == ReadbackFormat::RGBA8)
+	{
+		readback.unpacked.resize(pending.width * pending.height);
+		unpack_argb1555_to_rgba8(readback.unpacked.data(), ptr, readback.unpacked.size());
+		frame.data = readback.unpacked.data();
+	}
+	else
+		frame.data = ptr;
+
+	if (pending.callback)
+		pending.callback(frame);
+
+	device->unmap_host_buffer(*pending.buffer, MEMORY_ACCESS_READ_BIT);
+
+	// Keep a few buffers around for steady-state capture. VRAM readbacks are one-off.
+	if (pending.format != ReadbackFormat::Raw && readback.buffer_pool.size() < 4)
+		readback.buffer_pool.push_back(std::move(pending.buffer));
+}
+
+void RasterizerGPU::Impl::poll_readbacks(bool wait)
+{
+	// Complete in order so callbacks observe frames in the order they were requested.
+	while (!readback.pending.empty())
+	{
+		auto &pending = readback.pending.front();
+		if (wait)
+			pending.fence->wait();
+		else if (!pending.fence->wait_timeout(0))
+			break;
+
+		// Callback might request new readbacks, so take ownership first.
+		auto completed = std::move(pending);
+		readback.pending.pop_front();
+		complete_readback(completed);
+	}
+
+	if (wait)
+	{
+		std::unique_lock<std::mutex> holder{readback.lock};
+		readback.cond.wait(holder, [this]() {
+			return readback.jobs.empty() && readback.jobs_in_flight == 0;
+		});
+	}
+}
+
+void RasterizerGPU::Impl::readback_worker()
+{
+	for (;;)
+	{
+		std::function<void ()> job;
+		{
+			std::unique_lock<std::mutex> holder{readback.lock};
+			readback.cond.wait(holder, [this]() {
+				return readback.shutdown || !readback.jobs.empty();
+			});
+
+			if (readback.jobs.empty())
+				break;
+
+			job = std::move(readback.jobs.front());
+			readback.jobs.pop_front();
+			readback.jobs_in_flight++;
+		}
+
+		job();
+
+		std::lock_guard<std::mutex> holder{readback.lock};
+		readback.jobs_in_flight--;
+		readback.cond.notify_all();
+	}
+}
+
+void RasterizerGPU::Impl::queue_readback_job(std::function<void ()> job)
+{
+	std::lock_guard<std::mutex> holder{readback.lock};
+	if (!readback.worker.joinable())
+		readback.worker = std::thread(&Impl::readback_worker, this);
+	readback.jobs.push_back(std::move(job));
+	readback.cond.notify_all();
+}
+
+RasterizerGPU::Impl::~Impl()
+{
+	{
+		std::lock_guard<std::mutex> holder{readback.lock};
+		readback.shutdown = true;
+		readback.cond.notify_all();
+	}
+
+	if (readback.worker.joinable())
+		readback.worker.join();
+}
+
+ReadbackHandle RasterizerGPU::request_readback(ReadbackFormat format, ReadbackCallback callback)
+{
+	return impl->request_readback(format, std::move(callback));
+}
 
-	auto *ptr = static_cast<uint16_t *>(impl->device->map_host_buffer(*dst_buffer, MEMORY_ACCESS_READ_BIT));
-	for (unsigned i = 0; i < impl->color.width * impl->color.height; i++)
-		readback_result[i] = unpack(ptr[i]);
-	bool res = stbi_write_png(path, impl->color.width, impl->color.height, 4, readback_result.data(), impl->color.width * 4);
-	impl->device->unmap_host_buffer(*dst_buffer, MEMORY_ACCESS_READ_BIT);
+ReadbackHandle RasterizerGPU::request_vram_readback(uint32_t offset, size_t size, ReadbackCallback callback)
+{
+	if (offset > VRAM_SIZE || size > VRAM_SIZE - offset || !size)
+		return 0;
+	return impl->request_vram_readback(offset, size, std::move(callback));
+}
+
+ReadbackHandle RasterizerGPU::request_readback_png(const char *path)
+{
+	std::string png_path = path;
+	auto *self = impl.get();
+	return impl->request_readback(ReadbackFormat::ARGB1555, [self, png_path](const ReadbackFrame &frame) {
+		const auto *src = static_cast<const uint16_t *>(frame.data);
+		std::vector<uint16_t> pixels(src, src + frame.width * frame.height);
+		unsigned width = frame.width;
+		unsigned height = frame.height;
+
+		self->queue_readback_job([png_path, width, height, pixels = std::move(pixels)]() {
+			std::vector<u8vec4> rgba(width * height);
+			unpack_argb1555_to_rgba8(rgba.data(), pixels.data(), rgba.size());
+			if (!stbi_write_png(png_path.c_str(), width, height, 4, rgba.data(), width * 4))
+				LOGE("Failed to write PNG to %s.\n", png_path.c_str());
+		});
+	});
+}
+
+void RasterizerGPU::poll_readbacks()
+{
+	impl->poll_readbacks(false);
+}
+
+void RasterizerGPU::wait_readbacks()
+{
+	impl->poll_readbacks(true);
+}
+
+bool RasterizerGPU::save_canvas(const char *path)
+{
+	bool res = false;
+	impl->request_readback(ReadbackFormat::RGBA8, [&](const ReadbackFrame &frame) {
+		res = stbi_write_png(path, frame.width, frame.height, 4, frame.data, frame.width * 4);
+	});
+	wait_readbacks();
 	return res;
 }
 
@@ -1395,6 +2896,36 @@ void RasterizerGPU::init(Device &device, bool subgroup, bool ubershader, bool as
 	impl->init(device, subgroup, ubershader, async_compute, tile_size);
 }
 
+void RasterizerGPU::set_pipeline_mode(PipelineMode mode)
+{
+	impl->set_pipeline_mode(mode);
+}
+
+void RasterizerGPU::set_auto_pipeline_thresholds(const AutoPipelineThresholds &thresholds)
+{
+	impl->auto_pipeline = thresholds;
+}
+
+void RasterizerGPU::set_compact_work_list(bool enable)
+{
+	impl->set_compact_work_list(enable);
+}
+
+void RasterizerGPU::set_indirect_rop(bool enable)
+{
+	impl->set_indirect_rop(enable);
+}
+
+void RasterizerGPU::set_depth_prepass(bool enable)
+{
+	impl->set_depth_prepass(enable);
+}
+
+void RasterizerGPU::set_packed_attributes(bool enable)
+{
+	impl->set_packed_attributes(enable);
+}
+
 void RasterizerGPU::flush()
 {
 	impl->flush();
@@ -1402,12 +2933,600 @@ void RasterizerGPU::flush()
 
 void RasterizerGPU::Impl::flush()
 {
-	if (ubershader)
+	end_staging();
+
+	if (staging.count != 0)
+	{
+		TraceScope scope(trace.recorder, "flush");
+		if (recording)
+			record_batch();
+		else
+			dispatch_batch();
+	}
+
+	reset_staging();
+	resolve_trace();
+}
+
+bool RasterizerGPU::Impl::select_ubershader() const
+{
+	if (!staging.split_capable)
+		return true;
+	if (pipeline_mode != PipelineMode::Auto)
+		return pipeline_mode == PipelineMode::Ubershader;
+
+	if (staging.num_conservative_tile_instances <= auto_pipeline.max_ubershader_tile_instances)
+		return true;
+	if (state.shader_state_count > auto_pipeline.max_ubershader_shader_states)
+		return false;
+
+	uint32_t width, height;
+	get_batch_resolution(width, height);
+	unsigned num_tiles = ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+	float tile_depth = float(staging.num_conservative_tile_instances) / float(std::max(num_tiles, 1u));
+	return tile_depth <= auto_pipeline.max_ubershader_tile_depth;
+}
+
+void RasterizerGPU::Impl::dispatch_batch()
+{
+	// Display list batches render into whatever target is bound when they are replayed.
+	if (staging.targets.empty())
+		staging.targets.push_back(get_current_target(0));
+
+	run_triangle_setup();
+
+	if (staging.primitive_counts)
+	{
+		// Binning dispatches depend on the resolution, and a display list batch can be replayed at any of them.
+		BufferCreateInfo info = {};
+		info.domain = BufferDomain::Device;
+		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+		info.size = 2 * 4 * sizeof(uint32_t);
+		staging.binning_dispatch = device->create_buffer(info);
+	}
+
+	active_tiles.generation++;
+
+	if (statistics.enabled)
+		begin_statistics_snapshot();
+
+	if (select_ubershader())
+	{
+		if (statistics.enabled)
+			statistics.totals.ubershader_flushes++;
 		flush_ubershader();
+	}
 	else
+	{
+		if (statistics.enabled)
+			statistics.totals.split_flushes++;
 		flush_split();
+	}
 
-	reset_staging();
+	if (statistics.enabled)
+		statistics.ring_index = (statistics.ring_index + 1) % STATISTICS_RING_SIZE;
+}
+
+void RasterizerGPU::Impl::set_pipeline_mode(PipelineMode mode)
+{
+	// Staging depends on the mode, so never mix modes within a batch.
+	flush();
+	pipeline_mode = mode;
+}
+
+void RasterizerGPU::Impl::set_indirect_rop(bool enable)
+{
+	flush();
+	active_tiles.enabled = enable;
+}
+
+void RasterizerGPU::Impl::set_depth_prepass(bool enable)
+{
+	flush();
+	depth_prepass.enabled = enable;
+	init_depth_prepass_buffer();
+}
+
+bool RasterizerGPU::Impl::use_depth_prepass() const
+{
+	// Culling against the nearest opaque depth is only exact if nothing else can write depth.
+	// Opaque primitives of one target must not cull fragments of another either.
+	return depth_prepass.enabled && staging.opaque_depth_write && !staging.non_opaque_depth_write &&
+	       staging.targets.size() <= 1;
+}
+
+void RasterizerGPU::Impl::set_packed_attributes(bool enable)
+{
+	flush();
+	packed_attributes = enable;
+}
+
+size_t RasterizerGPU::Impl::get_attribute_size() const
+{
+	return staging.packed_attributes ? sizeof(PrimitiveSetupAttrPacked) : sizeof(PrimitiveSetupAttr);
+}
+
+void RasterizerGPU::Impl::set_compact_work_list(bool enable)
+{
+	flush();
+	raster_work.compact = enable;
+	init_raster_work_buffers();
+}
+
+static VRAMRange compute_framebuffer_range(uint32_t offset, uint32_t width, uint32_t height, uint32_t stride)
+{
+	if (width == 0 || height == 0)
+		return { 0, 0 };
+
+	uint64_t end = uint64_t(offset) + uint64_t(height - 1) * stride + width * 2;
+	if (end > VRAM_SIZE)
+		return { 0, VRAM_SIZE };
+	return { offset, uint32_t(end) };
+}
+
+// Conservative range of VRAM which sampling a texture can read. Must match addressing in texture.h.
+static VRAMRange compute_texture_range(const TextureDescriptor &tex)
+{
+	VRAMRange range = { VRAM_SIZE, 0 };
+	int subsample = tex.texture_fmt & 3;
+	int levels = std::min(std::max(int(tex.texture_max_lod), 0) + 1, 8);
+
+	for (int level = 0; level < levels; level++)
+	{
+		int mip_width = std::max(tex.texture_width >> level, 1);
+		mip_width = (mip_width + (1 << subsample) - 1) >> subsample;
+		int blocks_x = (mip_width + 7) >> 3;
+
+		// Coordinates are clamped, then masked. If the clamp range is non-negative, it bounds the coordinate as well.
+		int max_x = int(tex.texture_mask.x) >> level;
+		int max_y = int(tex.texture_mask.y) >> level;
+		if (tex.texture_clamp.x >= 0)
+			max_x = std::min(max_x, std::max(tex.texture_clamp.z >> level, 0));
+		if (tex.texture_clamp.y >= 0)
+			max_y = std::min(max_y, std::max(tex.texture_clamp.w >> level, 0));
+
+		uint64_t last_block = uint64_t(max_y >> 3) * blocks_x + uint64_t((max_x >> subsample) >> 3);
+		uint64_t begin = tex.texture_offset[level] & ~1u;
+		uint64_t end = begin + (last_block + 1) * 64 * sizeof(uint16_t);
+
+		// Addressing wraps around, don't bother being precise.
+		if (end > VRAM_SIZE)
+			return { 0, VRAM_SIZE };
+
+		range.begin = std::min(range.begin, uint32_t(begin));
+		range.end = std::max(range.end, uint32_t(end));
+	}
+
+	return range;
+}
+
+void RasterizerGPU::Impl::add_texture_range(const TextureDescriptor &tex)
+{
+	auto range = compute_texture_range(tex);
+
+	// Render states tend to alternate between few textures, so merge with what we already have where possible.
+	for (auto &r : staging.texture_ranges)
+	{
+		if (vram_ranges_overlap(r, range))
+		{
+			r.begin = std::min(r.begin, range.begin);
+			r.end = std::max(r.end, range.end);
+			return;
+		}
+	}
+
+	staging.texture_ranges.push_back(range);
+}
+
+bool RasterizerGPU::Impl::batch_samples_vram_range(const VRAMRange &range) const
+{
+	for (auto &r : staging.texture_ranges)
+		if (vram_ranges_overlap(r, range))
+			return true;
+	return false;
+}
+
+bool RasterizerGPU::Impl::batch_renders_texture(const TextureDescriptor &tex, bool include_last_target) const
+{
+	auto range = compute_texture_range(tex);
+	size_t count = staging.targets.size();
+	if (!include_last_target && count)
+		count--;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto &target = staging.targets[i];
+		auto &color_fb = target.color;
+		auto &depth_fb = target.depth;
+		if (vram_ranges_overlap(range, compute_framebuffer_range(color_fb.offset, color_fb.width, color_fb.height, color_fb.stride)) ||
+		    vram_ranges_overlap(range, compute_framebuffer_range(depth_fb.offset, depth_fb.width, depth_fb.height, depth_fb.stride)))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void RasterizerGPU::Impl::wait_for_render_to_texture(CommandBuffer::Type queue_type)
+{
+	// Without async compute, the combiner is ordered after earlier ROP on the same queue.
+	if (!async_compute)
+		return;
+
+	unsigned previous = tile_instance_data.index ^ 1;
+	auto &rop_sem = tile_instance_data.rop_complete[previous];
+	if (!rop_sem)
+		return;
+
+	auto &rop_ranges = tile_instance_data.rop_ranges[previous];
+	if (std::none_of(rop_ranges.begin(), rop_ranges.end(), [this](const VRAMRange &range) {
+		return batch_samples_vram_range(range);
+	}))
+	{
+		return;
+	}
+
+	// The next flush would wait for this semaphore before binning at full resolution.
+	// Since we wait for it here, the barrier after the next low-res binning pass provides that ordering instead.
+	device->add_wait_semaphore(queue_type, rop_sem, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, true);
+	rop_sem.reset();
+}
+
+void RasterizerGPU::Impl::record_rop_ranges()
+{
+	auto &ranges = tile_instance_data.rop_ranges[tile_instance_data.index];
+	ranges.clear();
+	for (auto &target : staging.targets)
+	{
+		ranges.push_back(compute_framebuffer_range(target.color.offset, target.color.width, target.color.height, target.color.stride));
+		ranges.push_back(compute_framebuffer_range(target.depth.offset, target.depth.width, target.depth.height, target.depth.stride));
+	}
+}
+
+void RasterizerGPU::Impl::record_batch()
+{
+	// Bake the result of GPU triangle setup into the display list.
+	run_triangle_setup();
+
+	DisplayList::Batch batch = {};
+	batch.positions = staging.positions_gpu;
+	batch.attributes = staging.attributes_gpu;
+	batch.shader_state_index = staging.shader_state_index_gpu;
+	batch.render_state_index = staging.render_state_index_gpu;
+	batch.render_state = staging.render_state_gpu;
+	batch.primitive_counts = staging.primitive_counts;
+	memcpy(batch.shader_states, state.shader_states, state.shader_state_count * sizeof(uint32_t));
+	batch.shader_state_count = state.shader_state_count;
+	batch.render_state_count = state.render_state_count;
+	batch.count = staging.count;
+	batch.num_conservative_tile_instances = staging.num_conservative_tile_instances;
+	batch.depth_may_increase = staging.depth_may_increase;
+	batch.split_capable = staging.split_capable;
+	batch.opaque_depth_write = staging.opaque_depth_write;
+	batch.non_opaque_depth_write = staging.non_opaque_depth_write;
+	batch.packed_attributes = staging.packed_attributes;
+	batch.texture_ranges = staging.texture_ranges;
+	recording->batches.push_back(std::move(batch));
+}
+
+void RasterizerGPU::Impl::install_batch(const DisplayList::Batch &batch)
+{
+	staging.positions_gpu = batch.positions;
+	staging.attributes_gpu = batch.attributes;
+	staging.shader_state_index_gpu = batch.shader_state_index;
+	staging.render_state_index_gpu = batch.render_state_index;
+	staging.render_state_gpu = batch.render_state;
+	staging.primitive_counts = batch.primitive_counts;
+	memcpy(state.shader_states, batch.shader_states, batch.shader_state_count * sizeof(uint32_t));
+	state.shader_state_count = batch.shader_state_count;
+	state.render_state_count = batch.render_state_count;
+	staging.count = batch.count;
+	staging.num_conservative_tile_instances = batch.num_conservative_tile_instances;
+	staging.depth_may_increase = batch.depth_may_increase;
+	staging.split_capable = batch.split_capable;
+	staging.opaque_depth_write = batch.opaque_depth_write;
+	staging.non_opaque_depth_write = batch.non_opaque_depth_write;
+	staging.packed_attributes = batch.packed_attributes;
+	staging.texture_ranges = batch.texture_ranges;
+}
+
+void RasterizerGPU::Impl::replay(const DisplayList &list)
+{
+	flush();
+
+	// Replaying into a recording simply references the same batches.
+	if (recording)
+	{
+		recording->batches.insert(recording->batches.end(), list.batches.begin(), list.batches.end());
+		return;
+	}
+
+	for (auto &batch : list.batches)
+	{
+		install_batch(batch);
+		dispatch_batch();
+		reset_staging();
+	}
+}
+
+void RasterizerGPU::Impl::register_time_interval(const QueryPoolHandle &start, const QueryPoolHandle &end, const char *name)
+{
+	device->register_time_interval("GPU", start, end, name);
+	if (stage_timing.enabled && start && end)
+		stage_timing.current.push_back({ start, end, name });
+	if (trace.ns_per_tick != 0.0 && start && end)
+		trace.pending.push_back({ start, end, name });
+}
+
+void RasterizerGPU::Impl::set_trace_recorder(TraceRecorder *recorder)
+{
+	flush();
+	trace.recorder = recorder;
+	trace.ns_per_tick = 0.0;
+	trace.pending.clear();
+	if (!recorder)
+		return;
+
+	// The error of the alignment is the latency from the timestamp until the fence wakes us up.
+	auto cmd = device->request_command_buffer();
+	auto timestamp = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	Fence fence;
+	device->submit(cmd, &fence);
+	fence->wait();
+	int64_t calibration_ns = recorder->get_time_ns();
+
+	// Query results are only read back when frame contexts are recycled.
+	device->wait_idle();
+	if (!timestamp || !timestamp->is_signalled())
+	{
+		LOGE("Timestamps are not supported, GPU intervals will not be traced.\n");
+		return;
+	}
+
+	trace.calibration_ticks = timestamp->get_timestamp_ticks();
+	trace.calibration_ns = calibration_ns;
+	trace.ns_per_tick = double(device->get_gpu_properties().limits.timestampPeriod);
+}
+
+void RasterizerGPU::Impl::resolve_trace()
+{
+	auto to_ns = [this](const QueryPoolHandle &query) {
+		int64_t ticks = int64_t(query->get_timestamp_ticks() - trace.calibration_ticks);
+		return trace.calibration_ns + int64_t(double(ticks) * trace.ns_per_tick);
+	};
+
+	// Intervals resolve in order, so no need to look further.
+	while (!trace.pending.empty())
+	{
+		auto &interval = trace.pending.front();
+		if (!interval.start->is_signalled() || !interval.end->is_signalled())
+			break;
+
+		trace.recorder->add_track_span("GPU", interval.name, to_ns(interval.start), to_ns(interval.end));
+		trace.pending.pop_front();
+	}
+}
+
+void RasterizerGPU::Impl::read_stage_timings(std::vector<std::vector<StageTiming>> &frames)
+{
+	double ms_per_tick = double(device->get_gpu_properties().limits.timestampPeriod) * 1e-6;
+
+	while (!stage_timing.frames.empty())
+	{
+		auto &intervals = stage_timing.frames.front();
+		bool resolved = std::all_of(intervals.begin(), intervals.end(), [](const TimingInterval &interval) {
+			return interval.start->is_signalled() && interval.end->is_signalled();
+		});
+
+		// Frames resolve in order, so no need to look further.
+		if (!resolved)
+			break;
+
+		std::vector<StageTiming> frame;
+		for (auto &interval : intervals)
+		{
+			double ms = double(interval.end->get_timestamp_ticks() - interval.start->get_timestamp_ticks()) * ms_per_tick;
+			auto itr = std::find_if(frame.begin(), frame.end(), [&](const StageTiming &timing) {
+				return timing.name == interval.name;
+			});
+
+			if (itr != frame.end())
+				itr->milliseconds += ms;
+			else
+				frame.push_back({ interval.name, ms });
+		}
+
+		frames.push_back(std::move(frame));
+		stage_timing.frames.pop_front();
+	}
+}
+
+void RasterizerGPU::set_stage_timing(bool enable)
+{
+	impl->stage_timing.enabled = enable;
+	if (!enable)
+	{
+		impl->stage_timing.current.clear();
+		impl->stage_timing.frames.clear();
+	}
+}
+
+void RasterizerGPU::end_timing_frame()
+{
+	if (!impl->stage_timing.enabled)
+		return;
+
+	impl->stage_timing.frames.push_back(std::move(impl->stage_timing.current));
+	impl->stage_timing.current.clear();
+}
+
+void RasterizerGPU::read_stage_timings(std::vector<std::vector<StageTiming>> &frames)
+{
+	impl->read_stage_timings(frames);
+}
+
+void RasterizerGPU::set_trace_recorder(TraceRecorder *recorder)
+{
+	impl->set_trace_recorder(recorder);
+}
+
+void RasterizerGPU::resolve_trace()
+{
+	impl->resolve_trace();
+}
+
+void RasterizerGPU::Impl::begin_statistics_snapshot()
+{
+	// The oldest snapshot is normally long done by the time its slot comes around again.
+	auto &readback = statistics.ring[statistics.ring_index];
+	if (readback.fence)
+		fold_statistics(readback);
+	readback.shader_state_count = 0;
+}
+
+void RasterizerGPU::Impl::copy_variant_statistics(CommandBuffer &cmd)
+{
+	if (state.shader_state_count == 0)
+		return;
+
+	auto &readback = statistics.ring[statistics.ring_index];
+	memcpy(readback.shader_states, state.shader_states, state.shader_state_count * sizeof(uint32_t));
+	readback.shader_state_count = state.shader_state_count;
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	cmd.copy_buffer(*readback.item_counts, 0, *raster_work.item_count_per_variant, 0,
+	                state.shader_state_count * 4 * sizeof(uint32_t));
+	cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+}
+
+Fence *RasterizerGPU::Impl::copy_statistics_counters(CommandBuffer &cmd)
+{
+	// ROP waits for binning and the combiner of this flush, so every counter is final here.
+	auto &readback = statistics.ring[statistics.ring_index];
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	cmd.copy_buffer(*readback.counters, *statistics.counters);
+	cmd.barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	return &readback.fence;
+}
+
+void RasterizerGPU::Impl::fold_statistics(StatisticsReadback &readback)
+{
+	readback.fence->wait();
+	readback.fence.reset();
+
+	// Unsigned differences are exact across wrap-around, as long as a single flush advances a counter by less than 2^32.
+	// For fragments, that takes a batch averaging over 1000 full screen layers at the maximum resolution.
+	auto *counters = static_cast<const uint32_t *>(device->map_host_buffer(*readback.counters, MEMORY_ACCESS_READ_BIT));
+	auto &last = statistics.last_counters;
+	auto &totals = statistics.totals;
+	totals.primitives_binned += uint32_t(counters[0] - last[0]);
+	totals.tile_instances += uint32_t(counters[1] - last[1]);
+	totals.tiles_with_primitives += uint32_t(counters[2] - last[2]);
+	totals.max_primitives_per_tile = std::max(totals.max_primitives_per_tile, counters[3]);
+	totals.fragments_shaded += uint32_t(counters[4] - last[4]);
+	totals.fragments_depth_passed += uint32_t(counters[5] - last[5]);
+	totals.fragments_blended += uint32_t(counters[6] - last[6]);
+	memcpy(last, counters, sizeof(last));
+	device->unmap_host_buffer(*readback.counters, MEMORY_ACCESS_READ_BIT);
+
+	if (readback.shader_state_count == 0)
+		return;
+
+	auto *item_counts = static_cast<const uvec4 *>(device->map_host_buffer(*readback.item_counts, MEMORY_ACCESS_READ_BIT));
+	for (unsigned i = 0; i < readback.shader_state_count; i++)
+	{
+		uint32_t shader_state = readback.shader_states[i];
+		auto itr = std::find_if(totals.combiner_variants.begin(), totals.combiner_variants.end(),
+		                        [&](const PipelineStatistics::CombinerVariant &variant) {
+			                        return variant.shader_state == shader_state;
+		                        });
+
+		if (itr != totals.combiner_variants.end())
+			itr->work_items += item_counts[i].x;
+		else
+			totals.combiner_variants.push_back({ shader_state, item_counts[i].x });
+	}
+	device->unmap_host_buffer(*readback.item_counts, MEMORY_ACCESS_READ_BIT);
+}
+
+PipelineStatistics RasterizerGPU::Impl::read_statistics()
+{
+	flush();
+
+	// Fold in submission order, oldest first.
+	for (unsigned i = 0; i < STATISTICS_RING_SIZE; i++)
+	{
+		auto &readback = statistics.ring[(statistics.ring_index + i) % STATISTICS_RING_SIZE];
+		if (readback.fence)
+			fold_statistics(readback);
+	}
+
+	return statistics.totals;
+}
+
+void RasterizerGPU::Impl::reset_statistics()
+{
+	// Drain anything in flight, so it doesn't end up in the next read.
+	read_statistics();
+	statistics.totals = {};
+
+	// Nothing is in flight now, so the counters can be cleared without racing a flush on the async queue.
+	auto cmd = device->request_command_buffer();
+	cmd->fill_buffer(*statistics.counters, 0);
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	Fence fence;
+	device->submit(cmd, &fence);
+	fence->wait();
+	memset(statistics.last_counters, 0, sizeof(statistics.last_counters));
+}
+
+void RasterizerGPU::set_statistics(bool enable)
+{
+	// Flush so a batch is never split between two shader configurations.
+	flush();
+	impl->statistics.enabled = enable;
+}
+
+PipelineStatistics RasterizerGPU::read_statistics()
+{
+	return impl->read_statistics();
+}
+
+void RasterizerGPU::reset_statistics()
+{
+	impl->reset_statistics();
+}
+
+void RasterizerGPU::begin_display_list()
+{
+	flush();
+	impl->recording = std::make_shared<DisplayList>();
+}
+
+std::shared_ptr<DisplayList> RasterizerGPU::end_display_list()
+{
+	flush();
+	auto list = std::move(impl->recording);
+	impl->recording.reset();
+	return list;
+}
+
+void RasterizerGPU::replay(const DisplayList &list)
+{
+	impl->replay(list);
+}
+
+size_t get_display_list_primitive_count(const DisplayList &list)
+{
+	size_t count = 0;
+	for (auto &batch : list.batches)
+		count += batch.count;
+	return count;
 }
 
 void RasterizerGPU::set_constant_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
@@ -3,13 +3,19 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "primitive_setup.hpp"
+#include "triangle_converter.hpp"
 #include "texture_format.hpp"
 #include <memory>
+#include <functional>
+#include <string>
+#include <vector>
 #include "device.hpp"
 #include "math.hpp"
 
 namespace RetroWarp
 {
+class TraceRecorder;
+
 enum class DepthTest : uint8_t
 {
 	Always = 0,
@@ -70,6 +76,94 @@ struct TextureDescriptor
 	uint32_t texture_offset[8] = {};
 };
 
+enum class ReadbackFormat
+{
+	ARGB1555,
+	RGBA8,
+	// Bytes of VRAM, see request_vram_readback(). Width is the size in bytes, height is 1.
+	Raw
+};
+
+using ReadbackHandle = uint64_t;
+
+struct ReadbackFrame
+{
+	ReadbackHandle handle;
+	ReadbackFormat format;
+	unsigned width;
+	unsigned height;
+
+	// Tightly packed, uint16_t per pixel for ARGB1555, u8vec4 per pixel for RGBA8, bytes for Raw.
+	// Only valid for the duration of the callback.
+	const void *data;
+};
+
+using ReadbackCallback = std::function<void (const ReadbackFrame &frame)>;
+
+enum class PipelineMode
+{
+	// Bin into tile instances and run a specialized combiner per shader state, then ROP.
+	Split,
+	// Shade, combine and ROP every tile in one shader.
+	Ubershader,
+	// Pick either of the above for every flush, see AutoPipelineThresholds.
+	Auto
+};
+
+// Heuristics for PipelineMode::Auto, evaluated on the batch being flushed.
+// Tile counts are the conservative (bounding box) tile coverage computed during staging.
+struct AutoPipelineThresholds
+{
+	// Batches this small always use the ubershader, the extra split passes dominate.
+	unsigned max_ubershader_tile_instances = 1024;
+	// More shader states than this favor specialized combiner shaders.
+	unsigned max_ubershader_shader_states = 4;
+	// Average primitives per framebuffer tile. Ubershader processes a tile's primitives serially.
+	float max_ubershader_tile_depth = 2.0f;
+};
+
+struct StageTiming
+{
+	std::string name;
+	double milliseconds;
+};
+
+// Totals accumulated by the raster shaders since the last reset, see RasterizerGPU::set_statistics().
+struct PipelineStatistics
+{
+	// Sum over all tiles of primitives which survived full-res binning.
+	uint64_t primitives_binned = 0;
+	// Tile instances allocated for the combiner, split shader architecture only.
+	uint64_t tile_instances = 0;
+	// Tiles which had at least one primitive binned, and the largest primitive count seen in a single tile.
+	uint64_t tiles_with_primitives = 0;
+	uint32_t max_primitives_per_tile = 0;
+
+	// Fragments which passed the coverage test.
+	uint64_t fragments_shaded = 0;
+	uint64_t fragments_depth_passed = 0;
+	// Fragments which passed the depth test with a blend mode other than Replace.
+	uint64_t fragments_blended = 0;
+
+	// Combiner workgroups dispatched per shader state, split shader architecture only.
+	struct CombinerVariant
+	{
+		uint32_t shader_state;
+		uint64_t work_items;
+	};
+	std::vector<CombinerVariant> combiner_variants;
+
+	// Which pipeline each flush used, mostly interesting with PipelineMode::Auto.
+	uint64_t split_flushes = 0;
+	uint64_t ubershader_flushes = 0;
+};
+
+// Primitives and their render state baked into device memory, see RasterizerGPU::begin_display_list().
+struct DisplayList;
+// Primitives queued while recording. With GPU triangle setup, this is an upper bound,
+// since culled triangles are only removed on the GPU.
+size_t get_display_list_primitive_count(const DisplayList &list);
+
 class RasterizerGPU
 {
 public:
@@ -78,6 +172,25 @@ public:
 
 	void init(Vulkan::Device &device, bool subgroup, bool ubershader, bool async_compute, unsigned tile_size);
 
+	// Overrides the pipeline chosen in init(). Flushes.
+	void set_pipeline_mode(PipelineMode mode);
+	void set_auto_pipeline_thresholds(const AutoPipelineThresholds &thresholds);
+	// Split pipeline only. Binning output is compacted into one work list sorted by shader state,
+	// and with many shader states, the combiner runs as a single dispatch.
+	// Avoids allocating a full work list for every possible shader state. Flushes.
+	void set_compact_work_list(bool enable);
+	// ROP only runs for tiles which had any primitive binned. Enabled by default.
+	// Fast cleared tiles which ROP skips are written out once the framebuffer is read or changed. Flushes.
+	void set_indirect_rop(bool enable);
+	// Split pipeline only. Before shading, the nearest depth of opaque primitives
+	// (Replace blending, depth write, LE or LEQ test and no alpha test) is rasterized for every pixel,
+	// and the combiner skips fragments behind it. Only used for batches where every depth write is opaque.
+	// Flushes.
+	void set_depth_prepass(bool enable);
+	// Upload primitive attributes in the compact 60 byte layout of primitive_packing.hpp rather than 80 bytes.
+	// UV, W and barycentric gradients lose some precision. Flushes.
+	void set_packed_attributes(bool enable);
+
 	void set_depth_state(DepthTest mode, DepthWrite write);
 	void set_rop_state(BlendState state);
 	void set_scissor(int x, int y, int width, int height);
@@ -85,6 +198,11 @@ public:
 	void set_constant_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
 	void set_combiner_mode(CombinerFlags flags);
 
+	// Switching targets does not flush. A batch keeps track of its targets and binning is shared,
+	// ROP then runs once per target in the same submission.
+	// A batch is only flushed early when a primitive samples a target the batch renders to,
+	// or for display lists and GPU triangle setup.
+	// Rendering to a texture and sampling it in the next flush is synchronized, also with async compute.
 	void set_color_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride);
 	void set_depth_framebuffer(unsigned offset, unsigned width, unsigned height, unsigned stride);
 
@@ -92,13 +210,71 @@ public:
 	void clear_color(uint32_t rgba = 0);
 	bool save_canvas(const char *path);
 
+	// Non-blocking readback of the current color framebuffer.
+	// Callbacks are invoked on the calling thread from poll_readbacks() or wait_readbacks(), in request order.
+	ReadbackHandle request_readback(ReadbackFormat format, ReadbackCallback callback);
+	// PNG encoding happens on a worker thread.
+	ReadbackHandle request_readback_png(const char *path);
+	// Non-blocking version of read_vram(), completed along with the other readbacks.
+	// Returns 0 without invoking the callback if the range is empty or outside VRAM.
+	ReadbackHandle request_vram_readback(uint32_t offset, size_t size, ReadbackCallback callback);
+	void poll_readbacks();
+	// Blocks until all readbacks have completed, including pending PNG encodes.
+	void wait_readbacks();
+
 	void rasterize_primitives(const PrimitiveSetup *setup, size_t count);
+	// Same as above, with positions and attributes in separate arrays, e.g. straight out of a memory mapped dump.
+	void rasterize_primitives(const PrimitiveSetupPos *positions, const PrimitiveSetupAttr *attributes, size_t count);
+
+	// Equivalent to calling setup_clipped_triangles() for every triangle and rasterizing the result,
+	// but clipping and setup run in a compute shader. Indices are three vertex indices per triangle.
+	void rasterize_triangles(const Vertex *vertices, size_t vertex_count,
+	                         const uint32_t *indices, size_t triangle_count,
+	                         CullMode mode, const ViewportTransform &vp);
+	// Runs GPU triangle setup and compares it bit-for-bit against setup_clipped_triangles().
+	// Returns number of mismatching triangles. Blocks, intended for testing, e.g. on lavapipe.
+	size_t validate_triangle_setup(const Vertex *vertices, size_t vertex_count,
+	                               const uint32_t *indices, size_t triangle_count,
+	                               CullMode mode, const ViewportTransform &vp);
+
+	// While recording, flushed primitives are kept in device memory instead of being rendered.
+	// Only primitives and their state are recorded, clears and framebuffer changes take effect immediately.
+	// The display list can be replayed any number of times, which skips all CPU staging work.
+	void begin_display_list();
+	std::shared_ptr<DisplayList> end_display_list();
+	void replay(const DisplayList &list);
 
 	void set_texture_descriptor(const TextureDescriptor &desc);
 	void copy_texture_rgba8888_to_vram(uint32_t offset, const uint32_t *src, unsigned width, unsigned height, TextureFormatBits fmt);
 
+	// Raw access to VRAM, e.g. to snapshot textures after they have been swizzled and restore them in one upload.
+	// Both flush first. read_vram() blocks until the GPU is done, write_vram() does not.
+	// Return false if the range is outside VRAM.
+	bool read_vram(uint32_t offset, void *data, size_t size);
+	bool write_vram(uint32_t offset, const void *data, size_t size);
+
 	Vulkan::ImageHandle copy_to_framebuffer();
 
+	// Collects GPU time per stage, grouped into timing frames which are ended with end_timing_frame().
+	// read_stage_timings() appends frames whose timestamps have resolved, oldest first.
+	// A stage which runs multiple times within a frame is summed.
+	void set_stage_timing(bool enable);
+	void end_timing_frame();
+	void read_stage_timings(std::vector<std::vector<StageTiming>> &frames);
+
+	// Records CPU spans of flushes, texture uploads and readbacks, and GPU stage intervals on a "GPU" track.
+	// The GPU clock is aligned to the recorder once, here, which flushes and waits for the device to go idle.
+	// GPU intervals are added as their timestamps resolve after a flush, resolve_trace() adds any resolved since.
+	// Pass nullptr to stop recording.
+	void set_trace_recorder(TraceRecorder *recorder);
+	void resolve_trace();
+
+	// Opt-in pipeline statistics, which adds atomics to the raster shaders.
+	// read_statistics() flushes and blocks until the GPU is done with all flushes so far.
+	void set_statistics(bool enable);
+	PipelineStatistics read_statistics();
+	void reset_statistics();
+
 	void flush();
 
 private:
@@ -0,0 +1,12 @@
+#pragma once
+
+namespace RetroWarp
+{
+// Capacity of one batch in RasterizerGPU. Running into any of these forces a flush.
+// Kept separate from rasterizer_gpu.hpp, so CPU tools can model flushing without Vulkan.
+// Must match assets/shaders/constants.h.
+constexpr int MAX_PRIMITIVES = 0x4000;
+constexpr int MAX_NUM_TILE_INSTANCES = 0xffff;
+constexpr unsigned MAX_NUM_SHADER_STATE_INDICES = 64;
+constexpr unsigned MAX_NUM_RENDER_STATE_INDICES = 1024;
+}
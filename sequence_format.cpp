@@ -0,0 +1,332 @@
+#include "sequence_format.hpp"
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+
+namespace RetroWarp
+{
+static const char SEQUENCE_MAGIC[] = "RETROWARP SEQ001";
+
+SequenceWriter::~SequenceWriter()
+{
+	close();
+}
+
+bool SequenceWriter::open(const char *path, uint32_t width, uint32_t height, uint32_t num_textures)
+{
+	close();
+
+	FILE *new_file = fopen(path, "wb");
+	if (!new_file)
+		return false;
+
+	bool ok = open([new_file](const void *data, size_t size) { return fwrite(data, size, 1, new_file) == 1; },
+	               width, height, num_textures);
+	// Closed, and num_frames patched, in close().
+	file = new_file;
+	return ok;
+}
+
+bool SequenceWriter::open(DumpWriteCallback write_, uint32_t width, uint32_t height, uint32_t num_textures)
+{
+	close();
+	sink = std::move(write_);
+
+	header = {};
+	memcpy(header.magic, SEQUENCE_MAGIC, sizeof(header.magic));
+	header.width = width;
+	header.height = height;
+	header.num_textures = num_textures;
+	failed = !write(&header, sizeof(header));
+	return !failed;
+}
+
+bool SequenceWriter::is_open() const
+{
+	return bool(sink);
+}
+
+bool SequenceWriter::write(const void *data, size_t size)
+{
+	if (size && !sink(data, size))
+		failed = true;
+	return !failed;
+}
+
+template <typename T>
+bool SequenceWriter::write_run_data(const std::vector<T> &data)
+{
+	for (auto &run : runs)
+		if (!write(data.data() + run.first, run.count * sizeof(T)))
+			return false;
+	return true;
+}
+
+bool SequenceWriter::write_frame(const DumpView &frame)
+{
+	if (!sink || failed)
+		return false;
+	if (frame.width != header.width || frame.height != header.height || frame.num_textures != header.num_textures)
+		return false;
+
+	size_t first_new_state = render_states.size();
+	state_remap.resize(frame.num_render_states);
+	for (size_t i = 0; i < frame.num_render_states; i++)
+	{
+		auto itr = render_state_map.find(frame.render_states[i]);
+		if (itr == render_state_map.end())
+		{
+			state_remap[i] = uint32_t(render_states.size());
+			render_state_map[frame.render_states[i]] = state_remap[i];
+			render_states.push_back(frame.render_states[i]);
+		}
+		else
+			state_remap[i] = itr->second;
+	}
+
+	// Update the previous frame in-place, remembering which ranges had to change.
+	size_t previous_count = positions.size();
+	state_indices.resize(frame.num_primitives);
+	positions.resize(frame.num_primitives);
+	attributes.resize(frame.num_primitives);
+	runs.clear();
+	last_changed_primitives = 0;
+
+	for (size_t i = 0; i < frame.num_primitives; i++)
+	{
+		uint32_t state_index = state_remap[frame.state_indices[i]];
+		if (i < previous_count &&
+		    state_indices[i] == state_index &&
+		    memcmp(&positions[i], &frame.positions[i], sizeof(PrimitiveSetupPos)) == 0 &&
+		    memcmp(&attributes[i], &frame.attributes[i], sizeof(PrimitiveSetupAttr)) == 0)
+		{
+			continue;
+		}
+
+		state_indices[i] = state_index;
+		positions[i] = frame.positions[i];
+		attributes[i] = frame.attributes[i];
+
+		if (!runs.empty() && runs.back().first + runs.back().count == i)
+			runs.back().count++;
+		else
+			runs.push_back({ uint32_t(i), 1 });
+		last_changed_primitives++;
+	}
+
+	SequenceFrameHeader frame_header = {};
+	memcpy(frame_header.fourcc, "FRME", 4);
+	frame_header.num_primitives = uint32_t(frame.num_primitives);
+	frame_header.num_new_render_states = uint32_t(render_states.size() - first_new_state);
+	frame_header.num_runs = uint32_t(runs.size());
+	frame_header.payload_size =
+			uint64_t(frame_header.num_new_render_states) * sizeof(DumpRenderState) +
+			uint64_t(frame_header.num_runs) * sizeof(SequenceRun) +
+			uint64_t(last_changed_primitives) * (sizeof(uint32_t) + sizeof(PrimitiveSetupPos) + sizeof(PrimitiveSetupAttr));
+
+	if (!write(&frame_header, sizeof(frame_header)) ||
+	    !write(render_states.data() + first_new_state, frame_header.num_new_render_states * sizeof(DumpRenderState)) ||
+	    !write(runs.data(), runs.size() * sizeof(SequenceRun)) ||
+	    !write_run_data(state_indices) ||
+	    !write_run_data(positions) ||
+	    !write_run_data(attributes))
+	{
+		return false;
+	}
+
+	header.num_frames++;
+	return true;
+}
+
+size_t SequenceWriter::get_last_changed_primitives() const
+{
+	return last_changed_primitives;
+}
+
+uint32_t SequenceWriter::get_num_frames() const
+{
+	return header.num_frames;
+}
+
+bool SequenceWriter::close()
+{
+	if (!sink)
+		return true;
+
+	if (file)
+	{
+		if (!failed && fseek(file, offsetof(SequenceHeader, num_frames), SEEK_SET) == 0)
+			write(&header.num_frames, sizeof(header.num_frames));
+		if (fclose(file) != 0)
+			failed = true;
+		file = nullptr;
+	}
+	sink = {};
+
+	bool ok = !failed;
+	failed = false;
+	render_states.clear();
+	render_state_map.clear();
+	state_indices.clear();
+	positions.clear();
+	attributes.clear();
+	return ok;
+}
+
+bool SequenceReader::init(const void *data, size_t size_)
+{
+	blob = static_cast<const uint8_t *>(data);
+	size = size_;
+	if (get_dump_version(data, size) != DumpVersion::Sequence || size < sizeof(SequenceHeader))
+		return false;
+
+	memcpy(&header, blob, sizeof(header));
+	rewind();
+	return true;
+}
+
+uint32_t SequenceReader::get_width() const
+{
+	return header.width;
+}
+
+uint32_t SequenceReader::get_height() const
+{
+	return header.height;
+}
+
+uint32_t SequenceReader::get_num_textures() const
+{
+	return header.num_textures;
+}
+
+void SequenceReader::rewind()
+{
+	offset = sizeof(SequenceHeader);
+	error = false;
+	frame_index = 0;
+	last_changed_primitives = 0;
+	render_states.clear();
+	state_indices.clear();
+	positions.clear();
+	attributes.clear();
+}
+
+bool SequenceReader::failed() const
+{
+	return error;
+}
+
+unsigned SequenceReader::get_frame_index() const
+{
+	return frame_index;
+}
+
+size_t SequenceReader::get_last_changed_primitives() const
+{
+	return last_changed_primitives;
+}
+
+template <typename T>
+static void read_run_data(std::vector<T> &data, const std::vector<SequenceRun> &runs, const uint8_t *&ptr)
+{
+	for (auto &run : runs)
+	{
+		memcpy(data.data() + run.first, ptr, run.count * sizeof(T));
+		ptr += run.count * sizeof(T);
+	}
+}
+
+bool SequenceReader::next_frame(DumpView &view)
+{
+	if (error || offset == size)
+		return false;
+
+	error = true;
+	SequenceFrameHeader frame_header;
+	if (size - offset < sizeof(frame_header))
+		return false;
+	memcpy(&frame_header, blob + offset, sizeof(frame_header));
+	offset += sizeof(frame_header);
+
+	if (memcmp(frame_header.fourcc, "FRME", 4) != 0 || frame_header.payload_size > size - offset)
+		return false;
+
+	// Validate the whole record before touching the current frame.
+	uint64_t expected_size = uint64_t(frame_header.num_new_render_states) * sizeof(DumpRenderState) +
+	                         uint64_t(frame_header.num_runs) * sizeof(SequenceRun);
+	if (expected_size > frame_header.payload_size)
+		return false;
+
+	const uint8_t *ptr = blob + offset;
+	const uint8_t *states_ptr = ptr;
+	ptr += frame_header.num_new_render_states * sizeof(DumpRenderState);
+
+	std::vector<SequenceRun> runs(frame_header.num_runs);
+	if (!runs.empty())
+		memcpy(runs.data(), ptr, runs.size() * sizeof(SequenceRun));
+	ptr += runs.size() * sizeof(SequenceRun);
+
+	// Runs must be sorted and cover every primitive the previous frame did not have.
+	size_t previous_count = positions.size();
+	size_t num_primitives = frame_header.num_primitives;
+	uint64_t changed = 0;
+	uint64_t covered_new = 0;
+	uint64_t end = 0;
+	for (auto &run : runs)
+	{
+		uint64_t run_end = uint64_t(run.first) + run.count;
+		if (run.first < end || run_end > num_primitives)
+			return false;
+		end = run_end;
+		changed += run.count;
+		if (run_end > previous_count)
+			covered_new += run_end - std::max<uint64_t>(run.first, previous_count);
+	}
+
+	if (num_primitives > previous_count && covered_new != num_primitives - previous_count)
+		return false;
+
+	expected_size += changed * (sizeof(uint32_t) + sizeof(PrimitiveSetupPos) + sizeof(PrimitiveSetupAttr));
+	if (expected_size != frame_header.payload_size)
+		return false;
+
+	for (uint32_t i = 0; i < frame_header.num_new_render_states; i++)
+	{
+		DumpRenderState state;
+		memcpy(&state, states_ptr + i * sizeof(DumpRenderState), sizeof(state));
+		if (state.texture_index >= header.num_textures)
+			return false;
+		render_states.push_back(state);
+	}
+
+	state_indices.resize(num_primitives);
+	positions.resize(num_primitives);
+	attributes.resize(num_primitives);
+	read_run_data(state_indices, runs, ptr);
+	read_run_data(positions, runs, ptr);
+	read_run_data(attributes, runs, ptr);
+
+	for (auto &run : runs)
+		for (uint32_t i = 0; i < run.count; i++)
+			if (state_indices[run.first + i] >= render_states.size())
+				return false;
+
+	offset += size_t(frame_header.payload_size);
+	frame_index++;
+	last_changed_primitives = size_t(changed);
+	error = false;
+
+	view = {};
+	view.width = header.width;
+	view.height = header.height;
+	view.num_textures = header.num_textures;
+	view.render_states = render_states.data();
+	view.num_render_states = render_states.size();
+	view.state_indices = state_indices.data();
+	view.positions = positions.data();
+	view.attributes = attributes.data();
+	view.num_primitives = num_primitives;
+	return true;
+}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "dump_format.hpp"
+#include <stdio.h>
+
+namespace RetroWarp
+{
+// Sequence of frames captured from the viewer, "RETROWARP SEQ001".
+//
+// SequenceHeader is followed by one record per frame, each starting with SequenceFrameHeader.
+// Render states form one table for the whole sequence, every frame appends the states it introduced.
+// Primitives are delta coded against the previous frame by primitive index:
+// - num_new_render_states DumpRenderState, appended to the render state table.
+// - num_runs SequenceRun, ranges of primitives which differ from the previous frame.
+// - For every primitive covered by the runs, in order: uint32_t render state indices,
+//   then PrimitiveSetupPos, then PrimitiveSetupAttr.
+// Primitives past the end of the previous frame are always part of a run.
+// A frame with fewer primitives than the previous one drops the excess.
+
+struct SequenceHeader
+{
+	char magic[16];
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_textures;
+	// Patched when the writer is closed, 0 if the capture was cut short.
+	uint32_t num_frames;
+};
+
+struct SequenceFrameHeader
+{
+	char fourcc[4];
+	uint32_t num_primitives;
+	uint32_t num_new_render_states;
+	uint32_t num_runs;
+	// Size of the record following this header.
+	uint64_t payload_size;
+};
+
+struct SequenceRun
+{
+	uint32_t first;
+	uint32_t count;
+};
+
+class SequenceWriter
+{
+public:
+	SequenceWriter() = default;
+	~SequenceWriter();
+	SequenceWriter(const SequenceWriter &) = delete;
+	void operator=(const SequenceWriter &) = delete;
+
+	bool open(const char *path, uint32_t width, uint32_t height, uint32_t num_textures);
+	// Streams the sequence through write instead, e.g. into a CaptureWriter.
+	// num_frames in the header stays 0, the owner of the output patches in get_num_frames() if it can.
+	bool open(DumpWriteCallback write, uint32_t width, uint32_t height, uint32_t num_textures);
+	bool is_open() const;
+	// Resolution and texture count of the frame must match what was passed to open().
+	bool write_frame(const DumpView &frame);
+	bool close();
+
+	uint32_t get_num_frames() const;
+
+	// Primitives of the last frame which had to be written, as opposed to reused from the frame before it.
+	size_t get_last_changed_primitives() const;
+
+private:
+	DumpWriteCallback sink;
+	// Only set if opened by path.
+	FILE *file = nullptr;
+	SequenceHeader header = {};
+	bool failed = false;
+
+	std::vector<DumpRenderState> render_states;
+	std::unordered_map<DumpRenderState, uint32_t, DumpRenderStateHash, DumpRenderStateEqual> render_state_map;
+
+	// Previous frame, with render state indices into render_states.
+	std::vector<uint32_t> state_indices;
+	std::vector<PrimitiveSetupPos> positions;
+	std::vector<PrimitiveSetupAttr> attributes;
+
+	std::vector<uint32_t> state_remap;
+	std::vector<SequenceRun> runs;
+	size_t last_changed_primitives = 0;
+
+	bool write(const void *data, size_t size);
+	template <typename T>
+	bool write_run_data(const std::vector<T> &data);
+};
+
+// Walks a sequence held in memory, reconstructing one frame at a time.
+// Only primitives which changed are copied, everything else is kept from the previous frame.
+class SequenceReader
+{
+public:
+	// The reader points into data, which must stay alive.
+	bool init(const void *data, size_t size);
+
+	uint32_t get_width() const;
+	uint32_t get_height() const;
+	uint32_t get_num_textures() const;
+
+	// Applies the next frame and returns a view of it, valid until the next call.
+	// Returns false at the end of the sequence, or if the sequence is corrupt, see failed().
+	bool next_frame(DumpView &view);
+	void rewind();
+	bool failed() const;
+
+	// Frames decoded since the last rewind.
+	unsigned get_frame_index() const;
+	size_t get_last_changed_primitives() const;
+
+private:
+	const uint8_t *blob = nullptr;
+	size_t size = 0;
+	size_t offset = 0;
+	SequenceHeader header = {};
+	bool error = false;
+	unsigned frame_index = 0;
+	size_t last_changed_primitives = 0;
+
+	std::vector<DumpRenderState> render_states;
+	std::vector<uint32_t> state_indices;
+	std::vector<PrimitiveSetupPos> positions;
+	std::vector<PrimitiveSetupAttr> attributes;
+};
+}
@@ -0,0 +1,72 @@
+#include "tile_coverage.hpp"
+#include <algorithm>
+
+namespace RetroWarp
+{
+static const int RASTER_ROUNDING = (1 << (SUBPIXELS_LOG2 + 16)) - 1;
+
+// Same as interpolate_x() in the shaders, including the wrap-around of 32-bit arithmetic.
+static void interpolate_x(const PrimitiveSetupPos &pos, int y_sub, int &primary_x, int &secondary_x)
+{
+	auto x_a = int32_t(uint32_t(pos.x_a) + uint32_t(pos.dxdy_a) * uint32_t(y_sub - pos.y_lo));
+	auto x_b = int32_t(uint32_t(pos.x_b) + uint32_t(pos.dxdy_b) * uint32_t(y_sub - pos.y_lo));
+	auto x_c = int32_t(uint32_t(pos.x_c) + uint32_t(pos.dxdy_c) * uint32_t(y_sub - pos.y_mid));
+	primary_x = x_a;
+	secondary_x = y_sub >= pos.y_mid ? x_c : x_b;
+}
+
+unsigned compute_tile_coverage(const PrimitiveSetupPos &pos, unsigned tile_size_log2, const TileCoverageRect &scissor)
+{
+	int scissor_end_x = scissor.x + scissor.width;
+	int scissor_end_y = scissor.y + scissor.height;
+	if (scissor.width <= 0 || scissor.height <= 0)
+		return 0;
+
+	int span_begin_y = (pos.y_lo + (1 << SUBPIXELS_LOG2) - 1) >> SUBPIXELS_LOG2;
+	int span_end_y = (pos.y_hi - 1) >> SUBPIXELS_LOG2;
+	span_begin_y = std::max(span_begin_y, scissor.y);
+	span_end_y = std::min(span_end_y, scissor_end_y - 1);
+	if (span_end_y < span_begin_y)
+		return 0;
+
+	int tile_size = 1 << tile_size_log2;
+	int start_tile_y = span_begin_y >> tile_size_log2;
+	int end_tile_y = span_end_y >> tile_size_log2;
+	unsigned num_tiles = 0;
+
+	for (int tile_y = start_tile_y; tile_y <= end_tile_y; tile_y++)
+	{
+		int start_pixel_y = std::max(tile_y * tile_size, scissor.y);
+		int end_pixel_y = std::min((tile_y + 1) * tile_size, scissor_end_y);
+
+		int start_y = std::max(start_pixel_y << SUBPIXELS_LOG2, int(pos.y_lo));
+		int end_y = std::min((end_pixel_y - 1) << SUBPIXELS_LOG2, pos.y_hi - 1);
+		if (end_y < start_y)
+			continue;
+
+		int lo_primary, lo_secondary, hi_primary, hi_secondary;
+		interpolate_x(pos, start_y, lo_primary, lo_secondary);
+		interpolate_x(pos, end_y, hi_primary, hi_secondary);
+		int lo_x = std::min(std::min(lo_primary, lo_secondary), std::min(hi_primary, hi_secondary));
+		int hi_x = std::max(std::max(lo_primary, lo_secondary), std::max(hi_primary, hi_secondary));
+
+		if (pos.y_mid > start_y && pos.y_mid < end_y)
+		{
+			int mid_primary, mid_secondary;
+			interpolate_x(pos, pos.y_mid, mid_primary, mid_secondary);
+			lo_x = std::min(lo_x, std::min(mid_primary, mid_secondary));
+			hi_x = std::max(hi_x, std::max(mid_primary, mid_secondary));
+		}
+
+		int start_x = (lo_x + RASTER_ROUNDING) >> (16 + SUBPIXELS_LOG2);
+		int end_x = (hi_x - 1) >> (16 + SUBPIXELS_LOG2);
+		start_x = std::max(start_x, scissor.x);
+		end_x = std::min(end_x, scissor_end_x - 1);
+
+		if (start_x <= end_x)
+			num_tiles += unsigned((end_x >> tile_size_log2) - (start_x >> tile_size_log2) + 1);
+	}
+
+	return num_tiles;
+}
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "primitive_setup.hpp"
+
+namespace RetroWarp
+{
+struct TileCoverageRect
+{
+	int x, y, width, height;
+};
+
+// Counts the tiles binning assigns a primitive to, rather than every tile within its bounding box.
+// Mirrors bin_primitive() in assets/shaders/rasterizer_helpers.h, evaluated once per row of tiles.
+// Tiles are (1 << tile_size_log2) pixels large, and the primitive is clipped against scissor.
+unsigned compute_tile_coverage(const PrimitiveSetupPos &pos, unsigned tile_size_log2, const TileCoverageRect &scissor);
+}
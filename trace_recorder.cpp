@@ -0,0 +1,122 @@
+#include "trace_recorder.hpp"
+#include "json_util.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+namespace RetroWarp
+{
+TraceRecorder::TraceRecorder(size_t max_events_)
+	: base(std::chrono::steady_clock::now()), max_events(max_events_)
+{
+}
+
+int64_t TraceRecorder::get_time_ns() const
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - base).count();
+}
+
+uint32_t TraceRecorder::get_thread_track()
+{
+	auto id = std::this_thread::get_id();
+	auto itr = thread_tracks.find(id);
+	if (itr != thread_tracks.end())
+		return itr->second;
+
+	uint32_t track = uint32_t(track_names.size());
+	track_names.push_back("CPU thread " + std::to_string(thread_tracks.size()));
+	thread_tracks[id] = track;
+	return track;
+}
+
+uint32_t TraceRecorder::get_named_track(const char *name)
+{
+	auto itr = std::find(track_names.begin(), track_names.end(), name);
+	if (itr != track_names.end())
+		return uint32_t(itr - track_names.begin());
+
+	track_names.push_back(name);
+	return uint32_t(track_names.size() - 1);
+}
+
+void TraceRecorder::add_span(uint32_t track, const char *name, int64_t start_ns, int64_t end_ns)
+{
+	if (events.size() >= max_events)
+	{
+		dropped_events++;
+		return;
+	}
+
+	events.push_back({ name, track, start_ns, std::max(start_ns, end_ns) });
+}
+
+void TraceRecorder::add_cpu_span(const char *name, int64_t start_ns, int64_t end_ns)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	add_span(get_thread_track(), name, start_ns, end_ns);
+}
+
+void TraceRecorder::add_track_span(const char *track, const char *name, int64_t start_ns, int64_t end_ns)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	add_span(get_named_track(track), name, start_ns, end_ns);
+}
+
+size_t TraceRecorder::get_num_events() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return events.size();
+}
+
+size_t TraceRecorder::get_dropped_events() const
+{
+	std::lock_guard<std::mutex> holder{lock};
+	return dropped_events;
+}
+
+bool TraceRecorder::write_chrome_trace(const char *path) const
+{
+	std::lock_guard<std::mutex> holder{lock};
+
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n\"displayTimeUnit\": \"ns\",\n\"traceEvents\": [\n");
+	fprintf(file, "{ \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"name\": \"process_name\", \"args\": { \"name\": \"RetroWarp\" } }");
+
+	// Keep tracks in creation order, rather than sorted by name.
+	for (size_t i = 0; i < track_names.size(); i++)
+	{
+		fprintf(file, ",\n{ \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_name\", \"args\": { \"name\": ", unsigned(i));
+		write_json_string(file, track_names[i].c_str());
+		fprintf(file, " } }");
+		fprintf(file, ",\n{ \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_sort_index\", \"args\": { \"sort_index\": %u } }",
+		        unsigned(i), unsigned(i));
+	}
+
+	// Timestamps are in microseconds.
+	for (auto &event : events)
+	{
+		fprintf(file, ",\n{ \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"name\": ",
+		        event.track, double(event.start_ns) * 1e-3, double(event.end_ns - event.start_ns) * 1e-3);
+		write_json_string(file, event.name);
+		fprintf(file, " }");
+	}
+
+	fprintf(file, "\n]\n}\n");
+	return fclose(file) == 0;
+}
+
+TraceScope::TraceScope(TraceRecorder *recorder_, const char *name_)
+	: recorder(recorder_), name(name_)
+{
+	if (recorder)
+		start_ns = recorder->get_time_ns();
+}
+
+TraceScope::~TraceScope()
+{
+	if (recorder)
+		recorder->add_cpu_span(name, start_ns, recorder->get_time_ns());
+}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace RetroWarp
+{
+// Collects spans from CPU threads and other timelines, e.g. GPU timestamps,
+// and writes them as Chrome trace JSON, which chrome://tracing and ui.perfetto.dev can open.
+// Names are not copied and must outlive the recorder, e.g. string literals. Thread safe.
+class TraceRecorder
+{
+public:
+	explicit TraceRecorder(size_t max_events = 1u << 20);
+
+	TraceRecorder(const TraceRecorder &) = delete;
+	void operator=(const TraceRecorder &) = delete;
+
+	// Nanoseconds since the recorder was created. All spans are on this clock.
+	int64_t get_time_ns() const;
+
+	// Span on the calling thread.
+	void add_cpu_span(const char *name, int64_t start_ns, int64_t end_ns);
+	// Span on a named track which is not a CPU thread, e.g. "GPU".
+	void add_track_span(const char *track, const char *name, int64_t start_ns, int64_t end_ns);
+
+	// Once max_events is reached, further spans are dropped.
+	size_t get_num_events() const;
+	size_t get_dropped_events() const;
+
+	bool write_chrome_trace(const char *path) const;
+
+private:
+	struct Event
+	{
+		const char *name;
+		uint32_t track;
+		int64_t start_ns;
+		int64_t end_ns;
+	};
+
+	mutable std::mutex lock;
+	std::chrono::steady_clock::time_point base;
+	std::vector<Event> events;
+	size_t max_events;
+	size_t dropped_events = 0;
+	// Index is the track ID.
+	std::vector<std::string> track_names;
+	std::unordered_map<std::thread::id, uint32_t> thread_tracks;
+
+	void add_span(uint32_t track, const char *name, int64_t start_ns, int64_t end_ns);
+	uint32_t get_thread_track();
+	uint32_t get_named_track(const char *name);
+};
+
+// Adds a CPU span covering the lifetime of the scope. Does nothing if recorder is nullptr.
+class TraceScope
+{
+public:
+	TraceScope(TraceRecorder *recorder, const char *name);
+	~TraceScope();
+
+	TraceScope(const TraceScope &) = delete;
+	void operator=(const TraceScope &) = delete;
+
+private:
+	TraceRecorder *recorder;
+	const char *name;
+	int64_t start_ns = 0;
+};
+}
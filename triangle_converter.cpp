@@ -400,9 +400,9 @@ static unsigned setup_clipped_triangles_clipped_w(PrimitiveSetup *setup, InputPr
 		return 0;
 	}
 
-	// FIXME: Not sure what the theoretical bound is, but it's probably way less than 256.
-	InputPrimitive tmp_a[256];
-	InputPrimitive tmp_b[256];
+	// Six clip planes, each of which at most doubles the primitive count.
+	InputPrimitive tmp_a[MAX_SETUPS_PER_TRIANGLE / 2];
+	InputPrimitive tmp_b[MAX_SETUPS_PER_TRIANGLE / 2];
 
 #if 0
 	// Fixed point consideration.
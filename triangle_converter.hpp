@@ -47,5 +47,10 @@ struct ViewportTransform
 	float max_depth;
 };
 
-unsigned setup_clipped_triangles(PrimitiveSetup prim[8], const InputPrimitive &input, CullMode mode, const ViewportTransform &vp);
+// Clipping against W splits a triangle in at most two, and each of the six remaining clip planes at most doubles that.
+// GPU triangle setup follows the same rules, so it never produces more either.
+constexpr unsigned MAX_SETUPS_PER_TRIANGLE = 2 * 64;
+
+unsigned setup_clipped_triangles(PrimitiveSetup prim[MAX_SETUPS_PER_TRIANGLE], const InputPrimitive &input,
+                                 CullMode mode, const ViewportTransform &vp);
 }
@@ -1,9 +1,15 @@
 #include "primitive_setup.hpp"
 #include "rasterizer_cpu.hpp"
 #include "triangle_converter.hpp"
+#include "dump_format.hpp"
+#include "capture_writer.hpp"
+#include "sequence_format.hpp"
+#include "vram_image.hpp"
+#include "trace_recorder.hpp"
 #include "canvas.hpp"
 #include "stb_image_write.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <vector>
 #include <random>
 #include <assert.h>
@@ -38,12 +44,17 @@ struct SoftwareRenderableComponent : ComponentBase
 
 struct SWRenderApplication : Application, EventHandler
 {
-	explicit SWRenderApplication(const std::string &path, bool subgroup, bool ubershader, bool async_compute,
-	                             unsigned width, unsigned height, unsigned tile_size);
+	explicit SWRenderApplication(const std::string &path, bool subgroup, PipelineMode pipeline_mode, bool async_compute,
+	                             bool gpu_setup, unsigned width, unsigned height, unsigned tile_size,
+	                             const std::string &record_prefix, const std::string &capture_prefix,
+	                             const std::string &sequence_path, bool dump_clip_space, const std::string &trace_path);
 	void render_frame(double, double) override;
 
 	SceneLoader loader;
 	FPSCamera cam;
+	// Declared before the rasterizer, which records into it.
+	std::unique_ptr<TraceRecorder> trace_recorder;
+	std::string trace_path;
 	RasterizerGPU rasterizer_gpu;
 
 	void on_device_created(const Vulkan::DeviceCreatedEvent &e);
@@ -51,7 +62,20 @@ struct SWRenderApplication : Application, EventHandler
 	bool on_key_pressed(const KeyboardEvent &e);
 	bool queue_dump_frame = false;
 
-	FILE *dump_file = nullptr;
+	// Delta codes frames on the render thread and streams them into capture_writer.
+	SequenceWriter sequence_writer;
+	// Dumped frames are built in memory and streamed to the capture writer in end_dump_frame().
+	CaptureWriter capture_writer;
+	unsigned captured_frames = 0;
+	unsigned dropped_frames = 0;
+	// Set once a sequence overflowed the capture writer, a sequence cannot skip frames.
+	bool capture_stopped = false;
+	// Points to dump_frame while a frame is being dumped. The frame is reused, so its allocations stick around.
+	DumpData dump_frame;
+	DumpData *dump_data = nullptr;
+	DumpRenderState dump_state;
+	std::string dump_path;
+	bool dump_textures_written = false;
 	void begin_dump_frame();
 	void end_dump_frame();
 	void dump_textures(const std::vector<Vulkan::MemoryMappedTexture *> &textures);
@@ -59,6 +83,9 @@ struct SWRenderApplication : Application, EventHandler
 	void dump_primitives(const PrimitiveSetup *setup, unsigned count);
 	void dump_alpha_threshold(uint8_t threshold);
 	void dump_rop_state(BlendState blend_state);
+	void dump_pipeline_state(DrawPipeline pipeline);
+	void apply_pipeline_state(DrawPipeline pipeline);
+	bool queue_validate_gpu_setup = false;
 
 	struct Cached
 	{
@@ -69,16 +96,29 @@ struct SWRenderApplication : Application, EventHandler
 	};
 	std::vector<Cached> setup_cache;
 	bool update_setup_cache = true;
+	// Baked version of setup_cache while frozen.
+	std::shared_ptr<DisplayList> frozen_display_list;
 	bool subgroup;
-	bool ubershader;
+	PipelineMode pipeline_mode;
 	bool async_compute;
+	bool gpu_setup;
 	unsigned fb_width;
 	unsigned fb_height;
 	unsigned tile_size;
+	std::string record_prefix;
+	unsigned record_frame_index = 0;
+	std::string capture_prefix;
+	unsigned capture_frame_index = 0;
+	std::string sequence_path;
+	// Also store transformed vertices and indices in dumps, so clipping and triangle setup can be replayed.
+	bool dump_clip_space;
 
 	std::unordered_map<std::string, unsigned> state_index_map;
 	std::vector<const Vulkan::TextureFormatLayout *> state_index_layout;
 	std::vector<TextureDescriptor> texture_descriptors;
+	// Range of VRAM holding textures, which does not change after on_device_created().
+	uint32_t texture_vram_begin = 0;
+	uint32_t texture_vram_end = 0;
 	void create_software_renderable(Entity *entity, RenderableComponent *renderable);
 };
 
@@ -202,7 +242,9 @@ void SWRenderApplication::create_software_renderable(Entity *entity, RenderableC
 
 void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 {
-	rasterizer_gpu.init(e.get_device(), subgroup, ubershader, async_compute, tile_size);
+	rasterizer_gpu.init(e.get_device(), subgroup, pipeline_mode == PipelineMode::Ubershader, async_compute, tile_size);
+	rasterizer_gpu.set_pipeline_mode(pipeline_mode);
+	rasterizer_gpu.set_trace_recorder(trace_recorder.get());
 	rasterizer_gpu.set_rop_state(BlendState::Replace);
 	rasterizer_gpu.set_depth_state(DepthTest::LE, DepthWrite::On);
 	rasterizer_gpu.set_combiner_mode(COMBINER_MODE_TEX_MOD_COLOR | COMBINER_SAMPLE_BIT);
@@ -212,6 +254,7 @@ void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 	addr += fb_width * fb_height * 2;
 	rasterizer_gpu.set_depth_framebuffer(addr, fb_width, fb_height, fb_width * 2);
 	addr += fb_width * fb_height * 2;
+	texture_vram_begin = (addr + 63) & ~63;
 
 	unsigned num_textures = state_index_layout.size();
 	for (unsigned i = 0; i < num_textures; i++)
@@ -249,86 +292,190 @@ void SWRenderApplication::on_device_created(const Vulkan::DeviceCreatedEvent& e)
 		texture_descriptors.push_back(descriptor);
 	}
 
+	texture_vram_end = std::max(addr, texture_vram_begin);
 	LOGI("Allocated %u bytes.\n", addr);
 }
 
-void SWRenderApplication::on_device_destroyed(const Vulkan::DeviceCreatedEvent &)
+void SWRenderApplication::on_device_destroyed(const Vulkan::DeviceCreatedEvent &e)
 {
+	frozen_display_list.reset();
+	rasterizer_gpu.wait_readbacks();
+	if (sequence_writer.is_open())
+	{
+		// The header is written before any frame, so the frame count is patched in at the end.
+		uint32_t num_frames = sequence_writer.get_num_frames();
+		sequence_writer.close();
+		capture_writer.end_file([num_frames](FILE *file) {
+			return fseek(file, offsetof(SequenceHeader, num_frames), SEEK_SET) == 0 &&
+			       fwrite(&num_frames, sizeof(num_frames), 1, file) == 1;
+		});
+	}
+	capture_writer.wait_idle();
+	if (!capture_prefix.empty() || !sequence_path.empty())
+	{
+		LOGI("Captured %u frames, dropped %u frames, %llu bytes, %u failed writes.\n", captured_frames, dropped_frames,
+		     static_cast<unsigned long long>(capture_writer.get_written_bytes()), capture_writer.get_failed_jobs());
+	}
+
+	if (trace_recorder)
+	{
+		e.get_device().wait_idle();
+		rasterizer_gpu.resolve_trace();
+		rasterizer_gpu.set_trace_recorder(nullptr);
+		if (trace_recorder->write_chrome_trace(trace_path.c_str()))
+		{
+			LOGI("Wrote %u trace events to %s, %u dropped.\n", unsigned(trace_recorder->get_num_events()),
+			     trace_path.c_str(), unsigned(trace_recorder->get_dropped_events()));
+		}
+		else
+			LOGE("Failed to write trace to %s.\n", trace_path.c_str());
+	}
 }
 
 void SWRenderApplication::begin_dump_frame()
 {
-	dump_file = fopen("retrowarp.dump", "wb");
-	if (!dump_file)
+	// Textures of a capture or sequence are shared by all frames and only written once.
+	if (!sequence_path.empty())
+		dump_path = sequence_path;
+	else if (!capture_prefix.empty())
 	{
-		LOGE("Failed to dump.\n");
-		exit(EXIT_FAILURE);
+		char frame_suffix[32];
+		snprintf(frame_suffix, sizeof(frame_suffix), ".%06u.dump", capture_frame_index++);
+		dump_path = capture_prefix + frame_suffix;
+	}
+	else
+	{
+		dump_path = "retrowarp.dump";
+		dump_textures_written = false;
 	}
 
-	fwrite("RETROWARP DUMP01", 1, 16, dump_file);
-
-	uint32_t word = fb_width;
-	fwrite(&word, 1, sizeof(word), dump_file);
-	word = fb_height;
-	fwrite(&word, 1, sizeof(word), dump_file);
+	dump_frame.clear();
+	dump_data = &dump_frame;
+	dump_data->width = fb_width;
+	dump_data->height = fb_height;
+	dump_state = {};
 }
 
 void SWRenderApplication::dump_textures(const std::vector<Vulkan::MemoryMappedTexture *> &textures)
 {
-	if (!dump_file)
+	if (!dump_data)
+		return;
+	dump_data->num_textures = textures.size();
+	if (dump_textures_written)
 		return;
-	uint32_t word = textures.size();
-	fwrite(&word, 1, sizeof(word), dump_file);
+
+	// Textures live as long as the scene, so they can be encoded on the I/O thread.
+	auto base = capture_prefix.empty() ? dump_path : capture_prefix;
 	for (unsigned i = 0; i < textures.size(); i++)
-		textures[i]->copy_to_path(*GRANITE_FILESYSTEM(), std::string("retrowarp.dump.tex.") + std::to_string(i));
+	{
+		auto *texture = textures[i];
+		auto tex_path = base + ".tex." + std::to_string(i);
+		capture_writer.submit([texture, tex_path]() {
+			return texture->copy_to_path(*GRANITE_FILESYSTEM(), tex_path);
+		});
+	}
+
+	// Also snapshot the textures as they sit in VRAM, so replays can skip mipmapping and conversion.
+	// The readback completes in a later poll_readbacks(), and the copy is written on the I/O thread.
+	auto descriptors = std::make_shared<std::vector<TextureDescriptor>>(texture_descriptors);
+	auto vram_path = base + ".vram";
+	uint32_t vram_offset = texture_vram_begin;
+	rasterizer_gpu.request_vram_readback(texture_vram_begin, texture_vram_end - texture_vram_begin,
+	                                     [this, descriptors, vram_path, vram_offset](const ReadbackFrame &frame) {
+		const auto *bytes = static_cast<const uint8_t *>(frame.data);
+		auto vram = std::make_shared<std::vector<uint8_t>>(bytes, bytes + frame.width);
+		capture_writer.submit([vram, descriptors, vram_path, vram_offset]() {
+			VRAMImageView view;
+			view.vram_offset = vram_offset;
+			view.vram = vram->data();
+			view.vram_size = vram->size();
+			view.descriptors = descriptors->data();
+			view.num_descriptors = descriptors->size();
+			return write_vram_image(vram_path.c_str(), view);
+		});
+	});
+	dump_textures_written = true;
 }
 
 void SWRenderApplication::dump_set_texture(unsigned index)
 {
-	if (!dump_file)
-		return;
-	uint32_t word = index;
-	fwrite("TEX ", 1, 4, dump_file);
-	fwrite(&word, 1, sizeof(word), dump_file);
+	dump_state.texture_index = index;
 }
 
 void SWRenderApplication::dump_alpha_threshold(uint8_t threshold)
 {
-	fwrite("ATRS", 1, 4, dump_file);
-	uint32_t word = threshold;
-	fwrite(&word, 1, sizeof(word), dump_file);
+	dump_state.alpha_threshold = threshold;
 }
 
 void SWRenderApplication::dump_rop_state(BlendState blend_state)
 {
-	fwrite("BSTA", 1, 4, dump_file);
-	uint32_t word = uint32_t(blend_state);
-	fwrite(&word, 1, sizeof(word), dump_file);
+	dump_state.blend_state = uint8_t(blend_state);
 }
 
 void SWRenderApplication::dump_primitives(const PrimitiveSetup *setup, unsigned count)
 {
-	if (!dump_file)
+	if (!dump_data)
 		return;
 	for (unsigned i = 0; i < count; i++)
-	{
-		fwrite("PRIM", 1, 4, dump_file);
-		fwrite(&setup[i], 1, sizeof(PrimitiveSetup), dump_file);
-	}
+		dump_data->add_primitive(dump_state, setup[i]);
 }
 
 void SWRenderApplication::end_dump_frame()
 {
-	if (dump_file)
-		fclose(dump_file);
-	dump_file = nullptr;
+	if (!dump_data)
+		return;
+
+	// Serializing is a copy into the capture writer's chunks, the disk is only touched on the I/O thread.
+	auto view = dump_data->get_view();
+	auto append = [this](const void *data, size_t size) { return capture_writer.append(data, size); };
+	dump_data = nullptr;
+
+	bool queued;
+	if (sequence_path.empty())
+		queued = capture_writer.begin_file(dump_path) && write_dump(view, append) && capture_writer.end_file();
+	else
+	{
+		if (!sequence_writer.is_open())
+		{
+			queued = capture_writer.begin_file(sequence_path) &&
+			         sequence_writer.open(append, view.width, view.height, view.num_textures);
+		}
+		else
+			queued = true;
+		queued = queued && sequence_writer.write_frame(view);
+	}
+
+	if (queued)
+		captured_frames++;
+	else if (capture_writer.overflowed() && sequence_path.empty())
+	{
+		// The I/O thread deletes the incomplete file, later frames are captured as usual.
+		LOGE("Capture I/O fell behind and ran out of buffer space, dropped %s.\n", dump_path.c_str());
+		dropped_frames++;
+	}
+	else if (capture_writer.overflowed())
+	{
+		LOGE("Capture I/O fell behind and ran out of buffer space, deleted incomplete %s. Capturing stopped.\n",
+		     dump_path.c_str());
+		sequence_writer.close();
+		capture_stopped = true;
+	}
+	else
+		LOGE("Failed to capture frame to %s.\n", dump_path.c_str());
 }
 
-SWRenderApplication::SWRenderApplication(const std::string &path, bool subgroup_, bool ubershader_, bool async_compute_,
-                                         unsigned width_, unsigned height_, unsigned tile_size_)
-		: subgroup(subgroup_), ubershader(ubershader_), async_compute(async_compute_),
-		  fb_width(width_), fb_height(height_), tile_size(tile_size_)
+SWRenderApplication::SWRenderApplication(const std::string &path, bool subgroup_, PipelineMode pipeline_mode_, bool async_compute_,
+                                         bool gpu_setup_, unsigned width_, unsigned height_, unsigned tile_size_,
+                                         const std::string &record_prefix_, const std::string &capture_prefix_,
+                                         const std::string &sequence_path_, bool dump_clip_space_,
+                                         const std::string &trace_path_)
+		: trace_path(trace_path_), subgroup(subgroup_), pipeline_mode(pipeline_mode_), async_compute(async_compute_), gpu_setup(gpu_setup_),
+		  fb_width(width_), fb_height(height_), tile_size(tile_size_), record_prefix(record_prefix_),
+		  capture_prefix(capture_prefix_), sequence_path(sequence_path_), dump_clip_space(dump_clip_space_)
 {
+	if (!trace_path.empty())
+		trace_recorder.reset(new TraceRecorder);
+
 	loader.load_scene(path);
 	get_wsi().set_backbuffer_srgb(false);
 
@@ -353,6 +500,8 @@ bool SWRenderApplication::on_key_pressed(const KeyboardEvent &e)
 {
 	if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::C)
 		queue_dump_frame = true;
+	else if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::V)
+		queue_validate_gpu_setup = true;
 	else if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::U)
 		update_setup_cache = !update_setup_cache;
 	else if (e.get_key_state() == KeyState::Pressed && e.get_key() == Key::Space)
@@ -360,6 +509,51 @@ bool SWRenderApplication::on_key_pressed(const KeyboardEvent &e)
 	return true;
 }
 
+void SWRenderApplication::dump_pipeline_state(DrawPipeline pipeline)
+{
+	switch (pipeline)
+	{
+	case DrawPipeline::Opaque:
+		dump_alpha_threshold(0);
+		dump_rop_state(BlendState::Replace);
+		break;
+
+	case DrawPipeline::AlphaTest:
+		dump_alpha_threshold(128);
+		dump_rop_state(BlendState::Replace);
+		break;
+
+	case DrawPipeline::AlphaBlend:
+		dump_alpha_threshold(0);
+		dump_rop_state(BlendState::Alpha);
+		break;
+	}
+}
+
+void SWRenderApplication::apply_pipeline_state(DrawPipeline pipeline)
+{
+	switch (pipeline)
+	{
+	case DrawPipeline::Opaque:
+		rasterizer_gpu.set_alpha_threshold(0);
+		rasterizer_gpu.set_rop_state(BlendState::Replace);
+		break;
+
+	case DrawPipeline::AlphaTest:
+		rasterizer_gpu.set_alpha_threshold(128);
+		rasterizer_gpu.set_rop_state(BlendState::Replace);
+		break;
+
+	case DrawPipeline::AlphaBlend:
+		rasterizer_gpu.set_alpha_threshold(0);
+		rasterizer_gpu.set_rop_state(BlendState::Alpha);
+		break;
+	}
+
+	if (queue_dump_frame)
+		dump_pipeline_state(pipeline);
+}
+
 static void transform_vertex(Vertex &out_vertex, const Vertex &in_vertex, const mat4 &mvp, const mat3 &normal_matrix)
 {
 	vec3 n = vec3(in_vertex.color[0], in_vertex.color[1], in_vertex.color[2]);
@@ -377,6 +571,7 @@ static void transform_vertex(Vertex &out_vertex, const Vertex &in_vertex, const
 
 void SWRenderApplication::render_frame(double frame_time, double)
 {
+	TraceScope frame_scope(trace_recorder.get(), "frame");
 	auto &device = get_wsi().get_device();
 	auto &scene = loader.get_scene();
 	scene.update_all_transforms();
@@ -384,10 +579,13 @@ void SWRenderApplication::render_frame(double frame_time, double)
 	rasterizer_gpu.clear_color();
 	rasterizer_gpu.clear_depth();
 
+	if ((!capture_prefix.empty() || !sequence_path.empty()) && !capture_stopped)
+		queue_dump_frame = true;
+
 	mat4 vp = cam.get_projection() * cam.get_view();
 	ViewportTransform viewport_transform = { -0.5f, -0.5f, float(fb_width), float(fb_height), 0.0f, 1.0f };
 	InputPrimitive input = {};
-	PrimitiveSetup setups[256];
+	PrimitiveSetup setups[MAX_SETUPS_PER_TRIANGLE];
 
 	auto renderables = scene.get_entity_pool().get_component_group<RenderableComponent, SoftwareRenderableComponent, RenderInfoComponent>();
 
@@ -411,6 +609,19 @@ void SWRenderApplication::render_frame(double frame_time, double)
 	}
 
 	if (update_setup_cache)
+		frozen_display_list.reset();
+
+	// The first frozen frame is recorded into a display list, later frames only replay it.
+	// Dumping still needs to go through the individual primitives, which requires CPU setup.
+	bool gpu_setup_frame = gpu_setup && !queue_dump_frame;
+	bool replay_display_list = frozen_display_list && !queue_dump_frame;
+	bool record_display_list = !update_setup_cache && !frozen_display_list;
+	bool process_renderables = update_setup_cache || (!replay_display_list && (gpu_setup_frame || setup_cache.empty()));
+
+	if (record_display_list)
+		rasterizer_gpu.begin_display_list();
+
+	if (process_renderables)
 	{
 		setup_cache.clear();
 		for (auto &renderable : renderables)
@@ -430,9 +641,38 @@ void SWRenderApplication::render_frame(double frame_time, double)
 			auto pipeline = static_mesh->material->pipeline;
 
 			size_t vertex_count = sw->vertices.size();
-			for (size_t i = 0; i < vertex_count; i++)
-				transform_vertex(sw->transformed_vertices[i], sw->vertices[i], mvp, n);
+			{
+				TraceScope scope(trace_recorder.get(), "vertex-transform");
+				for (size_t i = 0; i < vertex_count; i++)
+					transform_vertex(sw->transformed_vertices[i], sw->vertices[i], mvp, n);
+			}
 
+			if (gpu_setup_frame)
+			{
+				if (sw->indices.empty())
+					continue;
+
+				static_assert(sizeof(uvec3) == 3 * sizeof(uint32_t), "Indices must be tightly packed.");
+				auto cull_mode = two_sided ? CullMode::None : CullMode::CCWOnly;
+				auto *indices = sw->indices.front().data;
+				if (queue_validate_gpu_setup)
+				{
+					size_t mismatches = rasterizer_gpu.validate_triangle_setup(
+							sw->transformed_vertices.data(), vertex_count, indices, sw->indices.size(),
+							cull_mode, viewport_transform);
+					LOGI("GPU triangle setup: %u / %u triangles mismatch.\n", unsigned(mismatches), unsigned(sw->indices.size()));
+				}
+
+				TraceScope scope(trace_recorder.get(), "staging");
+				apply_pipeline_state(pipeline);
+				rasterizer_gpu.set_texture_descriptor(texture_descriptors[sw->state_index]);
+				rasterizer_gpu.rasterize_triangles(sw->transformed_vertices.data(), vertex_count,
+				                                   indices, sw->indices.size(),
+				                                   cull_mode, viewport_transform);
+				continue;
+			}
+
+			TraceScope scope(trace_recorder.get(), "triangle-setup");
 			for (auto &primitive : sw->indices)
 			{
 				input.vertices[0] = sw->transformed_vertices[primitive.x];
@@ -459,53 +699,56 @@ void SWRenderApplication::render_frame(double frame_time, double)
 	else
 		LOGI("Cached %u primitive setups!\n", unsigned(setup_cache.size()));
 
-	for (auto &setup : setup_cache)
+	if (!replay_display_list && !gpu_setup_frame)
 	{
-		if (queue_dump_frame)
-			dump_set_texture(setup.index);
-
-		auto pipeline = setup.pipeline;
-		switch (pipeline)
+		TraceScope scope(trace_recorder.get(), "staging");
+		for (auto &setup : setup_cache)
 		{
-		case DrawPipeline::Opaque:
-			rasterizer_gpu.set_alpha_threshold(0);
-			rasterizer_gpu.set_rop_state(BlendState::Replace);
 			if (queue_dump_frame)
-			{
-				dump_alpha_threshold(0);
-				dump_rop_state(BlendState::Replace);
-			}
-			break;
+				dump_set_texture(setup.index);
 
-		case DrawPipeline::AlphaTest:
-			rasterizer_gpu.set_alpha_threshold(128);
-			rasterizer_gpu.set_rop_state(BlendState::Replace);
+			apply_pipeline_state(setup.pipeline);
+			rasterizer_gpu.set_texture_descriptor(texture_descriptors[setup.index]);
+			rasterizer_gpu.rasterize_primitives(&setup.setup, 1);
 			if (queue_dump_frame)
-			{
-				dump_alpha_threshold(128);
-				dump_rop_state(BlendState::Replace);
-			}
-			break;
-
-		case DrawPipeline::AlphaBlend:
-			rasterizer_gpu.set_alpha_threshold(0);
-			rasterizer_gpu.set_rop_state(BlendState::Alpha);
-			if (queue_dump_frame)
-			{
-				dump_alpha_threshold(0);
-				dump_rop_state(BlendState::Alpha);
-			}
-			break;
+				dump_primitives(&setup.setup, 1);
 		}
+	}
+
+	if (queue_dump_frame && dump_clip_space && dump_data)
+	{
+		// Transformed vertices are left over from when setup_cache was last built, so they match the dumped primitives.
+		for (auto &renderable : renderables)
+		{
+			auto *sw = get_component<SoftwareRenderableComponent>(renderable);
+			auto *static_mesh = dynamic_cast<ImportedMesh *>(get_component<RenderableComponent>(renderable)->renderable.get());
+			if (!static_mesh || sw->indices.empty())
+				continue;
 
-		rasterizer_gpu.set_texture_descriptor(texture_descriptors[setup.index]);
-		rasterizer_gpu.rasterize_primitives(&setup.setup, 1);
-		if (queue_dump_frame)
-			dump_primitives(&setup.setup, 1);
+			dump_set_texture(sw->state_index);
+			dump_pipeline_state(static_mesh->material->pipeline);
+			dump_data->add_mesh(dump_state, static_mesh->material->two_sided ? CullMode::None : CullMode::CCWOnly,
+			                    sw->transformed_vertices.data(), sw->transformed_vertices.size(),
+			                    sw->indices.front().data, sw->indices.size() * 3);
+		}
+		dump_data->set_viewport(viewport_transform);
 	}
 
+	if (record_display_list)
+		frozen_display_list = rasterizer_gpu.end_display_list();
+	if (frozen_display_list && (record_display_list || replay_display_list))
+		rasterizer_gpu.replay(*frozen_display_list);
+
 	auto image_gpu = rasterizer_gpu.copy_to_framebuffer();
 
+	if (!record_prefix.empty())
+	{
+		char frame_suffix[32];
+		snprintf(frame_suffix, sizeof(frame_suffix), ".%06u.png", record_frame_index++);
+		rasterizer_gpu.request_readback_png((record_prefix + frame_suffix).c_str());
+	}
+	rasterizer_gpu.poll_readbacks();
+
 	auto cmd = device.request_command_buffer();
 	cmd->begin_render_pass(device.get_swapchain_render_pass(Vulkan::SwapchainRenderPass::ColorOnly));
 	cmd->set_texture(0, 0, image_gpu->get_view(), Vulkan::StockSampler::LinearClamp);
@@ -516,6 +759,7 @@ void SWRenderApplication::render_frame(double frame_time, double)
 	if (queue_dump_frame)
 		end_dump_frame();
 	queue_dump_frame = false;
+	queue_validate_gpu_setup = false;
 
 	LOGI("Frame time: %.3f ms\n", 1000.0 * frame_time);
 }
@@ -524,21 +768,34 @@ namespace Granite
 {
 Application *application_create(int argc, char **argv)
 {
-	bool ubershader = false;
+	PipelineMode pipeline_mode = PipelineMode::Split;
 	bool subgroup = true;
 	bool async_compute = false;
+	bool gpu_setup = false;
 	std::string path;
 	unsigned width = 640;
 	unsigned height = 360;
 	unsigned tile_size = 8;
+	std::string record_prefix;
+	std::string capture_prefix;
+	std::string sequence_path;
+	bool dump_clip_space = false;
+	std::string trace_path;
 
 	Util::CLICallbacks cbs;
-	cbs.add("--ubershader", [&](Util::CLIParser &) { ubershader = true; });
+	cbs.add("--ubershader", [&](Util::CLIParser &) { pipeline_mode = PipelineMode::Ubershader; });
+	cbs.add("--auto-pipeline", [&](Util::CLIParser &) { pipeline_mode = PipelineMode::Auto; });
 	cbs.add("--nosubgroup", [&](Util::CLIParser &) { subgroup = false; });
 	cbs.add("--async-compute", [&](Util::CLIParser &) { async_compute = true; });
+	cbs.add("--gpu-setup", [&](Util::CLIParser &) { gpu_setup = true; });
 	cbs.add("--width", [&](Util::CLIParser &parser) { width = parser.next_uint(); });
 	cbs.add("--height", [&](Util::CLIParser &parser) { height = parser.next_uint(); });
 	cbs.add("--tile-size", [&](Util::CLIParser &parser) { tile_size = parser.next_uint(); });
+	cbs.add("--record", [&](Util::CLIParser &parser) { record_prefix = parser.next_string(); });
+	cbs.add("--capture", [&](Util::CLIParser &parser) { capture_prefix = parser.next_string(); });
+	cbs.add("--capture-sequence", [&](Util::CLIParser &parser) { sequence_path = parser.next_string(); });
+	cbs.add("--dump-clip-space", [&](Util::CLIParser &) { dump_clip_space = true; });
+	cbs.add("--trace", [&](Util::CLIParser &parser) { trace_path = parser.next_string(); });
 	cbs.default_handler = [&](const char *arg) { path = arg; };
 	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
@@ -554,7 +811,13 @@ Application *application_create(int argc, char **argv)
 		return nullptr;
 	}
 
+	if (dump_clip_space && !sequence_path.empty())
+	{
+		LOGE("Sequences only store primitives after triangle setup, --dump-clip-space is not supported.\n");
+		return nullptr;
+	}
+
 	GRANITE_FILESYSTEM()->register_protocol("assets", std::make_unique<OSFilesystem>(ASSET_DIRECTORY));
-	return new SWRenderApplication(path, subgroup, ubershader, async_compute, width, height, tile_size);
+	return new SWRenderApplication(path, subgroup, pipeline_mode, async_compute, gpu_setup, width, height, tile_size, record_prefix, capture_prefix, sequence_path, dump_clip_space, trace_path);
 }
 }
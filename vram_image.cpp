@@ -0,0 +1,69 @@
+#include "vram_image.hpp"
+#include <string.h>
+#include <stdio.h>
+
+namespace RetroWarp
+{
+static const char VRAM_IMAGE_MAGIC[] = "RETROWARP VRAM01";
+static const uint32_t VRAM_IMAGE_ALIGNMENT = 64;
+static_assert(sizeof(TextureDescriptor) == 48, "TextureDescriptor layout is part of the file format.");
+
+static uint64_t get_data_offset(uint64_t num_descriptors)
+{
+	uint64_t offset = sizeof(VRAMImageHeader) + num_descriptors * sizeof(TextureDescriptor);
+	return (offset + VRAM_IMAGE_ALIGNMENT - 1) & ~uint64_t(VRAM_IMAGE_ALIGNMENT - 1);
+}
+
+bool parse_vram_image(VRAMImageView &view, const void *data, size_t size)
+{
+	auto *blob = static_cast<const uint8_t *>(data);
+	if (size < sizeof(VRAMImageHeader) || memcmp(blob, VRAM_IMAGE_MAGIC, 16) != 0)
+		return false;
+	if ((uintptr_t(blob) % alignof(TextureDescriptor)) != 0)
+		return false;
+
+	VRAMImageHeader header;
+	memcpy(&header, blob, sizeof(header));
+	if (header.data_offset != get_data_offset(header.num_descriptors))
+		return false;
+	if (header.data_offset > size || header.vram_size > size - header.data_offset)
+		return false;
+
+	view = {};
+	view.vram_offset = header.vram_offset;
+	view.vram = blob + header.data_offset;
+	view.vram_size = header.vram_size;
+	view.descriptors = reinterpret_cast<const TextureDescriptor *>(blob + sizeof(VRAMImageHeader));
+	view.num_descriptors = header.num_descriptors;
+	return true;
+}
+
+bool write_vram_image(const char *path, const VRAMImageView &view)
+{
+	VRAMImageHeader header = {};
+	memcpy(header.magic, VRAM_IMAGE_MAGIC, sizeof(header.magic));
+	header.vram_offset = view.vram_offset;
+	header.vram_size = uint32_t(view.vram_size);
+	header.num_descriptors = uint32_t(view.num_descriptors);
+	header.data_offset = uint32_t(get_data_offset(view.num_descriptors));
+
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (ok && view.num_descriptors)
+		ok = fwrite(view.descriptors, sizeof(TextureDescriptor), view.num_descriptors, file) == view.num_descriptors;
+
+	static const uint8_t zero_padding[VRAM_IMAGE_ALIGNMENT] = {};
+	size_t padding = header.data_offset - (sizeof(header) + view.num_descriptors * sizeof(TextureDescriptor));
+	if (ok && padding)
+		ok = fwrite(zero_padding, 1, padding, file) == padding;
+	if (ok && view.vram_size)
+		ok = fwrite(view.vram, view.vram_size, 1, file) == 1;
+
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+}
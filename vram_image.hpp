@@ -0,0 +1,37 @@
+#pragma once
+
+#include "rasterizer_gpu.hpp"
+#include <stdint.h>
+#include <stddef.h>
+
+namespace RetroWarp
+{
+// Snapshot of the textures a dump was captured with, "RETROWARP VRAM01", stored as <texture base>.vram.
+//
+// VRAMImageHeader is followed by num_descriptors TextureDescriptor, indexed by DumpRenderState::texture_index.
+// At data_offset, which is 64 byte aligned, follow vram_size bytes of VRAM starting at vram_offset.
+// VRAM is stored after swizzling and format conversion, so all textures are restored with one write_vram().
+struct VRAMImageHeader
+{
+	char magic[16];
+	uint32_t vram_offset;
+	uint32_t vram_size;
+	uint32_t num_descriptors;
+	uint32_t data_offset;
+};
+
+// Non-owning, points into a memory mapped file.
+struct VRAMImageView
+{
+	uint32_t vram_offset = 0;
+	const void *vram = nullptr;
+	size_t vram_size = 0;
+
+	const TextureDescriptor *descriptors = nullptr;
+	size_t num_descriptors = 0;
+};
+
+// Zero-copy, the view points into data, which must stay alive and be at least 4 byte aligned.
+bool parse_vram_image(VRAMImageView &view, const void *data, size_t size);
+bool write_vram_image(const char *path, const VRAMImageView &view);
+}